@@ -12,17 +12,36 @@ tiny/
     encoder.pt     # Multilingual encoder
     decoder.en.pt  # English decoder
     decoder.pt     # Multilingual decoder
+    decoder.en.bin # English decoder weights for the native decoder
+    decoder.bin    # Multilingual decoder weights for the native decoder
 
 This format allows capgen app to select english models for english->english transcription
 and multilingual models for other->other transcription or other->english translation without
 user input. In this design, the user does not need to know about model details.
+
+Passing `--quantize int8` exports a variant of the model whose linear layers are dynamically
+quantized to int8. Its zip file is named after the variant, e.g `small-int8.zip`, and should be
+extracted to `assets/models/small-int8/` where the app lists it alongside the other models.
+Quantized variants use the scripted decoder only.
+
+Passing `--dtype bf16` (or `fp16`) exports a variant, e.g `small-bf16`, whose weight matrices are
+stored in that dtype, which halves the size of the model in memory. The weights are converted
+to fp32 when they are used so all the arithmetic is still done in fp32. Its decoder weights
+file also stores the weight matrices in that dtype.
+
+Passing `--format mmap` exports a variant, e.g `small-mmap`, whose scripted modules hold no
+weights. The weights of the encoder are saved to `encoder(.en).bin` and the weights of the
+decoder to `decoder(.en).bin`, which the app maps into memory rather than reading. The pages of
+the weights are then loaded on demand and shared by all the processes that load the model.
 """
 
 
 import argparse
+import struct
 import zipfile
 from dataclasses import dataclass
 from pathlib import Path
+from typing import Optional
 
 import torch
 import torch.nn as nn
@@ -45,6 +64,44 @@ class ModelDimensions:
     n_text_layer: int = None  # Number of blocks in the decoder.
 
 
+# Number of queries whose attention scores are computed at a time. It bounds the size of the
+# scores to [n_batch, n_head, ATTENTION_CHUNK_SIZE, kv_ctx] instead of [n_batch, n_head, q_ctx, kv_ctx],
+# e.g 1500x1500 per head in the encoder.
+ATTENTION_CHUNK_SIZE = 256
+
+
+def qkv_attention(q, k, v, n_head: int, mask: Optional[torch.Tensor] = None):
+    n_batch, q_ctx, n_state = q.shape[0], q.shape[1], q.shape[2]
+    kv_ctx = k.shape[1]
+    d_head = n_state // n_head
+    # The scale is applied once, to the queries, rather than to both the queries and the keys.
+    q = q.view(n_batch, q_ctx, n_head, d_head).permute(0, 2, 1, 3) * (d_head ** -0.5)
+    k = k.view(n_batch, kv_ctx, n_head, d_head).permute(0, 2, 3, 1)
+    v = v.view(n_batch, kv_ctx, n_head, d_head).permute(0, 2, 1, 3)
+    chunks = []
+    for start in range(0, q_ctx, ATTENTION_CHUNK_SIZE):
+        end = min(start + ATTENTION_CHUNK_SIZE, q_ctx)
+        qk = q[:, :, start:end] @ k
+        if mask is not None:
+            qk = qk + mask[start:end, :kv_ctx]
+        chunks.append(F.softmax(qk, dim=-1) @ v)
+    qkv = torch.cat(chunks, dim=2)
+    qkv = qkv.permute(0, 2, 1, 3).flatten(start_dim=2)
+    return qkv
+
+
+def fuse_projections(state_dict, prefix, names, fused_name):
+    """Replaces the parameters of the linear layers `names` in a checkpoint state dict with the
+    parameters of the single linear layer `fused_name` whose output is their concatenated outputs.
+    The key projections have no bias so they get a zero bias."""
+    if f"{prefix}{names[0]}.weight" not in state_dict:
+        return
+    weights = [state_dict.pop(f"{prefix}{name}.weight") for name in names]
+    biases = [state_dict.pop(f"{prefix}{name}.bias", torch.zeros(weight.shape[0])) for name, weight in zip(names, weights)]
+    state_dict[f"{prefix}{fused_name}.weight"] = torch.cat(weights)
+    state_dict[f"{prefix}{fused_name}.bias"] = torch.cat(biases)
+
+
 class MultiHeadSelfAttention(nn.Module):
     def __init__(self, n_head, n_state):
         super().__init__()
@@ -52,32 +109,19 @@ class MultiHeadSelfAttention(nn.Module):
         self.n_head = n_head
         self.n_state = n_state
         self.d_head = n_state // n_head
-        self.query = nn.Linear(n_state, n_head * self.d_head)
-        self.key = nn.Linear(n_state, n_head * self.d_head, bias=False)
-        self.value = nn.Linear(n_state, n_head * self.d_head)
+        # Query, key and value projections computed by a single matrix multiplication.
+        self.qkv = nn.Linear(n_state, 3 * n_head * self.d_head)
         self.out = nn.Linear(n_head * self.d_head, n_state)
         
-    def forward(self, x, mask=None):
-        q = self.query(x)
-        k = self.key(x)
-        v = self.value(x)
-        qkv = self._qkv_attention(q, k, v, mask)
+    def forward(self, x, mask: Optional[torch.Tensor] = None):
+        q, k, v = self.qkv(x).chunk(3, dim=-1)
+        qkv = qkv_attention(q, k, v, self.n_head, mask)
         out = self.out(qkv)
         return out
-    
-    def _qkv_attention(self, q, k, v, mask=None):
-        n_batch, ctx = q.shape[0], q.shape[1]
-        scale = self.d_head ** -0.25
-        q = q.view(n_batch, ctx, self.n_head, self.d_head).permute(0, 2, 1, 3) * scale
-        k = k.view(n_batch, ctx, self.n_head, self.d_head).permute(0, 2, 3, 1) * scale
-        v = v.view(n_batch, ctx, self.n_head, self.d_head).permute(0, 2, 1, 3)
-        qk = q @ k
-        if mask is not None:
-            qk += mask[:ctx, :ctx]
-        qk = F.softmax(qk, dim=-1)
-        qkv = qk @ v
-        qkv = qkv.permute(0, 2, 1, 3).flatten(start_dim=2)
-        return qkv
+
+    def _load_from_state_dict(self, state_dict, prefix, *args, **kwargs):
+        fuse_projections(state_dict, prefix, ["query", "key", "value"], "qkv")
+        super()._load_from_state_dict(state_dict, prefix, *args, **kwargs)
     
 
 class MultiHeadCrossAttention(nn.Module):
@@ -88,8 +132,8 @@ class MultiHeadCrossAttention(nn.Module):
         self.n_state = n_state
         self.d_head = n_state // n_head
         self.query = nn.Linear(n_state, n_head * self.d_head)
-        self.key = nn.Linear(n_state, n_head * self.d_head, bias=False)
-        self.value = nn.Linear(n_state, n_head * self.d_head)
+        # Key and value projections computed by a single matrix multiplication.
+        self.kv = nn.Linear(n_state, 2 * n_head * self.d_head)
         self.out = nn.Linear(n_head * self.d_head, n_state)
 
         # NOTE: We use zeros instead of None so that torch script knows that
@@ -103,25 +147,17 @@ class MultiHeadCrossAttention(nn.Module):
         q = self.query(x)
         # The inequality operator on tensors will work because both tensors are singletons.
         if cache_idx != self.cache_idx:
-            self.k_cache = self.key(xa)
-            self.v_cache = self.value(xa)
+            k, v = self.kv(xa).chunk(2, dim=-1)
+            self.k_cache = k
+            self.v_cache = v
             self.cache_idx = cache_idx
-        qkv = self._qkv_attention(q, self.k_cache, self.v_cache)
+        qkv = qkv_attention(q, self.k_cache, self.v_cache, self.n_head)
         out = self.out(qkv)
         return out
-    
-    def _qkv_attention(self, q, k, v):
-        n_batch, q_ctx = q.shape[0], q.shape[1]
-        kv_ctx = k.shape[1]
-        scale = self.d_head ** -0.25
-        q = q.view(n_batch, q_ctx, self.n_head, self.d_head).permute(0, 2, 1, 3) * scale
-        k = k.view(n_batch, kv_ctx, self.n_head, self.d_head).permute(0, 2, 3, 1) * scale
-        v = v.view(n_batch, kv_ctx, self.n_head, self.d_head).permute(0, 2, 1, 3)
-        qk = q @ k
-        qk = F.softmax(qk, dim=-1)
-        qkv = qk @ v
-        qkv = qkv.permute(0, 2, 1, 3).flatten(start_dim=2)
-        return qkv
+
+    def _load_from_state_dict(self, state_dict, prefix, *args, **kwargs):
+        fuse_projections(state_dict, prefix, ["key", "value"], "kv")
+        super()._load_from_state_dict(state_dict, prefix, *args, **kwargs)
 
 
 class ResidualAttentionBlockEncoder(nn.Module):
@@ -261,7 +297,121 @@ class Whisper(nn.Module):
     def is_multilingual(self):
         return self.dims.n_vocab == 51865
 
-def export_model(model_path, is_en: bool):
+# Weights file format, read by src/core/weights.cpp:
+#   magic "CGWT", u32 version, u32 number of tensors,
+#   for each tensor: u32 name length, name, u32 dtype, u32 ndim, i64 dims[ndim], u64 data offset,
+#   followed by the data of the tensors. All values are little-endian. The dtype is one of the
+#   DTYPE_* codes below. The data of every tensor starts at a multiple of WEIGHTS_ALIGNMENT so
+#   that the file can be memory-mapped and the tensors used in place.
+WEIGHTS_MAGIC = b"CGWT"
+# Version 3 holds the fused attention projections, e.g `attn.qkv.weight`.
+WEIGHTS_VERSION = 3
+WEIGHTS_ALIGNMENT = 4096
+DTYPE_F32 = 0
+DTYPE_F16 = 1
+DTYPE_BF16 = 2
+
+WEIGHTS_DTYPES = {"fp16": torch.float16, "bf16": torch.bfloat16}
+WEIGHTS_DTYPE_CODES = {torch.float32: DTYPE_F32, torch.float16: DTYPE_F16, torch.bfloat16: DTYPE_BF16}
+
+
+def align(offset):
+    return (offset + WEIGHTS_ALIGNMENT - 1) // WEIGHTS_ALIGNMENT * WEIGHTS_ALIGNMENT
+
+
+def save_weights(module, path):
+    """Saves the parameters and buffers of the module, in the dtypes they are stored in."""
+    tensors = [(name, tensor.detach().contiguous()) for name, tensor in module.state_dict().items()]
+    index_size = 12
+    for name, tensor in tensors:
+        index_size += 4 + len(name.encode()) + 4 + 4 + 8 * tensor.dim() + 8
+    with open(path, "wb") as f:
+        f.write(WEIGHTS_MAGIC)
+        f.write(struct.pack("<II", WEIGHTS_VERSION, len(tensors)))
+        offsets = []
+        offset = align(index_size)
+        for name, tensor in tensors:
+            name_bytes = name.encode()
+            f.write(struct.pack("<I", len(name_bytes)))
+            f.write(name_bytes)
+            f.write(struct.pack("<II", WEIGHTS_DTYPE_CODES[tensor.dtype], tensor.dim()))
+            f.write(struct.pack(f"<{tensor.dim()}q", *tensor.shape))
+            f.write(struct.pack("<Q", offset))
+            offsets.append(offset)
+            offset = align(offset + tensor.numel() * tensor.element_size())
+        for (_, tensor), offset in zip(tensors, offsets):
+            f.seek(offset)
+            # Numpy has no bfloat16 so the 16-bit tensors are written as their raw bits.
+            if tensor.dtype == torch.float32:
+                f.write(tensor.numpy().astype("<f4").tobytes())
+            else:
+                f.write(tensor.view(torch.int16).numpy().astype("<i2").tobytes())
+
+
+def strip_weights(module):
+    """Replaces the parameters and buffers of a scripted module with empty tensors. The app
+    sets them to the tensors of the weights file when it loads the module."""
+    for name, _ in list(module.named_parameters()) + list(module.named_buffers()):
+        *path, attr = name.split(".")
+        submodule = module
+        for part in path:
+            submodule = getattr(submodule, part)
+        submodule._c.setattr(attr, torch.empty(0))
+
+
+def quantize_linear_layers(module):
+    """Dynamically quantizes all the linear layers, i.e the attention projections and the MLPs.
+    Their weights are stored as int8 and their inputs are quantized on the fly."""
+    return torch.quantization.quantize_dynamic(module, {nn.Linear}, dtype=torch.qint8)
+
+
+class LowPrecisionLinear(nn.Module):
+    """A linear layer whose weight is stored in a reduced precision dtype and converted to fp32
+    when the layer is called. Only the weight of the running layer is held in fp32, so the
+    resident weights stay in the reduced precision."""
+    def __init__(self, linear, dtype):
+        super().__init__()
+        self.weight = nn.Parameter(linear.weight.detach().to(dtype), requires_grad=False)
+        # Layers without a bias get a zero bias so that the bias is always a tensor. Biases are
+        # small and are kept in fp32.
+        bias = linear.bias if linear.bias is not None else torch.zeros(linear.out_features)
+        self.bias = nn.Parameter(bias.detach().float(), requires_grad=False)
+
+    def forward(self, x):
+        return F.linear(x, self.weight.float(), self.bias)
+
+
+class LowPrecisionConv1d(nn.Module):
+    """A convolution whose weight is stored in a reduced precision dtype and converted to fp32
+    when the layer is called, like `LowPrecisionLinear`."""
+    def __init__(self, conv, dtype):
+        super().__init__()
+        self.stride = conv.stride[0]
+        self.padding = conv.padding[0]
+        self.weight = nn.Parameter(conv.weight.detach().to(dtype), requires_grad=False)
+        self.bias = nn.Parameter(conv.bias.detach().float(), requires_grad=False)
+
+    def forward(self, x):
+        return F.conv1d(x, self.weight.float(), self.bias, stride=self.stride, padding=self.padding)
+
+
+def reduce_weights_precision(module, dtype):
+    """Replaces the linear and convolution layers of the module with layers that store their
+    weights in `dtype`. Layer norms are small and are kept in fp32."""
+    for name, child in module.named_children():
+        if isinstance(child, nn.Linear):
+            setattr(module, name, LowPrecisionLinear(child, dtype))
+        elif isinstance(child, nn.Conv1d):
+            setattr(module, name, LowPrecisionConv1d(child, dtype))
+        elif isinstance(child, nn.Embedding):
+            # The decoder converts the embeddings and the logits projection to fp32.
+            child.weight.data = child.weight.data.to(dtype)
+        else:
+            reduce_weights_precision(child, dtype)
+    return module
+
+
+def export_model(model_path, is_en: bool, quantize=None, dtype=None, mmap=False):
     print(f"Exporting {model_path}")
     model_name = Path(model_path).stem
     with open(model_path, "rb") as fp:
@@ -276,12 +426,27 @@ def export_model(model_path, is_en: bool):
     # Disable grad tracking
     for param in encoder.parameters():
         param.requires_grad = False
+    if quantize == "int8":
+        encoder = quantize_linear_layers(encoder)
+    if dtype:
+        encoder = reduce_weights_precision(encoder, WEIGHTS_DTYPES[dtype])
+    # Freezing would fold the conversions of the reduced precision weights to fp32 into fp32
+    # constants, so such variants are saved unfrozen. Freezing would also embed the weights
+    # of the memory-mapped variants into the modules.
+    freeze = dtype is None and not mmap
 
     dummy_input = torch.randn((1, 80, 3000))
     # For encoder, trace because we don't use cache or masking if statements.
     encoder_module = torch.jit.trace(encoder, example_inputs=dummy_input)
-    encoder_module = torch.jit.freeze(encoder_module)
+    if freeze:
+        encoder_module = torch.jit.freeze(encoder_module)
     encoder_save_path = "encoder.en.pt" if is_en else "encoder.pt"
+    exported = [encoder_save_path]
+    if mmap:
+        encoder_weights_save_path = "encoder.en.bin" if is_en else "encoder.bin"
+        save_weights(encoder, encoder_weights_save_path)
+        strip_weights(encoder_module)
+        exported.append(encoder_weights_save_path)
     encoder_module.save(encoder_save_path)
 
     # DECODER
@@ -290,26 +455,45 @@ def export_model(model_path, is_en: bool):
     # Disable grad tracking
     for param in decoder.parameters():
         param.requires_grad = False
+    if quantize == "int8":
+        decoder = quantize_linear_layers(decoder)
+    if dtype:
+        decoder = reduce_weights_precision(decoder, WEIGHTS_DTYPES[dtype])
+    # The native decoder cannot run quantized weights.
+    if quantize is None:
+        decoder_weights_save_path = "decoder.en.bin" if is_en else "decoder.bin"
+        save_weights(decoder, decoder_weights_save_path)
+        exported.append(decoder_weights_save_path)
 
     dummy_x = torch.randint(0, model.dims.n_vocab, (1, 10), requires_grad=False)
     dummy_xa = torch.randn((1, 1500, 384), requires_grad=False)
     dummy_cache_idx = torch.tensor(0, requires_grad=False)
     # Script due to if statements.
     decoder_module = torch.jit.script(decoder, example_inputs=(dummy_x, dummy_xa, dummy_cache_idx))
-    decoder_module = torch.jit.freeze(decoder_module)
+    if freeze:
+        decoder_module = torch.jit.freeze(decoder_module)
+    if mmap:
+        strip_weights(decoder_module)
     decoder_save_path = "decoder.en.pt" if is_en else "decoder.pt"
     decoder_module.save(decoder_save_path)
     print(f"Completed Exporting {model_path}")
-    return [encoder_save_path, decoder_save_path]
+    exported.append(decoder_save_path)
+    return exported
 
 
-def export(en_model_path, ml_model_path):  # ml -> multilingual
-    exported = export_model(en_model_path, is_en=True)
-    exported.extend(export_model(ml_model_path, is_en=False))
+def export(en_model_path, ml_model_path, quantize=None, dtype=None, mmap=False):  # ml -> multilingual
+    exported = export_model(en_model_path, is_en=True, quantize=quantize, dtype=dtype, mmap=mmap)
+    exported.extend(export_model(ml_model_path, is_en=False, quantize=quantize, dtype=dtype, mmap=mmap))
     print()
     print("ZIP compression started")
 
     model_name = Path(ml_model_path).stem
+    if quantize:
+        model_name = f"{model_name}-{quantize}"
+    elif dtype:
+        model_name = f"{model_name}-{dtype}"
+    if mmap:
+        model_name = f"{model_name}-mmap"
     with zipfile.ZipFile(f"{model_name}.zip", 'w') as outzip:
         for exported_path in exported:
             print(f"Compressing {exported_path} ...")
@@ -320,5 +504,12 @@ def export(en_model_path, ml_model_path):  # ml -> multilingual
 parser = argparse.ArgumentParser()
 parser.add_argument("en_modelpath", help="path to the English model to be converted.")
 parser.add_argument("ml_modelpath", help="path to the Multilingual model to be converted.")
+variant_group = parser.add_mutually_exclusive_group()
+variant_group.add_argument("--quantize", choices=["int8"], default=None, help="export a quantized variant of the model.")
+variant_group.add_argument("--dtype", choices=list(WEIGHTS_DTYPES), default=None, help="export a variant of the model whose weights are stored in this dtype.")
+parser.add_argument("--format", choices=["torchscript", "mmap"], default="torchscript", help="save the weights in the scripted modules or in memory-mapped weights files.")
 args = parser.parse_args()
-export(args.en_modelpath, args.ml_modelpath)
+if args.quantize and args.format == "mmap":
+    # Quantized weights are packed into the quantized operators rather than held as tensors.
+    parser.error("--quantize cannot be used with --format mmap")
+export(args.en_modelpath, args.ml_modelpath, quantize=args.quantize, dtype=args.dtype, mmap=args.format == "mmap")
@@ -0,0 +1,174 @@
+"""
+Compares the speed and accuracy of exported model variants against a reference model, e.g
+the int8 quantized `small-int8` against `small`. For every model it reports the time the encoder
+takes per 30-second window, the time the decoder takes per token, the size of the model files
+and the word error rate of its transcript against the transcript of the reference model.
+
+With `--tempo`, every model also transcribes the audio sped up by each of the given factors with
+FFmpeg's atempo filter, the same filter the app uses for `DecodingOptions::tempo`, and the total
+transcription time shows the speed/accuracy trade-off of each tempo. The reference transcript is
+that of the first model at the first tempo.
+
+The models are run exactly as the app runs them, i.e the scripted modules in
+`assets/models/<name>/`, with greedy decoding. The audio must be a 16kHz mono 16-bit WAV file,
+which can be created from any media file with:
+
+    ffmpeg -i input.mp4 -ar 16000 -ac 1 -c:a pcm_s16le audio.wav
+
+Usage:
+
+    python model_benchmark.py audio.wav small small-int8
+    python model_benchmark.py audio.wav small --tempo 1.0 1.25 1.5
+"""
+
+
+import argparse
+import subprocess
+import tempfile
+import time
+import wave
+from pathlib import Path
+
+import numpy as np
+import torch
+
+
+N_FRAMES = 3000  # Number of spectrogram frames in a 30-second window.
+N_TEXT_CTX = 224
+
+# Special tokens of the English and multilingual vocabularies.
+ENGLISH_TOKENS = {"sot": 50257, "eot": 50256, "no_timestamps": 50362}
+MULTILINGUAL_TOKENS = {"sot": 50258, "eot": 50257, "transcribe": 50359, "no_timestamps": 50363}
+
+
+def load_audio(path):
+    with wave.open(str(path), "rb") as f:
+        if f.getframerate() != 16000 or f.getnchannels() != 1 or f.getsampwidth() != 2:
+            raise ValueError("Expected a 16kHz mono 16-bit WAV file.")
+        samples = np.frombuffer(f.readframes(f.getnframes()), dtype=np.int16)
+    audio = torch.from_numpy(samples.astype(np.float32))
+    return audio / audio.max()
+
+
+def change_tempo(path, tempo):
+    """Speeds up the audio with FFmpeg's pitch-preserving atempo filter."""
+    with tempfile.NamedTemporaryFile(suffix=".wav") as f:
+        subprocess.run(
+            ["ffmpeg", "-y", "-loglevel", "error", "-i", str(path), "-filter:a", f"atempo={tempo}",
+             "-ar", "16000", "-ac", "1", "-c:a", "pcm_s16le", f.name],
+            check=True,
+        )
+        return load_audio(f.name)
+
+
+def log_mel_spectrogram(audio, assets_dir):
+    """Same computation as `AudioPreprocessor::get_audio_spectrogram`."""
+    filters = np.fromfile(assets_dir / "mel_80", dtype=np.float32, count=80 * 201)
+    filters = torch.from_numpy(filters).view(80, 201)
+    window = torch.hann_window(400)
+    stft = torch.stft(audio, 400, 160, window=window, center=True, return_complex=True)
+    magnitudes = stft[:, :-1].abs() ** 2
+    log_spec = torch.clamp(filters @ magnitudes, min=1e-10).log10()
+    log_spec = torch.maximum(log_spec, log_spec.max() - 8.0)
+    return ((log_spec + 4.0) / 4.0).unsqueeze(0)
+
+
+def load_vocab(path):
+    with open(path, "rb") as f:
+        return [word.decode("utf-8", errors="replace") for word in f.read().split(b"\n")]
+
+
+def model_size_mb(model_dir, is_en):
+    suffix = ".en.pt" if is_en else ".pt"
+    paths = [model_dir / f"encoder{suffix}", model_dir / f"decoder{suffix}"]
+    return sum(p.stat().st_size for p in paths) / 1e6
+
+
+def transcribe(model_dir, spectrogram, is_en, language_token):
+    suffix = ".en.pt" if is_en else ".pt"
+    encoder = torch.jit.load(str(model_dir / f"encoder{suffix}"))
+    decoder = torch.jit.load(str(model_dir / f"decoder{suffix}"))
+    special = ENGLISH_TOKENS if is_en else MULTILINGUAL_TOKENS
+    if is_en:
+        prompt = [special["sot"], special["no_timestamps"]]
+    else:
+        prompt = [special["sot"], language_token, special["transcribe"], special["no_timestamps"]]
+
+    tokens_out = []
+    encoder_time, decoder_time, n_decoded = 0.0, 0.0, 0
+    n_windows = (spectrogram.shape[-1] + N_FRAMES - 1) // N_FRAMES
+    with torch.no_grad():
+        for window_idx in range(n_windows):
+            window = spectrogram[:, :, window_idx * N_FRAMES:(window_idx + 1) * N_FRAMES]
+            window = torch.nn.functional.pad(window, (0, N_FRAMES - window.shape[-1]))
+            start = time.perf_counter()
+            audio_features = encoder(window)
+            encoder_time += time.perf_counter() - start
+
+            # Windows are decoded without timestamps so every window is decoded once.
+            tokens = list(prompt)
+            cache_idx = torch.tensor([window_idx])
+            start = time.perf_counter()
+            while len(tokens) < N_TEXT_CTX:
+                logits = decoder(torch.tensor([tokens]), audio_features, cache_idx)
+                token = int(logits[0, -1].argmax())
+                n_decoded += 1
+                if token == special["eot"]:
+                    break
+                tokens.append(token)
+            decoder_time += time.perf_counter() - start
+            tokens_out.extend(t for t in tokens[len(prompt):] if t < special["eot"])
+    return tokens_out, encoder_time, n_windows, decoder_time, n_decoded
+
+
+def word_error_rate(reference, hypothesis):
+    ref, hyp = reference.split(), hypothesis.split()
+    if not ref:
+        return 0.0 if not hyp else 1.0
+    # Levenshtein distance over words.
+    prev = list(range(len(hyp) + 1))
+    for i in range(1, len(ref) + 1):
+        cur = [i] + [0] * len(hyp)
+        for j in range(1, len(hyp) + 1):
+            cur[j] = min(prev[j] + 1, cur[j - 1] + 1, prev[j - 1] + (ref[i - 1] != hyp[j - 1]))
+        prev = cur
+    return prev[-1] / len(ref)
+
+
+parser = argparse.ArgumentParser()
+parser.add_argument("audio", help="path to a 16kHz mono 16-bit WAV file.")
+parser.add_argument("models", nargs="+", help="names of the models to compare. The first is the reference.")
+parser.add_argument("--assets", default="bin/assets", help="path to the assets directory.")
+parser.add_argument("--multilingual", action="store_true", help="use the multilingual models instead of the English models.")
+parser.add_argument("--language-token", type=int, default=50259, help="language token for multilingual models, <|en|> by default.")
+parser.add_argument("--threads", type=int, default=None, help="number of threads used by torch.")
+parser.add_argument("--tempo", type=float, nargs="+", default=[1.0], help="factors, between 0.5 and 2.0, by which the audio is sped up.")
+args = parser.parse_args()
+
+if args.threads:
+    torch.set_num_threads(args.threads)
+assets_dir = Path(args.assets)
+is_en = not args.multilingual
+vocab = load_vocab(assets_dir / ("english_vocab" if is_en else "multilingual_vocab"))
+audio = load_audio(args.audio)
+print(f"Audio duration: {len(audio) / 16000:.1f}s")
+spectrograms = {
+    tempo: log_mel_spectrogram(audio if tempo == 1.0 else change_tempo(args.audio, tempo), assets_dir)
+    for tempo in args.tempo
+}
+
+reference_text = None
+print(f"{'model':<16}{'tempo':>6}{'size(MB)':>10}{'windows':>9}{'encoder(ms/window)':>20}{'decoder(ms/token)':>20}{'total(s)':>10}{'WER':>8}")
+for name in args.models:
+    model_dir = assets_dir / "models" / name
+    for tempo, spectrogram in spectrograms.items():
+        tokens, encoder_time, n_windows, decoder_time, n_decoded = transcribe(model_dir, spectrogram, is_en, args.language_token)
+        text = "".join(vocab[t] for t in tokens)
+        if reference_text is None:
+            reference_text = text
+        wer = word_error_rate(reference_text, text)
+        print(
+            f"{name:<16}{tempo:>6.2f}{model_size_mb(model_dir, is_en):>10.1f}{n_windows:>9}"
+            f"{encoder_time / n_windows * 1000:>20.1f}{decoder_time / max(n_decoded, 1) * 1000:>20.2f}"
+            f"{encoder_time + decoder_time:>10.1f}{wer:>8.3f}"
+        )
@@ -7,6 +7,9 @@ extern "C" {
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
 #include <libswresample/swresample.h>
 #include <libavutil/opt.h>
 
@@ -88,14 +91,36 @@ void capi_free_audio_decode_output(AudioDecodeOutput **dec_out)
     fprintf(stdout, "[INFO]: Freed %ldMB audio decoding buffer.\n", bytes_to_mb(buf_size));
 }
 
+/// The part of the audio stream to decode, in output samples, and the position of the next
+/// output sample in the stream.
+typedef struct DecodeRange {
+    int64_t start_sample;
+    // A negative value decodes up to the end of the stream.
+    int64_t end_sample;
+    // Negative until the first frame is decoded, whose timestamp gives its position.
+    int64_t next_sample;
+} DecodeRange;
+
 static int _shrink_decode_output_to_fit(AudioDecodeOutput *dec_out);
-static int _decode_audio(const char *infilepath, AudioDecodeOutput *dec_out);
+static int _decode_audio(const char *infilepath, DecodeRange *range, AudioDecodeOutput *dec_out);
 
 int capi_get_audio_signal(const char *infilepath, AudioDecodeOutput *dec_out)
+{
+    return capi_get_audio_signal_range(infilepath, 0.0, -1.0, dec_out);
+}
+
+int capi_get_audio_signal_range(const char *infilepath,
+                                double start_secs,
+                                double end_secs,
+                                AudioDecodeOutput *dec_out)
 {
     if (!dec_out)
         return -1;
-    int ret = _decode_audio(infilepath, dec_out);
+    DecodeRange range;
+    range.start_sample = (int64_t)(start_secs * OUT_SAMPLE_RATE);
+    range.end_sample = (end_secs < 0.0) ? -1 : (int64_t)(end_secs * OUT_SAMPLE_RATE);
+    range.next_sample = -1;
+    int ret = _decode_audio(infilepath, &range, dec_out);
     if (ret < 0)
         return -1;
     ret = _shrink_decode_output_to_fit(dec_out);
@@ -186,11 +211,17 @@ static int _write_internal(const uint8_t *inbuf,
 }
 
 
-/// Loops through all the frames in the given packet while saving them to the output structure.
+/// Loops through all the frames in the given packet while saving the samples within the
+/// range to the output structure.
+/// @return 0 if successful, 1 if the range ends before the frames of the packet end and -1
+///  if something went wrong.
 static int _write_frames_to_output(SwrContext *sampler_ctx,
                                    AVCodecContext *codec_ctx,
                                    AVPacket *packet,
                                    AVFrame *frame,
+                                   AVRational time_base,
+                                   int64_t stream_start_time,
+                                   DecodeRange *range,
                                    AudioDecodeOutput *dec_out) 
 {
     // Decode the coded frame from the packet.
@@ -210,6 +241,17 @@ static int _write_frames_to_output(SwrContext *sampler_ctx,
             fprintf(stderr, "[ERROR]: Audio decoder failed to fetch sent packet into the frame.\n");
             return -1;
         }
+        // The resampler outputs contiguous samples so only the position of the first frame is
+        // taken from its timestamp, relative to the start of the stream. Without a timestamp,
+        // the first frame after a seek is at an unknown position and is skipped while the
+        // first frame decoded from the beginning is at the start.
+        if (range->next_sample < 0)
+        {
+            int64_t pts = frame->best_effort_timestamp;
+            if (pts == AV_NOPTS_VALUE && range->start_sample > 0)
+                continue;
+            range->next_sample = (pts == AV_NOPTS_VALUE) ? 0 : av_rescale_q(pts - stream_start_time, time_base, (AVRational){1, OUT_SAMPLE_RATE});
+        }
 
         // Number of samples contained in this frame.
         int n_in_samples = frame->nb_samples;
@@ -230,12 +272,24 @@ static int _write_frames_to_output(SwrContext *sampler_ctx,
             free(outbuf);
             return -1;
         }
-        ret = _write_internal(outbuf, n_output_samples, dec_out);
-        if (ret < 0) {
-            free(outbuf);
-            return -1;
+        // Drop the samples outside the range.
+        int64_t first_sample = range->next_sample;
+        int64_t last_sample = first_sample + n_output_samples;
+        range->next_sample = last_sample;
+        int64_t keep_start = (first_sample < range->start_sample) ? range->start_sample : first_sample;
+        int64_t keep_end = (range->end_sample >= 0 && last_sample > range->end_sample) ? range->end_sample : last_sample;
+        if (keep_end > keep_start)
+        {
+            const uint8_t *keep_buf = outbuf + (keep_start - first_sample) * OUT_SAMPLE_SIZE;
+            ret = _write_internal(keep_buf, keep_end - keep_start, dec_out);
+            if (ret < 0) {
+                free(outbuf);
+                return -1;
+            }
         }
         free(outbuf);
+        if (range->end_sample >= 0 && last_sample >= range->end_sample)
+            return 1;
     }
 
     return 0;
@@ -269,6 +323,7 @@ static int _set_up_sampler(SwrContext *sampler_ctx,
 static int _decode_audio_internal(AVFormatContext *fmt_ctx,
                                  AVCodecParameters *codec_params,
                                  int stream_idx,
+                                 DecodeRange *range,
                                  AudioDecodeOutput *dec_out)
 {
     if (codec_params->codec_type != AVMEDIA_TYPE_AUDIO) {
@@ -336,6 +391,21 @@ static int _decode_audio_internal(AVFormatContext *fmt_ctx,
         goto error_4;
     }
 
+    AVRational time_base = fmt_ctx->streams[stream_idx]->time_base;
+    // Timestamps of streams that do not start at zero, e.g those of MPEG-TS, are offset by the
+    // start of the stream.
+    int64_t stream_start_time = fmt_ctx->streams[stream_idx]->start_time;
+    if (stream_start_time == AV_NOPTS_VALUE)
+        stream_start_time = 0;
+    // Seek to the last keyframe before the start. Formats that cannot seek are decoded from
+    // the beginning and the samples before the start are dropped.
+    if (range->start_sample > 0)
+    {
+        int64_t start_ts = stream_start_time + av_rescale_q(range->start_sample, (AVRational){1, OUT_SAMPLE_RATE}, time_base);
+        if (av_seek_frame(fmt_ctx, stream_idx, start_ts, AVSEEK_FLAG_BACKWARD) < 0)
+            av_log(NULL, AV_LOG_INFO, "~Seek failed, decoding from the beginning\n");
+    }
+
     // Fetch the next coded frame of the stream into the packet. 
     while(av_read_frame(fmt_ctx, packet) >= 0)
     {
@@ -346,10 +416,13 @@ static int _decode_audio_internal(AVFormatContext *fmt_ctx,
             av_packet_unref(packet);
             continue;
         }
-        int ret = _write_frames_to_output(sampler_ctx, codec_ctx, packet, frame, dec_out);
+        int ret = _write_frames_to_output(sampler_ctx, codec_ctx, packet, frame, time_base, stream_start_time, range, dec_out);
+        av_packet_unref(packet);
         if (ret < 0)
             goto error_4;
-        av_packet_unref(packet);
+        // Stop reading once the end of the range is decoded.
+        if (ret == 1)
+            break;
     }
 
     // Cleanup
@@ -380,7 +453,7 @@ error_4:
 }
 
 
-static int _decode_audio(const char *infilepath, AudioDecodeOutput *dec_out) {
+static int _decode_audio(const char *infilepath, DecodeRange *range, AudioDecodeOutput *dec_out) {
     // Holds inforation about format(container) which is used to perform format I/O.
     AVFormatContext *fmt_ctx = avformat_alloc_context();
     if (!fmt_ctx)
@@ -417,13 +490,15 @@ static int _decode_audio(const char *infilepath, AudioDecodeOutput *dec_out) {
         if (codec_params->codec_type != AVMEDIA_TYPE_AUDIO)
           continue;
         found_audio = 1;
-        ret = _decode_audio_internal(fmt_ctx, codec_params, stream_idx, dec_out);
+        ret = _decode_audio_internal(fmt_ctx, codec_params, stream_idx, range, dec_out);
         if (ret < 0)
         {
             avformat_close_input(&fmt_ctx);
             avformat_free_context(fmt_ctx);
             return -1;
         }
+        // The packets are read once so the other audio streams have nothing left to decode.
+        break;
     }
     if (!found_audio)
         fprintf(stdout, "[INFO]: Audio stream not found.\n");
@@ -433,3 +508,120 @@ static int _decode_audio(const char *infilepath, AudioDecodeOutput *dec_out) {
     avformat_free_context(fmt_ctx);
     return 0;
 }
+
+
+/// Moves the frames that the filter graph has output to the output structure.
+static int _drain_filter_sink(AVFilterContext *sink_ctx, AVFrame *frame, AudioDecodeOutput *dec_out)
+{
+    while (1)
+    {
+        int ret = av_buffersink_get_frame(sink_ctx, frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return 0;
+        if (ret < 0)
+        {
+            fprintf(stderr, "[ERROR]: Audio tempo filter failed to output a frame.\n");
+            return -1;
+        }
+        ret = _write_internal(frame->data[0], frame->nb_samples, dec_out);
+        av_frame_unref(frame);
+        if (ret < 0)
+            return -1;
+    }
+}
+
+
+int capi_change_tempo(AudioDecodeOutput *dec_out, double tempo)
+{
+    if (!dec_out || tempo < 0.5 || tempo > 2.0)
+        return -1;
+    if (tempo == 1.0)
+        return 0;
+
+    // The filter graph is: signal -> abuffer -> atempo -> abuffersink -> output.
+    AVFilterGraph *graph = avfilter_graph_alloc();
+    if (!graph)
+    {
+        fprintf(stderr, "[ERROR]: Audio tempo filter failed to allocate a filter graph.\n");
+        return -1;
+    }
+    char args[128];
+    AVFilterContext *src_ctx = NULL, *tempo_ctx = NULL, *sink_ctx = NULL;
+    snprintf(args, sizeof(args), "sample_rate=%lu:sample_fmt=s16:channel_layout=mono:time_base=1/%lu", OUT_SAMPLE_RATE, OUT_SAMPLE_RATE);
+    int ret = avfilter_graph_create_filter(&src_ctx, avfilter_get_by_name("abuffer"), "in", args, NULL, graph);
+    snprintf(args, sizeof(args), "tempo=%f", tempo);
+    if (ret >= 0)
+        ret = avfilter_graph_create_filter(&tempo_ctx, avfilter_get_by_name("atempo"), "tempo", args, NULL, graph);
+    if (ret >= 0)
+        ret = avfilter_graph_create_filter(&sink_ctx, avfilter_get_by_name("abuffersink"), "out", NULL, NULL, graph);
+    if (ret >= 0)
+        ret = avfilter_link(src_ctx, 0, tempo_ctx, 0);
+    if (ret >= 0)
+        ret = avfilter_link(tempo_ctx, 0, sink_ctx, 0);
+    // atempo supports s16 so the format of the signal is kept.
+    if (ret >= 0)
+        ret = avfilter_graph_config(graph, NULL);
+    if (ret < 0)
+    {
+        fprintf(stderr, "[ERROR]: Audio tempo filter failed to set up the filter graph.\n");
+        avfilter_graph_free(&graph);
+        return -1;
+    }
+
+    // The output is written to a new buffer that is about the size of the changed signal.
+    AudioDecodeOutput out;
+    out.tot_buf_size = (uint64_t)(dec_out->num_samples / tempo + OUT_SAMPLE_RATE) * OUT_SAMPLE_SIZE;
+    out.used_buf_size = 0;
+    out.num_samples = 0;
+    out.buf = (uint8_t *)malloc(out.tot_buf_size);
+    AVFrame *frame = av_frame_alloc();
+    if (!out.buf || !frame)
+    {
+        fprintf(stderr, "[ERROR]: Audio tempo filter failed to allocate %ldMB.\n", bytes_to_mb(out.tot_buf_size));
+        free(out.buf);
+        av_frame_free(&frame);
+        avfilter_graph_free(&graph);
+        return -1;
+    }
+
+    // Feed the signal in chunks of one second.
+    const int64_t chunk_size = OUT_SAMPLE_RATE;
+    AVChannelLayout ch_layout = OUT_CHANNEL_LAYOUT;
+    for (int64_t offset = 0; offset < dec_out->num_samples && ret >= 0; offset += chunk_size)
+    {
+        int64_t n_samples = dec_out->num_samples - offset;
+        if (n_samples > chunk_size)
+            n_samples = chunk_size;
+        frame->nb_samples = n_samples;
+        frame->format = AV_SAMPLE_FMT_S16;
+        frame->sample_rate = OUT_SAMPLE_RATE;
+        frame->pts = offset;
+        av_channel_layout_copy(&frame->ch_layout, &ch_layout);
+        ret = av_frame_get_buffer(frame, 0);
+        if (ret < 0)
+            break;
+        memcpy(frame->data[0], dec_out->buf + offset * OUT_SAMPLE_SIZE, n_samples * OUT_SAMPLE_SIZE);
+        // The filter takes the reference to the frame data and resets the frame.
+        ret = av_buffersrc_add_frame(src_ctx, frame);
+        if (ret >= 0)
+            ret = _drain_filter_sink(sink_ctx, frame, &out);
+    }
+    // Flush the samples that atempo holds back.
+    if (ret >= 0)
+        ret = av_buffersrc_add_frame(src_ctx, NULL);
+    if (ret >= 0)
+        ret = _drain_filter_sink(sink_ctx, frame, &out);
+    av_frame_free(&frame);
+    avfilter_graph_free(&graph);
+    if (ret < 0)
+    {
+        fprintf(stderr, "[ERROR]: Audio tempo filter failed to change the tempo.\n");
+        free(out.buf);
+        return -1;
+    }
+
+    fprintf(stdout, "[INFO]: Changed audio tempo by %.2fx: %ld -> %ld samples.\n", tempo, dec_out->num_samples, out.num_samples);
+    free(dec_out->buf);
+    *dec_out = out;
+    return _shrink_decode_output_to_fit(dec_out);
+}
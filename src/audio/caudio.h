@@ -50,6 +50,24 @@ void capi_free_audio_decode_output(AudioDecodeOutput **dec_out);
 /// @return 0 if the process was successful and -1 if decoding could not be done.
 int capi_get_audio_signal(const char *media_filepath, AudioDecodeOutput *dec_out);
 
+/// @brief Decodes the part of the audio stream between `start_secs` and `end_secs`. The
+///  decoder seeks close to the start in the container and stops reading at the end so the
+///  cost depends on the length of the part rather than the length of the media. The samples
+///  outside the part are dropped so the signal starts exactly at `start_secs`.
+/// @param end_secs End of the part, a negative value decodes up to the end of the stream.
+/// @return 0 if the process was successful and -1 if decoding could not be done.
+int capi_get_audio_signal_range(const char *media_filepath,
+                                double start_secs,
+                                double end_secs,
+                                AudioDecodeOutput *dec_out);
+
+/// @brief Speeds up or slows down the decoded audio signal by the given factor with FFmpeg's
+///  atempo filter, which preserves the pitch. Speeding up speech shortens the signal that
+///  the model has to transcribe.
+/// @param tempo The speed factor, between 0.5 and 2.0. 1.25 makes the signal 20% shorter.
+/// @return 0 if the process was successful and -1 if the tempo could not be changed.
+int capi_change_tempo(AudioDecodeOutput *dec_out, double tempo);
+
 /// @brief Writes the signal from the given decoder output to the given filepath
 /// as binary. Helpful for debugging and inspection.
 /// @return 0 if successful and -1 if something went wrong.
@@ -0,0 +1,277 @@
+#include "core/cache.h"
+#include "core/exceptions.h"
+#include "core/log.h"
+#include "core/models_manager.h"
+#include "core/transcribe.h"
+#include "options.h"
+#include "server.h"
+
+#include <ATen/Parallel.h>
+
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <system_error>
+#include <vector>
+
+
+static const char *s_USAGE =
+    "Usage: capgen-cli [OPTIONS] FILE...\n"
+    "       capgen-cli [OPTIONS] --serve SOCKET\n"
+    "Transcribes the media files, in order, with a model that is loaded once. The srt files are\n"
+    "written next to the media files unless an output directory is given. With --serve, runs\n"
+    "until interrupted and transcribes the files submitted on the Unix socket, with the options\n"
+    "as defaults. Must be run from the directory that contains the `assets` directory.\n"
+    "\n"
+    "Options:\n"
+    "  --model NAME               Model in ./assets/models, default: base or the first installed.\n"
+    "  --model-type TYPE          english or multilingual, default: multilingual.\n"
+    "  --task TASK                transcribe, translate or transcribe+translate, default: transcribe.\n"
+    "  --decoder DECODER          greedy, beamsearch or adaptive, default: greedy.\n"
+    "  --backend BACKEND          torchscript or native decoder implementation, default: torchscript.\n"
+    "  --threads N                Number of threads used within an operation.\n"
+    "  --interop-threads N        Number of threads that run independent operations.\n"
+    "  --output-dir DIR           Directory in which the srt files are written.\n"
+    "  --start SECONDS            Start of the transcribed part of the media.\n"
+    "  --end SECONDS              End of the transcribed part of the media.\n"
+    "  --tempo FACTOR             Speeds up the audio by a factor between 0.5 and 2.0.\n"
+    "  --draft-model NAME         Model that drafts tokens for greedy decoding, e.g tiny.\n"
+    "  --segmentation-model NAME  Model that finds the parts of the media with speech, e.g tiny.\n"
+    "  --serve SOCKET             Serves transcriptions on the Unix socket at this path.\n"
+    "  --cache-stats              Prints the hits and misses of the transcript cache at the end.\n"
+    "  --help                     Prints this message.\n";
+
+struct CliOptions {
+    std::vector<std::filesystem::path> media_filepaths;
+    std::string model_name;
+    capgen::ModelType model_type = capgen::ModelType::Multilingual;
+    capgen::TranscriptionTask task = capgen::TranscriptionTask::Transcribe;
+    capgen::TranscriptionDecoder decoder = capgen::TranscriptionDecoder::Greedy;
+    capgen::DecoderBackendType backend_type = capgen::DecoderBackendType::TorchScript;
+    // Zero keeps the number of threads chosen by torch.
+    int n_threads = 0;
+    int n_interop_threads = 0;
+    std::string draft_model_name;
+    std::string segmentation_model_name;
+    capgen::DecodingOptions decoding_options;
+    // If set, transcriptions are served on this socket instead of transcribing the files.
+    std::filesystem::path socket_path;
+    bool print_cache_stats = false;
+};
+
+// Parses the command line arguments into `options`. Prints the invalid argument and returns
+// false if the arguments are invalid.
+static bool parse_args(int argc, char **argv, CliOptions &options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        if (std::strncmp(arg, "--", 2) != 0)
+        {
+            options.media_filepaths.push_back(arg);
+            continue;
+        }
+        if (std::strcmp(arg, "--help") == 0)
+            return false;
+        if (std::strcmp(arg, "--cache-stats") == 0)
+        {
+            options.print_cache_stats = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            std::fprintf(stderr, "Missing value of option %s\n", arg);
+            return false;
+        }
+        const char *value = argv[++i];
+        bool valid = true;
+        if (std::strcmp(arg, "--model") == 0)
+            options.model_name = value;
+        else if (std::strcmp(arg, "--model-type") == 0)
+            valid = capgen::parse_model_type(value, options.model_type);
+        else if (std::strcmp(arg, "--task") == 0)
+            valid = capgen::parse_task(value, options.task);
+        else if (std::strcmp(arg, "--decoder") == 0)
+            valid = capgen::parse_decoder(value, options.decoder);
+        else if (std::strcmp(arg, "--backend") == 0)
+            valid = capgen::parse_backend(value, options.backend_type);
+        else if (std::strcmp(arg, "--threads") == 0)
+            valid = capgen::parse_int(value, options.n_threads) && options.n_threads >= 0;
+        else if (std::strcmp(arg, "--interop-threads") == 0)
+            valid = capgen::parse_int(value, options.n_interop_threads) && options.n_interop_threads >= 0;
+        else if (std::strcmp(arg, "--output-dir") == 0)
+            options.decoding_options.output_dir = value;
+        else if (std::strcmp(arg, "--start") == 0)
+            valid = capgen::parse_time(value, options.decoding_options.start_time);
+        else if (std::strcmp(arg, "--end") == 0)
+            valid = capgen::parse_time(value, options.decoding_options.end_time);
+        else if (std::strcmp(arg, "--tempo") == 0)
+            valid = capgen::parse_tempo(value, options.decoding_options.tempo);
+        else if (std::strcmp(arg, "--serve") == 0)
+            options.socket_path = value;
+        else if (std::strcmp(arg, "--draft-model") == 0)
+            options.draft_model_name = value;
+        else if (std::strcmp(arg, "--segmentation-model") == 0)
+            options.segmentation_model_name = value;
+        else
+        {
+            std::fprintf(stderr, "Unknown option %s\n", arg);
+            return false;
+        }
+        if (!valid)
+        {
+            std::fprintf(stderr, "Invalid value of option %s: %s\n", arg, value);
+            return false;
+        }
+    }
+    if (!capgen::is_valid_time_range(options.decoding_options.start_time, options.decoding_options.end_time))
+    {
+        std::fprintf(stderr, "The end of the media, --end, must be after its start, --start\n");
+        return false;
+    }
+    if (options.media_filepaths.empty() && options.socket_path.empty())
+    {
+        std::fprintf(stderr, "No media files given\n");
+        return false;
+    }
+    return true;
+}
+
+// Returns whether the model is installed, printing an error if it is not.
+static bool check_model_registered(const capgen::ModelsManager &models_manager, const std::string &name)
+{
+    if (models_manager.model_is_registered(name))
+        return true;
+    std::fprintf(stderr, "Model %s is not installed in ./assets/models\n", name.c_str());
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    CliOptions options;
+    if (!parse_args(argc, argv, options))
+    {
+        std::fprintf(stderr, "%s", s_USAGE);
+        return 2;
+    }
+    // The inter-op threads must be set before torch runs any operation.
+    if (options.n_interop_threads > 0)
+        at::set_num_interop_threads(options.n_interop_threads);
+    if (options.n_threads > 0)
+        at::set_num_threads(options.n_threads);
+    if (!options.decoding_options.output_dir.empty())
+    {
+        std::error_code error;
+        std::filesystem::create_directories(options.decoding_options.output_dir, error);
+        if (error)
+        {
+            std::fprintf(stderr, "Failed to create output directory %s\n", options.decoding_options.output_dir.c_str());
+            return 1;
+        }
+    }
+
+    // The models manager lists the installed models on construction, which fails without
+    // the models directory, e.g when capgen-cli is run from another directory.
+    if (!std::filesystem::is_directory("./assets/models"))
+    {
+        std::fprintf(stderr, "No ./assets/models directory, run capgen-cli from the directory that contains the assets\n");
+        std::fprintf(stderr, "%s", s_USAGE);
+        return 2;
+    }
+    capgen::ModelsManager models_manager;
+    // All the models, including the ones used by the server, are loaded with this backend.
+    models_manager.set_decoder_backend(options.backend_type);
+    if (options.model_name.empty())
+        options.model_name = models_manager.get_default_model_name();
+    if (options.model_name.empty())
+    {
+        std::fprintf(stderr, "No models are installed in ./assets/models\n");
+        return 1;
+    }
+    if (!check_model_registered(models_manager, options.model_name)
+        || (!options.draft_model_name.empty() && !check_model_registered(models_manager, options.draft_model_name))
+        || (!options.segmentation_model_name.empty() && !check_model_registered(models_manager, options.segmentation_model_name)))
+        return 1;
+
+    if (!options.socket_path.empty())
+    {
+        // Jobs that do not set the options use the options of the command line.
+        const capgen::JobOptions default_options = {options.model_name, options.model_type, options.task, options.decoder,
+                                                    options.draft_model_name, options.segmentation_model_name,
+                                                    options.decoding_options};
+        try
+        {
+            capgen::TranscriptionServer server(options.socket_path, models_manager, default_options);
+            // The default model is loaded before the first job is submitted.
+            models_manager.get_model(options.model_name, options.model_type);
+            std::signal(SIGINT, [](int) { capgen::TranscriptionServer::stop(); });
+            std::signal(SIGTERM, [](int) { capgen::TranscriptionServer::stop(); });
+            server.run();
+            if (options.print_cache_stats)
+                std::fprintf(stderr, "Transcript cache: %d hits, %d misses\n",
+                             (int)capgen::TranscriptCache::n_hits(), (int)capgen::TranscriptCache::n_misses());
+        }
+        catch (const std::exception &)
+        {
+            CG_LOG_ERROR("Failed to serve on %s", options.socket_path.c_str());
+            return 1;
+        }
+        return 0;
+    }
+
+    std::function<void()> trx_start_callback = []() {};
+    std::function<void(float)> trx_update_callback = [](float progress) {
+        std::fprintf(stderr, "\rProgress: %3d%%", (int)progress);
+        std::fflush(stderr);
+    };
+    std::function<void(const std::string&)> trx_segment_callback = [](const std::string &text) {
+        std::printf("%s\n", text.c_str());
+        std::fflush(stdout);
+    };
+
+    const int n_files = options.media_filepaths.size();
+    int n_failed = 0;
+    for (int i = 0; i < n_files; ++i)
+    {
+        const std::filesystem::path &media_filepath = options.media_filepaths[i];
+        std::fprintf(stderr, "[%d/%d] %s\n", i + 1, n_files, media_filepath.c_str());
+        try
+        {
+            // Media that was transcribed before in the same way is not transcribed again.
+            if (capgen::transcribe_from_cache(media_filepath, options.model_name, options.model_type, options.task,
+                                              options.decoder, options.segmentation_model_name, options.decoding_options,
+                                              trx_segment_callback))
+                continue;
+            // The models are loaded by the first transcription and stay loaded for the rest.
+            auto model = models_manager.get_model(options.model_name, options.model_type);
+            capgen::DecodingOptions decoding_options = options.decoding_options;
+            if (!options.draft_model_name.empty() && options.decoder == capgen::TranscriptionDecoder::Greedy)
+                decoding_options.draft_model = models_manager.get_model(options.draft_model_name, options.model_type);
+            if (!options.segmentation_model_name.empty())
+                decoding_options.segmentation_model = models_manager.get_model(options.segmentation_model_name, options.model_type);
+            capgen::transcribe(media_filepath, model, options.task, options.decoder,
+                               trx_start_callback, trx_update_callback, trx_segment_callback, decoding_options);
+            std::fprintf(stderr, "\n");
+        }
+        catch (const capgen::MediaDecodingException &)
+        {
+            CG_LOG_ERROR("Failed to decode %s", media_filepath.c_str());
+            n_failed += 1;
+        }
+        catch (const std::exception &e)
+        {
+            CG_LOG_ERROR("Failed to transcribe %s: %s", media_filepath.c_str(), e.what());
+            n_failed += 1;
+        }
+    }
+    if (options.print_cache_stats)
+        std::fprintf(stderr, "Transcript cache: %d hits, %d misses\n",
+                     (int)capgen::TranscriptCache::n_hits(), (int)capgen::TranscriptCache::n_misses());
+    if (n_failed > 0)
+        std::fprintf(stderr, "%d of %d files failed\n", n_failed, n_files);
+    return n_failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,86 @@
+#include "options.h"
+
+#include <cstdlib>
+#include <cstring>
+
+
+namespace capgen {
+
+bool parse_float(const char *value, float &out)
+{
+    char *end;
+    out = std::strtof(value, &end);
+    return end != value && *end == '\0';
+}
+
+bool parse_int(const char *value, int &out)
+{
+    char *end;
+    out = (int)std::strtol(value, &end, 10);
+    return end != value && *end == '\0';
+}
+
+bool parse_model_type(const char *value, ModelType &out)
+{
+    if (std::strcmp(value, "english") == 0)
+        out = ModelType::English;
+    else if (std::strcmp(value, "multilingual") == 0)
+        out = ModelType::Multilingual;
+    else
+        return false;
+    return true;
+}
+
+bool parse_task(const char *value, TranscriptionTask &out)
+{
+    if (std::strcmp(value, "transcribe") == 0)
+        out = TranscriptionTask::Transcribe;
+    else if (std::strcmp(value, "translate") == 0)
+        out = TranscriptionTask::Translate;
+    else if (std::strcmp(value, "transcribe+translate") == 0)
+        out = TranscriptionTask::TranscribeAndTranslate;
+    else
+        return false;
+    return true;
+}
+
+bool parse_decoder(const char *value, TranscriptionDecoder &out)
+{
+    if (std::strcmp(value, "greedy") == 0)
+        out = TranscriptionDecoder::Greedy;
+    else if (std::strcmp(value, "beamsearch") == 0)
+        out = TranscriptionDecoder::BeamSearch;
+    else if (std::strcmp(value, "adaptive") == 0)
+        out = TranscriptionDecoder::Adaptive;
+    else
+        return false;
+    return true;
+}
+
+bool parse_backend(const char *value, DecoderBackendType &out)
+{
+    if (std::strcmp(value, "torchscript") == 0)
+        out = DecoderBackendType::TorchScript;
+    else if (std::strcmp(value, "native") == 0)
+        out = DecoderBackendType::Native;
+    else
+        return false;
+    return true;
+}
+
+bool parse_tempo(const char *value, float &out)
+{
+    return parse_float(value, out) && out >= 0.5f && out <= 2.0f;
+}
+
+bool parse_time(const char *value, float &out)
+{
+    return parse_float(value, out) && out >= 0.0f;
+}
+
+bool is_valid_time_range(float start_time, float end_time)
+{
+    return start_time >= 0.0f && (end_time < 0.0f || end_time > start_time);
+}
+
+} // namespace capgen
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "core/model.h"
+#include "core/transcribe.h"
+
+
+namespace capgen {
+
+// Parsers of the values of the options of capgen-cli, which the server also accepts in its
+// requests. Each returns false if the value is invalid.
+bool parse_float(const char *value, float &out);
+bool parse_int(const char *value, int &out);
+// `english` or `multilingual`.
+bool parse_model_type(const char *value, ModelType &out);
+// `transcribe`, `translate` or `transcribe+translate`.
+bool parse_task(const char *value, TranscriptionTask &out);
+// `greedy`, `beamsearch` or `adaptive`.
+bool parse_decoder(const char *value, TranscriptionDecoder &out);
+// `torchscript` or `native`, see `DecoderBackendType`.
+bool parse_backend(const char *value, DecoderBackendType &out);
+// A factor between 0.5 and 2.0, see `DecodingOptions`.
+bool parse_tempo(const char *value, float &out);
+// A time in the media in seconds, which cannot be negative.
+bool parse_time(const char *value, float &out);
+// Whether the part of the media from `start_time` to `end_time` is not empty. A negative
+// `end_time` is the end of the media, see `DecodingOptions`.
+bool is_valid_time_range(float start_time, float end_time);
+
+} // namespace capgen
@@ -0,0 +1,498 @@
+#include "server.h"
+#include "options.h"
+#include "core/cache.h"
+#include "core/exceptions.h"
+#include "core/log.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <system_error>
+
+
+// Largest message accepted from a client. Requests are a few short fields.
+static const uint32_t s_MAX_MESSAGE_SIZE = 64 * 1024;
+// Time after which a message to a client that does not read its messages is dropped, and
+// the client disconnected, so that a stuck client does not stall the other jobs.
+static const int s_SEND_TIMEOUT_SECS = 10;
+// Interval at which the accepting thread checks whether the server was stopped.
+static const int s_POLL_INTERVAL_MS = 500;
+
+static volatile std::sig_atomic_t s_stop_requested = 0;
+
+
+// Returns a message of the given type with the given fields. Newlines in the values, e.g in
+// the text of a segment, are replaced by spaces so that each field is on its own line.
+static std::string make_message(const char *type, std::initializer_list<std::pair<const char *, std::string>> fields)
+{
+    std::string message = type;
+    for (const auto &[key, value] : fields)
+    {
+        message += '\n';
+        message += key;
+        message += '=';
+        for (const char c : value)
+            message += (c == '\n' || c == '\r') ? ' ' : c;
+    }
+    return message;
+}
+
+// Splits a message into its type and its fields. Returns false if a field is not `key=value`.
+static bool parse_message(const std::string &message, std::string &type, std::map<std::string, std::string> &fields)
+{
+    size_t line_start = 0;
+    size_t line_end = message.find('\n');
+    type = message.substr(0, line_end);
+    while (line_end != std::string::npos)
+    {
+        line_start = line_end + 1;
+        line_end = message.find('\n', line_start);
+        const std::string line = message.substr(line_start, line_end == std::string::npos ? std::string::npos : line_end - line_start);
+        if (line.empty())
+            continue;
+        const size_t separator = line.find('=');
+        if (separator == std::string::npos || separator == 0)
+            return false;
+        fields[line.substr(0, separator)] = line.substr(separator + 1);
+    }
+    return true;
+}
+
+static bool read_bytes(int fd, void *out, size_t n_bytes)
+{
+    char *buf = static_cast<char *>(out);
+    while (n_bytes > 0)
+    {
+        const ssize_t n_read = ::recv(fd, buf, n_bytes, 0);
+        if (n_read < 0 && errno == EINTR)
+            continue;
+        if (n_read <= 0)
+            return false;
+        buf += n_read;
+        n_bytes -= n_read;
+    }
+    return true;
+}
+
+static bool write_bytes(int fd, const void *data, size_t n_bytes)
+{
+    const char *buf = static_cast<const char *>(data);
+    while (n_bytes > 0)
+    {
+        // A client that disconnected must not kill the server with SIGPIPE.
+        const ssize_t n_written = ::send(fd, buf, n_bytes, MSG_NOSIGNAL);
+        if (n_written < 0 && errno == EINTR)
+            continue;
+        if (n_written <= 0)
+            return false;
+        buf += n_written;
+        n_bytes -= n_written;
+    }
+    return true;
+}
+
+static std::string job_id_string(const capgen::TranscriptionJob &job)
+{
+    return std::to_string(job.id);
+}
+
+
+namespace capgen {
+
+ClientConnection::~ClientConnection()
+{
+    ::close(m_fd);
+}
+
+void ClientConnection::send(const std::string &message)
+{
+    std::lock_guard<std::mutex> lock(m_send_mutex);
+    if (!m_open)
+        return;
+    // The frame size is sent in little-endian order, which is the order of the supported hosts.
+    const uint32_t size = message.size();
+    if (!write_bytes(m_fd, &size, sizeof(size)) || !write_bytes(m_fd, message.data(), message.size()))
+    {
+        CG_LOG_MWARNING("Failed to send a message to a client, disconnecting it");
+        shutdown();
+    }
+}
+
+bool ClientConnection::receive(std::string &message)
+{
+    uint32_t size;
+    if (!read_bytes(m_fd, &size, sizeof(size)))
+        return false;
+    if (size > s_MAX_MESSAGE_SIZE)
+    {
+        CG_LOG_WARNING("Client sent a message of %u bytes, disconnecting it", size);
+        return false;
+    }
+    message.resize(size);
+    return read_bytes(m_fd, message.data(), size);
+}
+
+void ClientConnection::shutdown()
+{
+    m_open = false;
+    ::shutdown(m_fd, SHUT_RDWR);
+}
+
+TranscriptionServer::TranscriptionServer(const std::filesystem::path &socket_path,
+                                         ModelsManager &models_manager,
+                                         const JobOptions &default_options)
+  : m_socket_path(socket_path), m_models_manager(models_manager), m_default_options(default_options)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (m_socket_path.string().size() >= sizeof(address.sun_path))
+    {
+        CG_LOG_ERROR("Socket path %s is too long", m_socket_path.c_str());
+        throw std::exception();
+    }
+    std::strcpy(address.sun_path, m_socket_path.c_str());
+
+    // The socket of a server that did not exit cleanly is left behind and would fail the bind.
+    std::error_code error;
+    if (std::filesystem::is_socket(m_socket_path, error))
+        std::filesystem::remove(m_socket_path, error);
+
+    m_listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_listen_fd < 0
+        || ::bind(m_listen_fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0
+        || ::listen(m_listen_fd, SOMAXCONN) != 0)
+    {
+        CG_LOG_ERROR("Failed to listen on socket %s: %s", m_socket_path.c_str(), std::strerror(errno));
+        if (m_listen_fd >= 0)
+            ::close(m_listen_fd);
+        throw std::exception();
+    }
+}
+
+TranscriptionServer::~TranscriptionServer()
+{
+    ::close(m_listen_fd);
+    std::error_code error;
+    std::filesystem::remove(m_socket_path, error);
+}
+
+void TranscriptionServer::stop()
+{
+    s_stop_requested = 1;
+}
+
+void TranscriptionServer::run()
+{
+    CG_LOG_INFO("Serving transcriptions on %s", m_socket_path.c_str());
+    m_jobs_thread = std::thread(&TranscriptionServer::run_jobs, this);
+
+    while (!s_stop_requested)
+    {
+        join_finished_client_threads();
+        pollfd listen_poll = {m_listen_fd, POLLIN, 0};
+        if (::poll(&listen_poll, 1, s_POLL_INTERVAL_MS) <= 0)
+            continue;
+        const int client_fd = ::accept(m_listen_fd, nullptr, nullptr);
+        if (client_fd < 0)
+            continue;
+        const timeval send_timeout = {s_SEND_TIMEOUT_SECS, 0};
+        ::setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+        auto client = std::make_shared<ClientConnection>(client_fd);
+        // The thread is added under the lock so that it cannot finish before it is added.
+        std::lock_guard<std::mutex> lock(m_clients_mutex);
+        m_clients.emplace(client, std::thread(&TranscriptionServer::serve_client, this, client));
+    }
+
+    CG_LOG_MINFO("Stopping the server");
+    {
+        std::lock_guard<std::mutex> lock(m_jobs_mutex);
+        m_stopping = true;
+        // The running job keeps its progress in its checkpoint.
+        if (m_running_job)
+            m_running_job->cancelled = true;
+    }
+    m_jobs_cv.notify_all();
+    m_jobs_thread.join();
+    {
+        std::unique_lock<std::mutex> lock(m_clients_mutex);
+        for (const auto &[client, client_thread] : m_clients)
+            client->shutdown();
+        m_clients_cv.wait(lock, [this]() { return m_clients.empty(); });
+    }
+    join_finished_client_threads();
+}
+
+void TranscriptionServer::join_finished_client_threads()
+{
+    std::vector<std::thread> finished_threads;
+    {
+        std::lock_guard<std::mutex> lock(m_clients_mutex);
+        finished_threads.swap(m_finished_client_threads);
+    }
+    for (auto &client_thread : finished_threads)
+        client_thread.join();
+}
+
+void TranscriptionServer::serve_client(std::shared_ptr<ClientConnection> client)
+{
+    std::string request;
+    while (client->receive(request))
+        handle_request(client, request);
+    client->shutdown();
+    cancel_client_jobs(client);
+    // The thread cannot join itself so it is handed to the accepting thread, which joins it.
+    std::lock_guard<std::mutex> lock(m_clients_mutex);
+    const auto client_it = m_clients.find(client);
+    m_finished_client_threads.push_back(std::move(client_it->second));
+    m_clients.erase(client_it);
+    m_clients_cv.notify_all();
+}
+
+void TranscriptionServer::handle_request(const std::shared_ptr<ClientConnection> &client, const std::string &request)
+{
+    std::string type;
+    std::map<std::string, std::string> fields;
+    if (!parse_message(request, type, fields))
+        client->send(make_message("error", {{"message", "Invalid field in request " + type}}));
+    else if (type == "submit")
+        submit(client, fields);
+    else if (type == "cancel")
+        cancel(client, fields);
+    else if (type == "stats")
+        send_stats(client);
+    else
+        client->send(make_message("error", {{"message", "Unknown request " + type}}));
+}
+
+void TranscriptionServer::send_stats(const std::shared_ptr<ClientConnection> &client)
+{
+    size_t n_queued;
+    {
+        std::lock_guard<std::mutex> lock(m_jobs_mutex);
+        n_queued = m_queued_jobs.size();
+    }
+    client->send(make_message("stats", {{"queued", std::to_string(n_queued)},
+                                        {"cache_hits", std::to_string(TranscriptCache::n_hits())},
+                                        {"cache_misses", std::to_string(TranscriptCache::n_misses())}}));
+}
+
+void TranscriptionServer::submit(const std::shared_ptr<ClientConnection> &client, const std::map<std::string, std::string> &fields)
+{
+    auto job = std::make_shared<TranscriptionJob>();
+    job->options = m_default_options;
+    job->client = client;
+    bool has_file = false;
+    for (const auto &[key, value] : fields)
+    {
+        bool valid = true;
+        if (key == "file")
+        {
+            job->media_filepath = value;
+            has_file = true;
+        }
+        else if (key == "priority")
+            valid = parse_int(value.c_str(), job->priority);
+        else if (key == "model")
+            job->options.model_name = value;
+        else if (key == "model_type")
+            valid = parse_model_type(value.c_str(), job->options.model_type);
+        else if (key == "task")
+            valid = parse_task(value.c_str(), job->options.task);
+        else if (key == "decoder")
+            valid = parse_decoder(value.c_str(), job->options.decoder);
+        else if (key == "output_dir")
+            job->options.decoding_options.output_dir = value;
+        else if (key == "start")
+            valid = parse_time(value.c_str(), job->options.decoding_options.start_time);
+        else if (key == "end")
+            valid = parse_time(value.c_str(), job->options.decoding_options.end_time);
+        else if (key == "tempo")
+            valid = parse_tempo(value.c_str(), job->options.decoding_options.tempo);
+        else if (key == "draft_model")
+            job->options.draft_model_name = value;
+        else if (key == "segmentation_model")
+            job->options.segmentation_model_name = value;
+        else
+        {
+            client->send(make_message("error", {{"message", "Unknown field " + key}}));
+            return;
+        }
+        if (!valid)
+        {
+            client->send(make_message("error", {{"message", "Invalid value of field " + key + ": " + value}}));
+            return;
+        }
+    }
+    if (!has_file)
+    {
+        client->send(make_message("error", {{"message", "Missing field file"}}));
+        return;
+    }
+    // The range is checked once both ends are known, which may come from the defaults.
+    if (!is_valid_time_range(job->options.decoding_options.start_time, job->options.decoding_options.end_time))
+    {
+        client->send(make_message("error", {{"message", "The end must be after the start"}}));
+        return;
+    }
+    for (const std::string &model_name : {job->options.model_name, job->options.draft_model_name, job->options.segmentation_model_name})
+        if (!model_name.empty() && !m_models_manager.model_is_registered(model_name))
+        {
+            client->send(make_message("error", {{"message", "Model " + model_name + " is not installed"}}));
+            return;
+        }
+    // The output directory is created up front so that a job cannot fail on it after it was
+    // queued for a while.
+    const std::filesystem::path &output_dir = job->options.decoding_options.output_dir;
+    std::error_code error;
+    if (!output_dir.empty() && !std::filesystem::create_directories(output_dir, error) && error)
+    {
+        client->send(make_message("error", {{"message", "Failed to create output directory " + output_dir.string()}}));
+        return;
+    }
+
+    // The job is queued once it is accepted so that `accepted` is always the first message of
+    // the job. Messages are sent without holding the lock so that a slow client does not stall
+    // the jobs thread, and the requests of a client are handled in order so the job cannot be
+    // cancelled in between.
+    size_t n_queued;
+    {
+        std::lock_guard<std::mutex> lock(m_jobs_mutex);
+        job->id = m_next_job_id++;
+        n_queued = m_queued_jobs.size() + 1;
+    }
+    client->send(make_message("accepted", {{"job", job_id_string(*job)}, {"queued", std::to_string(n_queued)}}));
+    {
+        std::lock_guard<std::mutex> lock(m_jobs_mutex);
+        m_queued_jobs[{-job->priority, job->id}] = job;
+    }
+    m_jobs_cv.notify_one();
+}
+
+void TranscriptionServer::cancel(const std::shared_ptr<ClientConnection> &client, const std::map<std::string, std::string> &fields)
+{
+    const auto job_field = fields.find("job");
+    int job_id = 0;
+    if (job_field == fields.end() || !parse_int(job_field->second.c_str(), job_id))
+    {
+        client->send(make_message("error", {{"message", "Missing or invalid field job"}}));
+        return;
+    }
+    bool was_queued = false;
+    {
+        std::lock_guard<std::mutex> lock(m_jobs_mutex);
+        for (auto it = m_queued_jobs.begin(); it != m_queued_jobs.end(); ++it)
+            if (it->second->id == (uint64_t)job_id && it->second->client == client)
+            {
+                m_queued_jobs.erase(it);
+                was_queued = true;
+                break;
+            }
+        // The jobs thread reports the cancellation once the transcription stops.
+        if (!was_queued && m_running_job && m_running_job->id == (uint64_t)job_id && m_running_job->client == client)
+        {
+            m_running_job->cancelled = true;
+            return;
+        }
+    }
+    if (was_queued)
+        client->send(make_message("cancelled", {{"job", job_field->second}}));
+    else
+        client->send(make_message("error", {{"message", "Unknown job " + job_field->second}}));
+}
+
+void TranscriptionServer::cancel_client_jobs(const std::shared_ptr<ClientConnection> &client)
+{
+    std::lock_guard<std::mutex> lock(m_jobs_mutex);
+    for (auto it = m_queued_jobs.begin(); it != m_queued_jobs.end();)
+        if (it->second->client == client)
+            it = m_queued_jobs.erase(it);
+        else
+            ++it;
+    if (m_running_job && m_running_job->client == client)
+        m_running_job->cancelled = true;
+}
+
+void TranscriptionServer::run_jobs()
+{
+    while (true)
+    {
+        std::shared_ptr<TranscriptionJob> job;
+        {
+            std::unique_lock<std::mutex> lock(m_jobs_mutex);
+            m_jobs_cv.wait(lock, [this]() { return m_stopping || !m_queued_jobs.empty(); });
+            if (m_stopping)
+                return;
+            job = m_queued_jobs.begin()->second;
+            m_queued_jobs.erase(m_queued_jobs.begin());
+            m_running_job = job;
+        }
+        run_job(job);
+        std::lock_guard<std::mutex> lock(m_jobs_mutex);
+        m_running_job = nullptr;
+    }
+}
+
+void TranscriptionServer::run_job(const std::shared_ptr<TranscriptionJob> &job)
+{
+    const std::string job_id = job_id_string(*job);
+    CG_LOG_INFO("Running job %s: %s", job_id.c_str(), job->media_filepath.c_str());
+    job->client->send(make_message("started", {{"job", job_id}}));
+
+    std::function<void()> trx_start_callback = []() {};
+    std::function<void(float)> trx_update_callback = [&job, &job_id](float progress) {
+        job->client->send(make_message("progress", {{"job", job_id}, {"percent", std::to_string((int)progress)}}));
+    };
+    std::function<void(const std::string&)> trx_segment_callback = [&job, &job_id](const std::string &text) {
+        job->client->send(make_message("segment", {{"job", job_id}, {"text", text}}));
+    };
+
+    try
+    {
+        // Media that was transcribed before in the same way is not transcribed again.
+        if (capgen::transcribe_from_cache(job->media_filepath, job->options.model_name, job->options.model_type, job->options.task,
+                                          job->options.decoder, job->options.segmentation_model_name, job->options.decoding_options,
+                                          trx_segment_callback))
+        {
+            trx_update_callback(100.0f);
+            job->client->send(make_message("completed", {{"job", job_id}}));
+            return;
+        }
+        // The models are loaded by the first job that uses them and stay loaded. Loading a
+        // model takes a while so a job that is cancelled meanwhile stops before and after it.
+        auto throw_if_cancelled = [&job]() {
+            if (job->cancelled)
+                throw TranscriptionCancelledException();
+        };
+        throw_if_cancelled();
+        auto model = m_models_manager.get_model(job->options.model_name, job->options.model_type);
+        DecodingOptions options = job->options.decoding_options;
+        if (!job->options.draft_model_name.empty() && job->options.decoder == TranscriptionDecoder::Greedy)
+            options.draft_model = m_models_manager.get_model(job->options.draft_model_name, job->options.model_type);
+        if (!job->options.segmentation_model_name.empty())
+            options.segmentation_model = m_models_manager.get_model(job->options.segmentation_model_name, job->options.model_type);
+        throw_if_cancelled();
+        options.is_cancelled = [&job]() { return job->cancelled.load(); };
+        capgen::transcribe(job->media_filepath, model, job->options.task, job->options.decoder,
+                           trx_start_callback, trx_update_callback, trx_segment_callback, options);
+        job->client->send(make_message("completed", {{"job", job_id}}));
+    }
+    catch (const TranscriptionCancelledException &)
+    {
+        job->client->send(make_message("cancelled", {{"job", job_id}}));
+    }
+    catch (const std::exception &e)
+    {
+        CG_LOG_ERROR("Job %s failed: %s", job_id.c_str(), e.what());
+        job->client->send(make_message("failed", {{"job", job_id}, {"message", e.what()}}));
+    }
+}
+
+} // namespace capgen
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "core/models_manager.h"
+#include "core/transcribe.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+namespace capgen {
+
+/// A client connected to the server. Messages to the client are sent both by the thread that
+/// reads its requests and by the transcribing thread.
+class ClientConnection {
+public:
+    ClientConnection(int fd) : m_fd(fd) {}
+    ~ClientConnection();
+    ClientConnection(const ClientConnection&) = delete;
+    ClientConnection& operator=(const ClientConnection&) = delete;
+
+    /// @brief Sends a message, see `TranscriptionServer` for the format. Messages to a client
+    ///  that disconnected are dropped.
+    void send(const std::string &message);
+    /// @brief Reads the next message. Returns false once the client disconnects or sends an
+    ///  invalid frame.
+    bool receive(std::string &message);
+    /// @brief Unblocks `receive` and drops the messages sent after it.
+    void shutdown();
+
+private:
+    int m_fd;
+    std::mutex m_send_mutex;
+    std::atomic<bool> m_open{true};
+};
+
+/// Options of a transcription, see `transcribe`. The models are given by name.
+struct JobOptions {
+    std::string model_name;
+    ModelType model_type = ModelType::Multilingual;
+    TranscriptionTask task = TranscriptionTask::Transcribe;
+    TranscriptionDecoder decoder = TranscriptionDecoder::Greedy;
+    std::string draft_model_name;
+    std::string segmentation_model_name;
+    DecodingOptions decoding_options;
+};
+
+/// A transcription requested by a client.
+struct TranscriptionJob {
+    uint64_t id;
+    // Jobs with a higher priority run first and jobs of the same priority run in the order
+    // in which they were submitted.
+    int priority = 0;
+    std::filesystem::path media_filepath;
+    JobOptions options;
+    std::shared_ptr<ClientConnection> client;
+    std::atomic<bool> cancelled{false};
+};
+
+/// @brief Serves transcriptions over a Unix domain socket to clients on the same host. The
+///  models stay loaded between jobs so a job only pays for its own transcription. Jobs are
+///  queued by priority and transcribed one at a time, which is what the models support, and
+///  the text of every segment is streamed to the client that submitted the job as soon as
+///  it is transcribed.
+///
+///  Every message, in both directions, is a frame made of the size of the payload in bytes,
+///  as a little-endian uint32, followed by the payload. The payload is text whose first line
+///  is the type of the message and whose other lines are `key=value` fields. Requests are:
+///   ~ `submit`: Queues a transcription. Fields are `file`, which is required, `priority`,
+///     `model`, `model_type`, `task`, `decoder`, `output_dir`, `start`, `end`, `tempo`,
+///     `draft_model` and `segmentation_model` with the values of the capgen-cli options of
+///     the same name. The output directory is created if it does not exist. Replied to with
+///     `accepted`, the `job` id and the number of `queued` jobs.
+///   ~ `cancel`: Cancels the job with the given `job` id, which must have been submitted by
+///     the same client. A queued job is removed from the queue and a running job stops
+///     before its next segment.
+///   ~ `stats`: Replied to with `stats`, the number of `queued` jobs and the numbers of
+///     `cache_hits` and `cache_misses` of the transcript cache since the server started.
+///  The events of a job, all with its `job` id, are `started`, `progress` with the `percent`
+///  done, `segment` with the `text` of a segment, then either `completed`, `cancelled` or
+///  `failed` with an error `message`. The segments of a cached transcript are sent as well.
+///  Invalid requests are replied to with `error` and a `message`. The jobs of a client that
+///  disconnects are cancelled.
+class TranscriptionServer {
+public:
+    /// @param default_options Options of the jobs that do not set them.
+    TranscriptionServer(const std::filesystem::path &socket_path,
+                        ModelsManager &models_manager,
+                        const JobOptions &default_options);
+    ~TranscriptionServer();
+    TranscriptionServer(const TranscriptionServer&) = delete;
+    TranscriptionServer& operator=(const TranscriptionServer&) = delete;
+
+    /// @brief Accepts clients until `stop` is called, from any thread or a signal handler.
+    void run();
+    static void stop();
+
+private:
+    void serve_client(std::shared_ptr<ClientConnection> client);
+    void handle_request(const std::shared_ptr<ClientConnection> &client, const std::string &request);
+    void submit(const std::shared_ptr<ClientConnection> &client, const std::map<std::string, std::string> &fields);
+    void cancel(const std::shared_ptr<ClientConnection> &client, const std::map<std::string, std::string> &fields);
+    void send_stats(const std::shared_ptr<ClientConnection> &client);
+    void cancel_client_jobs(const std::shared_ptr<ClientConnection> &client);
+    void join_finished_client_threads();
+    void run_jobs();
+    void run_job(const std::shared_ptr<TranscriptionJob> &job);
+
+    std::filesystem::path m_socket_path;
+    ModelsManager &m_models_manager;
+    JobOptions m_default_options;
+    int m_listen_fd = -1;
+
+    // Queued jobs keyed by (-priority, id) so that the first job is the next to run, and the
+    // running job. Guarded by `m_jobs_mutex`.
+    std::map<std::pair<int, uint64_t>, std::shared_ptr<TranscriptionJob>> m_queued_jobs;
+    std::shared_ptr<TranscriptionJob> m_running_job;
+    uint64_t m_next_job_id = 1;
+    bool m_stopping = false;
+    std::mutex m_jobs_mutex;
+    std::condition_variable m_jobs_cv;
+
+    std::thread m_jobs_thread;
+    // The connected clients and the threads that serve them. The thread of a client that
+    // disconnects moves itself to `m_finished_client_threads`, which the accepting thread
+    // joins. Guarded by `m_clients_mutex`.
+    std::map<std::shared_ptr<ClientConnection>, std::thread> m_clients;
+    std::vector<std::thread> m_finished_client_threads;
+    std::mutex m_clients_mutex;
+    std::condition_variable m_clients_cv;
+};
+
+} // namespace capgen
@@ -1,10 +1,18 @@
 #include "audio/caudio.h"
 #include "audio.h"
+#include "cache.h"
 #include "log.h"
 #include "utils.h"
 
 #include "exceptions.h"
 
+#include <cstring>
+
+
+// Identifies the parameters of the spectrogram computation in the keys of cached spectrograms.
+// Must be changed whenever the computation changes so that stale spectrograms are not used.
+static const char *s_FRONTEND_PARAMS = "sample_rate=16000,n_fft=400,hop_length=160,n_mels=80";
+
 
 namespace capgen {
 
@@ -24,13 +32,37 @@ AudioPreprocessor::~AudioPreprocessor()
     capi_free_audio_decode_output(&m_decode_output);
 }
 
-at::Tensor AudioPreprocessor::get_audio_spectrogram(const char *infilepath) const
+at::Tensor AudioPreprocessor::get_audio_spectrogram(const char *infilepath, float start_time, float end_time, float tempo) const
 {
-    int ret = capi_get_audio_signal(infilepath, m_decode_output);
+    uint64_t cache_key;
+    try {
+        cache_key = hash_bytes(s_FRONTEND_PARAMS, std::strlen(s_FRONTEND_PARAMS), hash_media_file(infilepath));
+        // The media hash only samples the file so an edit in place may keep it. The edit
+        // changes the modification time, as in the keys of the checkpoints.
+        const int64_t media_mtime = file_modification_time(infilepath);
+        cache_key = hash_bytes(&media_mtime, sizeof(media_mtime), cache_key);
+        const float audio_params[3] = {start_time, end_time, tempo};
+        cache_key = hash_bytes(audio_params, sizeof(audio_params), cache_key);
+    }
+    catch (const std::exception &e) {
+        throw MediaDecodingException();
+    }
+    const SpectrogramCache spectrogram_cache;
+    const at::Tensor cached_spectrogram = spectrogram_cache.get(cache_key);
+    if (cached_spectrogram.defined())
+        return cached_spectrogram;
+
+    int ret = capi_get_audio_signal_range(infilepath, start_time, end_time, m_decode_output);
     if (ret < 0)
         throw MediaDecodingException();
+    if (tempo != 1.0f && capi_change_tempo(m_decode_output, tempo) < 0)
+    {
+        CG_LOG_ERROR("Failed to change the tempo of the audio by %.2fx", tempo);
+        throw std::exception();
+    }
     const at::Tensor audio = get_audio_tensor();
     const at::Tensor spectrogram = get_audio_spectrogram(audio);
+    spectrogram_cache.put(cache_key, spectrogram);
     return spectrogram;
 }
 
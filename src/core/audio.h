@@ -13,7 +13,14 @@ class AudioPreprocessor {
 public:
     AudioPreprocessor(bool enable_logging = false);
     ~AudioPreprocessor();
-    at::Tensor get_audio_spectrogram(const char *infilepath) const;
+    /// @brief Returns the spectrogram of the audio between `start_time` and `end_time`, in
+    ///  seconds. A negative end time means the end of the audio. The audio is sped up by
+    ///  `tempo`, between 0.5 and 2.0, so the times in the spectrogram are times in the media
+    ///  divided by `tempo`.
+    at::Tensor get_audio_spectrogram(const char *infilepath,
+                                     float start_time = 0.0f,
+                                     float end_time = -1.0f,
+                                     float tempo = 1.0f) const;
 
 private:
     // TODO: Does forward slash work on Windows.
@@ -0,0 +1,94 @@
+#include "backend.h"
+#include "utils.h"
+#include "weights.h"
+#include "log.h"
+
+#include <torch/csrc/jit/codegen/fuser/interface.h>
+#include <torch/version.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <filesystem>
+
+
+static const char *s_MODULE_CACHE_DIR = "./assets/cache";
+
+
+namespace capgen {
+
+torch::jit::script::Module load_optimized_module(const std::string& path)
+{
+    // Allows the fuser to generate kernels for the elementwise operations on the CPU.
+    torch::jit::overrideCanFuseOnCPU(true);
+
+    // The optimized graph depends on the module and on the version of torch that optimized
+    // it. The module file is identified by its stamp, which is much cheaper than hashing
+    // its contents on every start.
+    char cache_name[64];
+    std::snprintf(cache_name, sizeof(cache_name), "%016" PRIx64 "-torch%s.pt", hash_file_stamp(path), TORCH_VERSION);
+    const std::filesystem::path cache_path = std::filesystem::path(s_MODULE_CACHE_DIR) / cache_name;
+    if (std::filesystem::exists(cache_path))
+    {
+        try {
+            torch::jit::script::Module module = torch::jit::load(cache_path.string());
+            CG_LOG_INFO("Loaded optimized module %s from %s", path.c_str(), cache_path.c_str());
+            return module;
+        }
+        catch (const c10::Error &e) {
+            CG_LOG_WARNING("Failed to load optimized module from %s, optimizing again", cache_path.c_str());
+        }
+    }
+
+    torch::jit::script::Module module = torch::jit::load(path);
+    // Freezing removes the attributes of a module, including `training`.
+    if (module.hasattr("training"))
+    {
+        CG_LOG_INFO("Module %s is not frozen, skipping inference optimizations", path.c_str());
+        return module;
+    }
+    module = torch::jit::optimize_for_inference(module);
+    try {
+        std::filesystem::create_directories(s_MODULE_CACHE_DIR);
+        module.save(cache_path.string());
+        CG_LOG_INFO("Saved optimized module %s to %s", path.c_str(), cache_path.c_str());
+    }
+    catch (const std::exception &e) {
+        // Some optimized graphs hold values that cannot be serialized. They are used as they
+        // are and the optimization is repeated on the next load.
+        CG_LOG_WARNING("Failed to save optimized module to %s: %s", cache_path.c_str(), e.what());
+    }
+    return module;
+}
+
+TorchScriptDecoder::TorchScriptDecoder(const std::string& path, const std::string& weights_path)
+{
+    if (weights_path.empty())
+        m_module = load_optimized_module(path);
+    else
+    {
+        m_module = torch::jit::load(path);
+        assign_weights(m_module, load_weights(weights_path));
+    }
+}
+
+at::Tensor TorchScriptDecoder::logits(const at::Tensor& tokens,
+                                      const at::Tensor& audio_features,
+                                      int audio_id,
+                                      int64_t n_last)
+{
+    // The scripted decoder recomputes its cross-attention cache whenever the index tensor
+    // it is given differs from the one of the previous call.
+    if (audio_id != m_audio_id || !m_audio_id_tensor.defined())
+    {
+        m_audio_id = audio_id;
+        m_audio_id_tensor = at::tensor({audio_id});
+    }
+    // `forward` takes its inputs by value, which costs a small allocation per step whether or
+    // not the vector is kept between calls.
+    const at::Tensor logits = m_module.forward({tokens, audio_features, m_audio_id_tensor}).toTensor();
+    if (n_last > 0 && n_last < logits.size(1))
+        return logits.narrow(1, logits.size(1) - n_last, n_last);
+    return logits;
+}
+
+} // namespace capgen
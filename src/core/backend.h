@@ -0,0 +1,61 @@
+#pragma once
+
+#include <torch/script.h>
+
+#include <string>
+#include <vector>
+
+
+namespace capgen {
+
+/// @brief Loads a scripted module and applies the inference optimizations of libtorch to it,
+///  with CPU fusion enabled. The optimized module is saved in `./assets/cache/`, keyed by the
+///  hash of the module file and the libtorch version, so later loads of the same module skip
+///  the optimization. Modules that are not frozen, i.e the reduced precision variants, are
+///  returned as loaded because optimizing them would freeze their weights to fp32.
+torch::jit::script::Module load_optimized_module(const std::string& path);
+
+enum class DecoderBackendType {
+  TorchScript,
+  Native
+};
+
+/// @brief Computes the logits of the text decoder. Backends keep the cross-attention keys
+///  and values of the audio features they were last called with and only recompute them
+///  when `audio_id` changes, so the caller must give different audio features different ids.
+class DecoderBackend {
+public:
+    virtual ~DecoderBackend() = default;
+    /// @brief Computes the logits of the last `n_last` positions of every sequence in `tokens`,
+    ///  or of all the positions if `n_last` is not positive. Returns a [n_seqs, n_last, n_vocab]
+    ///  float tensor.
+    virtual at::Tensor logits(const at::Tensor& tokens,
+                              const at::Tensor& audio_features,
+                              int audio_id,
+                              int64_t n_last) = 0;
+    virtual const char *name() const = 0;
+};
+
+
+/// @brief Runs the scripted decoder module exported by `cpp_model_gen.py`. This is the
+///  reference implementation.
+class TorchScriptDecoder : public DecoderBackend {
+public:
+    /// @param weights_path The weights file of a module exported without its weights. The
+    ///  module is loaded as it is if it is empty.
+    TorchScriptDecoder(const std::string& path, const std::string& weights_path = "");
+    at::Tensor logits(const at::Tensor& tokens,
+                      const at::Tensor& audio_features,
+                      int audio_id,
+                      int64_t n_last) override;
+    const char *name() const override { return "torchscript"; }
+
+private:
+    torch::jit::script::Module m_module;
+    // The audio id tensor is kept between calls so that it is only created when the id
+    // changes rather than on every decoding step.
+    int m_audio_id = -1;
+    at::Tensor m_audio_id_tensor;
+};
+
+} // namespace capgen
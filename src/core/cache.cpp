@@ -0,0 +1,253 @@
+#include "cache.h"
+#include "log.h"
+#include "utils.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+
+// Cached spectrogram files start with this magic followed by the format version, the number
+// of mel bins and the number of frames. The float data follows the header. The version must
+// be changed whenever the decoding of the audio changes. Version 2 positions the decoded
+// range relative to the start of the stream.
+static const char s_SPECTROGRAM_MAGIC[4] = {'C', 'G', 'M', 'S'};
+static const uint32_t s_SPECTROGRAM_VERSION = 2;
+static const size_t s_SPECTROGRAM_HEADER_SIZE = 16;
+// Numbers the temporary files of the entries written by the process.
+static std::atomic<uint64_t> s_n_temp_files = 0;
+
+
+// Returns a path next to `path` at which no other process or thread writes, in which an
+// entry is written before it is renamed to `path`.
+static std::filesystem::path temp_path(const std::filesystem::path& path)
+{
+    std::filesystem::path tmp_path = path;
+    tmp_path += "." + std::to_string(getpid()) + "." + std::to_string(s_n_temp_files++) + ".tmp";
+    return tmp_path;
+}
+
+// Deletes the least recently used entries with the given extension, i.e those with the oldest
+// modification time, until the entries in the directory take at most `max_size` bytes.
+static void evict_least_recently_used(const std::filesystem::path& directory, const char *extension, uint64_t max_size)
+{
+    std::error_code error;
+    std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> entries;
+    uint64_t total_size = 0;
+    for (const auto &entry : std::filesystem::directory_iterator(directory, error))
+    {
+        if (entry.path().extension() != extension)
+            continue;
+        const uint64_t size = entry.file_size(error);
+        const auto last_use_time = entry.last_write_time(error);
+        if (error)
+            continue;
+        total_size += size;
+        entries.push_back({last_use_time, entry.path()});
+    }
+    // The least recently used entries are deleted first.
+    std::sort(entries.begin(), entries.end());
+    for (const auto &[last_use_time, path] : entries)
+    {
+        if (total_size <= max_size)
+            break;
+        const uint64_t size = std::filesystem::file_size(path, error);
+        if (std::filesystem::remove(path, error))
+        {
+            total_size -= size;
+            CG_LOG_INFO("Evicted cache entry %s", path.c_str());
+        }
+    }
+}
+
+
+// Returns the window of `n_frames` frames that begins at `start_frame`. If the spectrogram
+// ends before the window does, the window is padded with zeros.
+static at::Tensor pad_or_trim(const at::Tensor &spectrogram, int start_frame, int n_frames)
+{
+    const int end_frame = start_frame + n_frames;
+    const int64_t total_frames = spectrogram.size(-1);
+    if (total_frames - start_frame >= n_frames)
+        return spectrogram.index_select(-1, at::arange(start_frame, end_frame));
+    else
+    {
+        // Add the required number of frames.
+        const int needed_extra_frames = n_frames - (total_frames - start_frame);
+        at::Tensor padded_spectrogram = at::pad(spectrogram, {0, needed_extra_frames, 0, 0});
+        return padded_spectrogram.index_select(-1, at::arange(start_frame, end_frame));
+    }
+}
+
+
+namespace capgen {
+
+AudioFeaturesCache::AudioFeaturesCache(uint32_t capacity)
+  : m_capacity(capacity)
+{}
+
+at::Tensor AudioFeaturesCache::get_audio_features(std::shared_ptr<Whisper> model,
+                                                  const at::Tensor& spectrogram,
+                                                  uint32_t start_frame,
+                                                  uint32_t n_frames)
+{
+    for (auto it = m_entries.begin(); it != m_entries.end(); ++it)
+        if (it->model == model.get() && it->start_frame == start_frame && it->n_frames == n_frames)
+        {
+            CG_LOG_DEBUG("Audio features cache hit: start_frame=%d", start_frame);
+            // Move the entry to the front so that it is evicted last.
+            m_entries.splice(m_entries.begin(), m_entries, it);
+            return m_entries.front().audio_features;
+        }
+
+    const at::Tensor segment_spec = pad_or_trim(spectrogram, start_frame, n_frames);
+    const at::Tensor audio_features = model->embed_audio(segment_spec);
+    m_entries.push_front({model.get(), start_frame, n_frames, audio_features});
+    if (m_entries.size() > m_capacity)
+        m_entries.pop_back();
+    return audio_features;
+}
+
+void AudioFeaturesCache::clear()
+{
+    m_entries.clear();
+}
+
+
+SpectrogramCache::SpectrogramCache(const std::filesystem::path& directory, uint64_t max_size)
+  : m_directory(directory), m_max_size(max_size)
+{}
+
+std::filesystem::path SpectrogramCache::entry_path(uint64_t key) const
+{
+    char entry_name[32];
+    std::snprintf(entry_name, sizeof(entry_name), "%016" PRIx64 ".mel", key);
+    return m_directory / entry_name;
+}
+
+at::Tensor SpectrogramCache::get(uint64_t key) const
+{
+    const std::filesystem::path path = entry_path(key);
+    if (!std::filesystem::exists(path))
+        return at::Tensor();
+    try
+    {
+        const auto file = std::make_shared<MappedFile>(path.string());
+        char magic[4];
+        uint32_t header[3];
+        if (file->size() < s_SPECTROGRAM_HEADER_SIZE)
+            throw std::exception();
+        std::memcpy(magic, file->data(), sizeof(magic));
+        std::memcpy(header, file->data() + sizeof(magic), sizeof(header));
+        const uint32_t version = header[0], n_mels = header[1], n_frames = header[2];
+        if (std::memcmp(magic, s_SPECTROGRAM_MAGIC, sizeof(magic)) != 0 || version != s_SPECTROGRAM_VERSION
+            || file->size() != s_SPECTROGRAM_HEADER_SIZE + (uint64_t)n_mels * n_frames * sizeof(float))
+            throw std::exception();
+        // Marks the entry as the most recently used.
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now());
+        CG_LOG_INFO("Spectrogram cache hit: %s", path.c_str());
+        // The spectrogram is only read so the read-only mapping is safe to use. The tensor
+        // holds a reference to the mapping.
+        void *data = const_cast<char *>(file->data() + s_SPECTROGRAM_HEADER_SIZE);
+        return at::from_blob(data, {1, n_mels, n_frames}, [file](void *) {}, at::TensorOptions(at::kFloat));
+    }
+    catch (const std::exception &e)
+    {
+        CG_LOG_WARNING("Discarding invalid cached spectrogram %s", path.c_str());
+        std::error_code error;
+        std::filesystem::remove(path, error);
+        return at::Tensor();
+    }
+}
+
+void SpectrogramCache::put(uint64_t key, const at::Tensor& spectrogram) const
+{
+    std::error_code error;
+    std::filesystem::create_directories(m_directory, error);
+    const std::filesystem::path path = entry_path(key);
+    // Written to a temporary file first so that a partially written entry is never read.
+    const std::filesystem::path tmp_path = temp_path(path);
+    std::FILE *outfile = std::fopen(tmp_path.c_str(), "wb");
+    if (!outfile)
+    {
+        CG_LOG_WARNING("Failed to create cached spectrogram %s", tmp_path.c_str());
+        return;
+    }
+    const at::Tensor data = spectrogram.to(at::kFloat).contiguous();
+    const uint32_t header[3] = {s_SPECTROGRAM_VERSION, (uint32_t)data.size(-2), (uint32_t)data.size(-1)};
+    bool ok = std::fwrite(s_SPECTROGRAM_MAGIC, sizeof(s_SPECTROGRAM_MAGIC), 1, outfile) == 1;
+    ok = ok && std::fwrite(header, sizeof(header), 1, outfile) == 1;
+    ok = ok && std::fwrite(data.data_ptr<float>(), sizeof(float), data.numel(), outfile) == (size_t)data.numel();
+    ok = (std::fclose(outfile) == 0) && ok;
+    if (ok)
+        std::filesystem::rename(tmp_path, path, error);
+    if (!ok || error)
+    {
+        CG_LOG_WARNING("Failed to write cached spectrogram %s", path.c_str());
+        std::filesystem::remove(tmp_path, error);
+        return;
+    }
+    evict();
+}
+
+void SpectrogramCache::evict() const
+{
+    evict_least_recently_used(m_directory, ".mel", m_max_size);
+}
+
+
+std::atomic<uint64_t> TranscriptCache::s_n_hits = 0;
+std::atomic<uint64_t> TranscriptCache::s_n_misses = 0;
+
+TranscriptCache::TranscriptCache(const std::filesystem::path& directory, uint64_t max_size)
+  : m_directory(directory), m_max_size(max_size)
+{}
+
+std::filesystem::path TranscriptCache::entry_path(const CheckpointKey& key) const
+{
+    char entry_name[32];
+    std::snprintf(entry_name, sizeof(entry_name), "%016" PRIx64 ".trx", checkpoint_key_hash(key));
+    return m_directory / entry_name;
+}
+
+bool TranscriptCache::get(const CheckpointKey& key,
+                          bool dual_task,
+                          std::vector<SegmentTranscription>& transcriptions,
+                          std::vector<SegmentTranscription>& translations) const
+{
+    const std::filesystem::path path = entry_path(key);
+    CheckpointAudio audio;
+    uint32_t seek = 0;
+    // The entry is also checked against the key because different keys may have the same hash.
+    const bool is_hit = std::filesystem::exists(path) && read_checkpoint(path, key, dual_task, audio, seek, transcriptions, translations) > 0;
+    if (is_hit)
+    {
+        s_n_hits += 1;
+        // Marks the entry as the most recently used.
+        std::error_code error;
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+    }
+    else
+    {
+        s_n_misses += 1;
+        transcriptions.clear();
+        translations.clear();
+    }
+    CG_LOG_INFO("Transcript cache %s: hits=%d, misses=%d", is_hit ? "hit" : "miss", (int)s_n_hits, (int)s_n_misses);
+    return is_hit;
+}
+
+void TranscriptCache::put(TranscriptionCheckpoint& checkpoint, const CheckpointKey& key) const
+{
+    checkpoint.complete(entry_path(key));
+    evict_least_recently_used(m_directory, ".trx", m_max_size);
+}
+
+} // namespace capgen
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "checkpoint.h"
+#include "decoder.h"
+#include "model.h"
+
+#include <ATen/ATen.h>
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <vector>
+
+
+namespace capgen {
+
+/// @brief Keeps the encoder outputs (audio features) of the most recently embedded
+///  windows so that language detection, decoding and any re-decoding of the same window
+///  share a single encoder pass. Entries are keyed by the model and the position and
+///  length of the window. A cache instance is meant to live for a single transcription
+///  and must therefore only be used with one spectrogram.
+class AudioFeaturesCache {
+public:
+    AudioFeaturesCache(uint32_t capacity = 2);
+    /// @brief Returns the audio features of the window of `n_frames` frames that begins
+    ///  at `start_frame`. The encoder is only run if the window is not cached.
+    at::Tensor get_audio_features(std::shared_ptr<Whisper> model,
+                                  const at::Tensor& spectrogram,
+                                  uint32_t start_frame,
+                                  uint32_t n_frames = 3000);
+    void clear();
+
+private:
+    struct Entry {
+        const Whisper *model;
+        uint32_t start_frame;
+        uint32_t n_frames;
+        at::Tensor audio_features;
+    };
+
+    // Maximum number of windows held at once.
+    uint32_t m_capacity;
+    // Cached windows ordered from the most recently used to the least recently used.
+    std::list<Entry> m_entries;
+};
+
+
+/// @brief Keeps the log-mel spectrograms of previously decoded media files on disk so that
+///  transcribing the same media again, e.g with another model or task, does not decode its
+///  audio again. Entries are keyed by a hash of the media contents and of the parameters of
+///  the spectrogram computation. Cached spectrograms are memory-mapped rather than read. The
+///  least recently used entries are deleted once the cache exceeds `max_size` bytes.
+class SpectrogramCache {
+public:
+    SpectrogramCache(const std::filesystem::path& directory = "./assets/cache/spectrograms",
+                     uint64_t max_size = 2ULL << 30);
+    /// @brief Returns the cached spectrogram or an undefined tensor if it is not cached.
+    at::Tensor get(uint64_t key) const;
+    /// @brief Caches the spectrogram. Failures are logged and otherwise ignored.
+    void put(uint64_t key, const at::Tensor& spectrogram) const;
+
+private:
+    std::filesystem::path m_directory;
+    uint64_t m_max_size;
+
+    std::filesystem::path entry_path(uint64_t key) const;
+    void evict() const;
+};
+
+
+/// @brief Keeps the transcripts of completed transcriptions on disk so that transcribing
+///  the same media again with the same model files, task, decoder and segmentation model
+///  writes the srt files from the cached segments without loading the model. A transcript
+///  is the checkpoint of its transcription once it is complete. The least recently used
+///  entries are deleted once the cache exceeds `max_size` bytes.
+class TranscriptCache {
+public:
+    TranscriptCache(const std::filesystem::path& directory = "./assets/cache/transcripts",
+                    uint64_t max_size = 64ULL << 20);
+    /// @brief Reads the segments of the cached transcript into `transcriptions` and, in
+    ///  dual-task mode, `translations`.
+    /// @return Whether the transcript is cached.
+    bool get(const CheckpointKey& key,
+             bool dual_task,
+             std::vector<SegmentTranscription>& transcriptions,
+             std::vector<SegmentTranscription>& translations) const;
+    /// @brief Caches the complete transcription recorded by the checkpoint.
+    void put(TranscriptionCheckpoint& checkpoint, const CheckpointKey& key) const;
+    /// @brief The path at which the transcript of the transcription is cached.
+    std::filesystem::path entry_path(const CheckpointKey& key) const;
+
+    /// Numbers of lookups, by all the caches of the process, that found or did not find the
+    /// transcript. Reported in the log after every lookup.
+    static uint64_t n_hits() { return s_n_hits; }
+    static uint64_t n_misses() { return s_n_misses; }
+
+private:
+    std::filesystem::path m_directory;
+    uint64_t m_max_size;
+
+    static std::atomic<uint64_t> s_n_hits;
+    static std::atomic<uint64_t> s_n_misses;
+};
+
+} // namespace capgen
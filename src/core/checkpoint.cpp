@@ -0,0 +1,343 @@
+#include "checkpoint.h"
+#include "log.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <system_error>
+
+
+static const char *s_CHECKPOINT_DIR = "./assets/checkpoints";
+// Checkpoint files start with this magic followed by the format version, the key of the
+// transcription, its audio and then its segments. Version 6 records the audio and version 7
+// the decoding options.
+static const char s_CHECKPOINT_MAGIC[4] = {'C', 'G', 'C', 'K'};
+static const uint32_t s_CHECKPOINT_VERSION = 7;
+// Must be incremented whenever a change to the decoding changes the transcripts so that the
+// checkpoints and cached transcripts of older versions are discarded.
+static const uint32_t s_DECODING_VERSION = 1;
+
+
+namespace {
+
+// Reads the values of a checkpoint file. Fails, rather than throwing, at the end of the
+// data because the last record is cut short if the process died while writing it.
+class RecordReader {
+public:
+    RecordReader(const std::vector<char>& data) : m_data(data) {}
+
+    template <typename T>
+    bool read(T& value) { return read_bytes(&value, sizeof(T)); }
+
+    bool read_bytes(void *out, size_t n_bytes)
+    {
+        if (m_offset + n_bytes > m_data.size())
+            return false;
+        std::memcpy(out, m_data.data() + m_offset, n_bytes);
+        m_offset += n_bytes;
+        return true;
+    }
+
+    bool read_segment(capgen::SegmentTranscription& segment)
+    {
+        uint32_t stop_reason, n_sub_segments;
+        if (!read(segment.m_segment_index) || !read(segment.m_end_time) || !read(stop_reason) || !read(n_sub_segments))
+            return false;
+        segment.m_stop_reason = static_cast<capgen::DecodingStopReason>(stop_reason);
+        for (uint32_t i = 0; i < n_sub_segments; ++i)
+        {
+            capgen::TimestampedTranscription sub_segment;
+            uint32_t n_tokens;
+            if (!read(sub_segment.m_start_time) || !read(sub_segment.m_end_time) || !read(n_tokens))
+                return false;
+            if (m_offset + (uint64_t)n_tokens * sizeof(uint32_t) > m_data.size())
+                return false;
+            sub_segment.m_text_tokens.resize(n_tokens);
+            read_bytes(sub_segment.m_text_tokens.data(), n_tokens * sizeof(uint32_t));
+            segment.sub_segments.push_back(std::move(sub_segment));
+        }
+        return true;
+    }
+
+    bool read_string(std::string& value)
+    {
+        uint32_t size;
+        if (!read(size) || m_offset + size > m_data.size())
+            return false;
+        value.assign(m_data.data() + m_offset, size);
+        m_offset += size;
+        return true;
+    }
+
+    size_t offset() const { return m_offset; }
+
+private:
+    const std::vector<char>& m_data;
+    size_t m_offset = 0;
+};
+
+template <typename T>
+void write_value(std::FILE *file, const T& value)
+{
+    std::fwrite(&value, sizeof(T), 1, file);
+}
+
+void write_string(std::FILE *file, const std::string& value)
+{
+    write_value(file, (uint32_t)value.size());
+    std::fwrite(value.data(), 1, value.size(), file);
+}
+
+void write_segment(std::FILE *file, const capgen::SegmentTranscription& segment)
+{
+    write_value(file, segment.m_segment_index);
+    write_value(file, segment.m_end_time);
+    write_value(file, (uint32_t)segment.m_stop_reason);
+    write_value(file, (uint32_t)segment.sub_segments.size());
+    for (const auto &sub_segment : segment.sub_segments)
+    {
+        write_value(file, sub_segment.m_start_time);
+        write_value(file, sub_segment.m_end_time);
+        write_value(file, (uint32_t)sub_segment.m_text_tokens.size());
+        std::fwrite(sub_segment.m_text_tokens.data(), sizeof(uint32_t), sub_segment.m_text_tokens.size(), file);
+    }
+}
+
+// The integer and real decoding options of the key, in the order they are hashed and written.
+void decoding_limits(const capgen::CheckpointKey& key, uint32_t (&limits)[4])
+{
+    limits[0] = key.n_beam;
+    limits[1] = key.repetition_max_ngram;
+    limits[2] = key.repetition_min_repeats;
+    limits[3] = key.repetition_min_tokens;
+}
+
+void decoding_thresholds(const capgen::CheckpointKey& key, float (&thresholds)[4])
+{
+    thresholds[0] = key.logprob_threshold;
+    thresholds[1] = key.compression_ratio_threshold;
+    thresholds[2] = key.max_tokens_per_second;
+    thresholds[3] = key.no_speech_threshold;
+}
+
+} // namespace
+
+
+namespace capgen {
+
+uint64_t checkpoint_key_hash(const CheckpointKey& key)
+{
+    uint64_t hash = hash_bytes(&key.media_hash, sizeof(key.media_hash));
+    hash = hash_bytes(&key.media_mtime, sizeof(key.media_mtime), hash);
+    hash = hash_bytes(&key.model_version, sizeof(key.model_version), hash);
+    hash = hash_bytes(key.model_name.data(), key.model_name.size(), hash);
+    const uint32_t options[3] = {(uint32_t)key.model_type, (uint32_t)key.task, (uint32_t)key.decoder};
+    hash = hash_bytes(options, sizeof(options), hash);
+    hash = hash_bytes(key.segmentation_model_name.data(), key.segmentation_model_name.size(), hash);
+    const float audio_params[3] = {key.start_time, key.end_time, key.tempo};
+    hash = hash_bytes(audio_params, sizeof(audio_params), hash);
+    uint32_t limits[4];
+    float thresholds[4];
+    decoding_limits(key, limits);
+    decoding_thresholds(key, thresholds);
+    hash = hash_bytes(limits, sizeof(limits), hash);
+    return hash_bytes(thresholds, sizeof(thresholds), hash);
+}
+
+TranscriptionCheckpoint::TranscriptionCheckpoint(const CheckpointKey& key, bool dual_task)
+  : m_dual_task(dual_task)
+{
+    char checkpoint_name[32];
+    std::snprintf(checkpoint_name, sizeof(checkpoint_name), "%016" PRIx64 ".ckpt", checkpoint_key_hash(key));
+    m_path = std::filesystem::path(s_CHECKPOINT_DIR) / checkpoint_name;
+
+    std::error_code error;
+    std::filesystem::create_directories(s_CHECKPOINT_DIR, error);
+    const int fd = open(m_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        CG_LOG_WARNING("Failed to open transcription checkpoint %s, progress will not be saved", m_path.c_str());
+        return;
+    }
+    // The lock is held until the file is closed. It is not waited for because the other
+    // transcription records the same segments. A checkpoint that was completed, i.e moved
+    // to the transcript cache, between the open and the lock must not be written to.
+    struct stat locked_stat, path_stat;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &locked_stat) != 0 || stat(m_path.c_str(), &path_stat) != 0
+        || locked_stat.st_ino != path_stat.st_ino || locked_stat.st_dev != path_stat.st_dev)
+    {
+        CG_LOG_WARNING("Transcription checkpoint %s is used by another transcription, progress will not be saved", m_path.c_str());
+        close(fd);
+        return;
+    }
+    const uint64_t valid_size = read_checkpoint(m_path, key, m_dual_task, m_audio, m_seek, m_transcriptions, m_translations);
+    // Drops a partially written record so that the next record follows the last valid one,
+    // or the whole file if it is not a checkpoint of this transcription.
+    if (ftruncate(fd, valid_size) != 0 || !(m_file = fdopen(fd, "ab")))
+    {
+        close(fd);
+        m_seek = 0;
+        m_audio = CheckpointAudio();
+        m_transcriptions.clear();
+        m_translations.clear();
+    }
+    else if (valid_size == 0)
+    {
+        std::fwrite(s_CHECKPOINT_MAGIC, 1, sizeof(s_CHECKPOINT_MAGIC), m_file);
+        write_value(m_file, s_CHECKPOINT_VERSION);
+        write_value(m_file, s_DECODING_VERSION);
+        write_value(m_file, key.media_hash);
+        write_value(m_file, key.media_mtime);
+        write_value(m_file, key.model_version);
+        write_value(m_file, (uint32_t)key.model_type);
+        write_value(m_file, (uint32_t)key.task);
+        write_value(m_file, (uint32_t)key.decoder);
+        write_string(m_file, key.model_name);
+        write_string(m_file, key.segmentation_model_name);
+        write_value(m_file, key.start_time);
+        write_value(m_file, key.end_time);
+        write_value(m_file, key.tempo);
+        uint32_t limits[4];
+        float thresholds[4];
+        decoding_limits(key, limits);
+        decoding_thresholds(key, thresholds);
+        write_value(m_file, limits);
+        write_value(m_file, thresholds);
+        std::fflush(m_file);
+    }
+    if (!m_file)
+        CG_LOG_WARNING("Failed to open transcription checkpoint %s, progress will not be saved", m_path.c_str());
+    if (m_seek > 0)
+        CG_LOG_INFO("Restored %d segments from transcription checkpoint %s", (int)m_transcriptions.size(), m_path.c_str());
+}
+
+TranscriptionCheckpoint::~TranscriptionCheckpoint()
+{
+    if (m_file)
+        std::fclose(m_file);
+}
+
+uint64_t read_checkpoint(const std::filesystem::path& path,
+                         const CheckpointKey& key,
+                         bool dual_task,
+                         CheckpointAudio& audio,
+                         uint32_t& seek,
+                         std::vector<SegmentTranscription>& transcriptions,
+                         std::vector<SegmentTranscription>& translations)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return 0;
+    const std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    // The file of a new checkpoint is created empty.
+    if (data.empty())
+        return 0;
+    RecordReader reader(data);
+
+    char magic[4];
+    uint32_t version, decoding_version, model_type, task, decoder;
+    uint64_t media_hash, model_version;
+    int64_t media_mtime;
+    float start_time, end_time, tempo;
+    uint32_t limits[4], key_limits[4];
+    float thresholds[4], key_thresholds[4];
+    std::string model_name, segmentation_model_name;
+    if (!reader.read_bytes(magic, sizeof(magic)) || !reader.read(version)
+        || std::memcmp(magic, s_CHECKPOINT_MAGIC, sizeof(magic)) != 0 || version != s_CHECKPOINT_VERSION)
+    {
+        CG_LOG_WARNING("Discarding invalid transcription checkpoint %s", path.c_str());
+        return 0;
+    }
+    if (!reader.read(decoding_version) || !reader.read(media_hash) || !reader.read(media_mtime) || !reader.read(model_version) || !reader.read(model_type)
+        || !reader.read(task) || !reader.read(decoder) || !reader.read_string(model_name) || !reader.read_string(segmentation_model_name)
+        || !reader.read(start_time) || !reader.read(end_time) || !reader.read(tempo) || !reader.read(limits) || !reader.read(thresholds))
+        return 0;
+    decoding_limits(key, key_limits);
+    decoding_thresholds(key, key_thresholds);
+    if (decoding_version != s_DECODING_VERSION || media_hash != key.media_hash || media_mtime != key.media_mtime
+        || model_version != key.model_version
+        || model_name != key.model_name || model_type != (uint32_t)key.model_type || task != (uint32_t)key.task
+        || decoder != (uint32_t)key.decoder || segmentation_model_name != key.segmentation_model_name
+        || start_time != key.start_time || end_time != key.end_time || tempo != key.tempo
+        || std::memcmp(limits, key_limits, sizeof(limits)) != 0 || std::memcmp(thresholds, key_thresholds, sizeof(thresholds)) != 0)
+    {
+        CG_LOG_INFO("Discarding transcription checkpoint %s of model %s", path.c_str(), model_name.c_str());
+        return 0;
+    }
+
+    // A checkpoint whose audio was not written to the end holds no segments.
+    uint64_t valid_size = reader.offset();
+    CheckpointAudio recorded_audio;
+    if (!reader.read(recorded_audio.language_id) || !reader.read(recorded_audio.n_frames))
+        return valid_size;
+    audio = recorded_audio;
+    valid_size = reader.offset();
+    while (true)
+    {
+        uint32_t segment_seek;
+        SegmentTranscription transcription(0, 0.0f);
+        SegmentTranscription translation(0, 0.0f);
+        if (!reader.read(segment_seek) || !reader.read_segment(transcription))
+            break;
+        if (dual_task && !reader.read_segment(translation))
+            break;
+        seek = segment_seek;
+        transcriptions.push_back(std::move(transcription));
+        if (dual_task)
+            translations.push_back(std::move(translation));
+        valid_size = reader.offset();
+    }
+    return valid_size;
+}
+
+void TranscriptionCheckpoint::record_audio(const CheckpointAudio& audio)
+{
+    if (!m_file || m_audio.n_frames > 0)
+        return;
+    m_audio = audio;
+    write_value(m_file, m_audio.language_id);
+    write_value(m_file, m_audio.n_frames);
+    std::fflush(m_file);
+}
+
+void TranscriptionCheckpoint::append(const SegmentTranscription& transcription,
+                                     const SegmentTranscription* translation,
+                                     uint32_t seek)
+{
+    if (!m_file || m_audio.n_frames == 0)
+        return;
+    write_value(m_file, seek);
+    write_segment(m_file, transcription);
+    if (m_dual_task)
+        write_segment(m_file, *translation);
+    std::fflush(m_file);
+}
+
+void TranscriptionCheckpoint::complete(const std::filesystem::path& path)
+{
+    if (!m_file)
+        return;
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+    // The checkpoint is moved while it is locked so that no other transcription opens it
+    // in between.
+    const bool flushed = std::fflush(m_file) == 0 && fsync(fileno(m_file)) == 0;
+    if (flushed)
+        std::filesystem::rename(m_path, path, error);
+    if (!flushed || error)
+    {
+        CG_LOG_WARNING("Failed to move transcription checkpoint %s to %s", m_path.c_str(), path.c_str());
+        std::filesystem::remove(m_path, error);
+    }
+    std::fclose(m_file);
+    m_file = nullptr;
+}
+
+} // namespace capgen
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "decoder.h"
+#include "model.h"
+#include "transcribe.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+
+namespace capgen {
+
+/// Identifies a transcription. A checkpoint is only resumed by a transcription of the same
+/// media contents with the same model files, task, decoder, segmentation model and decoding
+/// options.
+struct CheckpointKey {
+    // Hash of the size and of parts of the contents of the media, see `hash_media_file`. The
+    // modification time of the media tells apart edits that the sampled hash misses.
+    uint64_t media_hash;
+    int64_t media_mtime;
+    std::string model_name;
+    ModelType model_type;
+    TranscriptionTask task;
+    TranscriptionDecoder decoder;
+    // Hash of the model files, see `model_files_hash`.
+    uint64_t model_version;
+    // Name of the model that finds the parts of the audio with speech, empty if none.
+    std::string segmentation_model_name;
+    // The transcribed part of the media and the tempo of the audio, see `DecodingOptions`.
+    float start_time;
+    float end_time;
+    float tempo;
+    // The decoding options that change the transcribed text, see `DecodingOptions`.
+    uint32_t n_beam;
+    float logprob_threshold;
+    float compression_ratio_threshold;
+    uint32_t repetition_max_ngram;
+    uint32_t repetition_min_repeats;
+    uint32_t repetition_min_tokens;
+    float max_tokens_per_second;
+    float no_speech_threshold;
+};
+
+/// The audio of a transcription. It is recorded in the checkpoint before the first segment so
+/// that a transcription that resumes only decodes the audio after the checkpoint.
+struct CheckpointAudio {
+    // Language token of the audio, see `detect_language`.
+    uint32_t language_id = 0;
+    // Number of spectrogram frames of the transcribed part of the media, zero if the audio
+    // was not recorded.
+    uint32_t n_frames = 0;
+};
+
+/// @brief Returns a hash of all the fields of the key, which names the checkpoint and the
+///  cached transcript of the transcription.
+uint64_t checkpoint_key_hash(const CheckpointKey& key);
+
+/// @brief Reads the segments of the checkpoint file of the transcription with the given key.
+/// @param audio Set to the recorded audio of the transcription, if any.
+/// @param seek Set to the frame after the last segment.
+/// @return The size of the valid prefix of the file, which excludes a partially written
+///  segment, or zero if the file is not a checkpoint of the transcription.
+uint64_t read_checkpoint(const std::filesystem::path& path,
+                         const CheckpointKey& key,
+                         bool dual_task,
+                         CheckpointAudio& audio,
+                         uint32_t& seek,
+                         std::vector<SegmentTranscription>& transcriptions,
+                         std::vector<SegmentTranscription>& translations);
+
+/// @brief Records the progress of the transcription of a media file so that a transcription
+///  that was cancelled or crashed resumes from the last transcribed segment instead of
+///  starting over. Every segment is appended to the checkpoint file, together with the
+///  position in the audio after it, as soon as it is decoded. A segment that was only
+///  partially written when the process died is discarded on restore. Every transcription
+///  has its own checkpoint file, which is locked while it is recorded, so that concurrent
+///  transcriptions of the same media in other processes neither discard nor corrupt it.
+class TranscriptionCheckpoint {
+public:
+    /// @brief Restores the checkpoint of the transcription, if there is one, and opens it for
+    ///  appending the next segments. If another transcription with the same key holds the
+    ///  checkpoint, nothing is restored or recorded.
+    TranscriptionCheckpoint(const CheckpointKey& key, bool dual_task);
+    ~TranscriptionCheckpoint();
+    TranscriptionCheckpoint(const TranscriptionCheckpoint&) = delete;
+    TranscriptionCheckpoint& operator=(const TranscriptionCheckpoint&) = delete;
+
+    /// @brief Records the audio of the transcription, unless it was restored. Segments are
+    ///  only appended once the audio is recorded.
+    void record_audio(const CheckpointAudio& audio);
+    /// @brief Appends a transcribed segment and, in dual-task mode, its translation.
+    /// @param seek The frame at which the next segment starts.
+    void append(const SegmentTranscription& transcription,
+                const SegmentTranscription* translation,
+                uint32_t seek);
+    /// @brief Moves the checkpoint of the complete transcription to `path`, where it holds
+    ///  all the segments of the transcription. The file is moved in a single rename so that
+    ///  readers of `path` never see a partial transcript.
+    void complete(const std::filesystem::path& path);
+
+    /// The frame at which the transcription resumes, zero if nothing was restored.
+    uint32_t seek() const { return m_seek; }
+    /// The recorded audio, whose `n_frames` is zero if it was neither restored nor recorded.
+    /// It is always restored along with the segments.
+    const CheckpointAudio& audio() const { return m_audio; }
+    /// The restored segments, in order. In dual-task mode, `restored_translations()` holds
+    /// the translation of every restored segment.
+    const std::vector<SegmentTranscription>& restored_transcriptions() const { return m_transcriptions; }
+    const std::vector<SegmentTranscription>& restored_translations() const { return m_translations; }
+
+private:
+    std::filesystem::path m_path;
+    bool m_dual_task;
+    // Null if the checkpoint file could not be created or locked, in which case nothing is
+    // recorded. Closing the file releases the lock.
+    std::FILE *m_file = nullptr;
+    uint32_t m_seek = 0;
+    CheckpointAudio m_audio;
+    std::vector<SegmentTranscription> m_transcriptions;
+    std::vector<SegmentTranscription> m_translations;
+};
+
+} // namespace capgen
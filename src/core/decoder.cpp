@@ -3,118 +3,293 @@
 #include "tokenizer.h"
 #include "utils.h"
 
+#include <zlib.h>
+
 #include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <string>
 #include <vector>
 
 
 
+// Largest number of beams of beamsearch. Every beam is a row of the decoder batch and of
+// the tokens buffer.
+static const int s_MAX_BEAMS = 32;
+
 // All non-language tokens that are suppressed during decoding.
-static const at::Tensor s_ENGLISH_VOCAB_BAD_TOKENS = at::tensor(
-    {
-        1, 2, 7, 8, 9, 10, 14, 25, 26, 27, 28, 29, 31, 58, 59, 60, 61, 62, 63, 90, 91, 92,
-        93, 357, 366, 438, 532, 685, 705, 796, 930, 1058, 1220, 1267, 1279, 1303, 1343, 1377,
-        1391, 1635, 1782, 1875, 2162, 2361, 2488, 3467, 3880, 4008, 4211, 4600, 4808, 5299,
-        5855, 6329, 7203, 8864, 9609, 9959, 10221, 10563, 10786, 11420, 11709, 11907, 13163,
-        13697, 13700, 14808, 15306, 16410, 16791, 17174, 17992, 19203, 19510, 20368, 20724,
-        22305, 22935, 23090, 27007, 29113, 30109, 30420, 30906, 33409, 34949, 40283, 40493, 
-        40549, 41906, 46111, 47282, 49146, 49704, 50361
-    },
-    at::TensorOptions(at::kLong)
-);
-
-static const at::Tensor s_MULTILINGUAL_VOCAB_BAD_TOKENS = at::tensor(
-    {
-        1, 2, 7, 8, 9, 10, 14, 25, 26, 27, 28, 29, 31, 58, 59, 60, 61, 62, 63, 90, 91, 92,
-        93, 220, 359, 503, 522, 542, 873, 893, 902, 918, 922, 931, 1350, 1853, 1982, 2460, 
-        2627, 3246, 3253, 3268, 3536, 3846, 3961, 4183, 4667, 6585, 6647, 7273, 9061, 9383,
-        10428, 10929, 11938, 12033, 12331, 12562, 13793, 14157, 14635, 15265, 15618, 16553,
-        16604, 18362, 18956, 20075, 21675, 22520, 26130, 26161, 26435, 28279, 29464, 31650,
-        32302, 32470, 36865, 42863, 47425, 49870, 50254, 50258, 50360, 50361, 50362
-    },
-    at::TensorOptions(at::kLong)
-);
-
-
-static void apply_timestamp_rules(at::Tensor& logits,
-                                  const at::Tensor& tokens,
-                                  const capgen::Tokenizer& tokenizer)
+static const int s_ENGLISH_VOCAB_BAD_TOKENS[] = {
+    1, 2, 7, 8, 9, 10, 14, 25, 26, 27, 28, 29, 31, 58, 59, 60, 61, 62, 63, 90, 91, 92,
+    93, 357, 366, 438, 532, 685, 705, 796, 930, 1058, 1220, 1267, 1279, 1303, 1343, 1377,
+    1391, 1635, 1782, 1875, 2162, 2361, 2488, 3467, 3880, 4008, 4211, 4600, 4808, 5299,
+    5855, 6329, 7203, 8864, 9609, 9959, 10221, 10563, 10786, 11420, 11709, 11907, 13163,
+    13697, 13700, 14808, 15306, 16410, 16791, 17174, 17992, 19203, 19510, 20368, 20724,
+    22305, 22935, 23090, 27007, 29113, 30109, 30420, 30906, 33409, 34949, 40283, 40493, 
+    40549, 41906, 46111, 47282, 49146, 49704, 50361
+};
+
+static const int s_MULTILINGUAL_VOCAB_BAD_TOKENS[] = {
+    1, 2, 7, 8, 9, 10, 14, 25, 26, 27, 28, 29, 31, 58, 59, 60, 61, 62, 63, 90, 91, 92,
+    93, 220, 359, 503, 522, 542, 873, 893, 902, 918, 922, 931, 1350, 1853, 1982, 2460, 
+    2627, 3246, 3253, 3268, 3536, 3846, 3961, 4183, 4667, 6585, 6647, 7273, 9061, 9383,
+    10428, 10929, 11938, 12033, 12331, 12562, 13793, 14157, 14635, 15265, 15618, 16553,
+    16604, 18362, 18956, 20075, 21675, 22520, 26130, 26161, 26435, 28279, 29464, 31650,
+    32302, 32470, 36865, 42863, 47425, 49870, 50254, 50258, 50360, 50361, 50362
+};
+
+
+// Additive masks, with zero for allowed tokens and -inf for forbidden tokens, that are
+// added to the logits of every decoding step. They only depend on the vocabulary and are
+// therefore computed once per tokenizer type.
+struct SuppressionMasks {
+    // Suppresses the bad tokens and <|notimestamps|> because we always want timestamps.
+    std::vector<float> step_mask;
+    // Same as above but also suppresses the timestamps the initial timestamp cannot be
+    // later than. Applied only at the first step.
+    std::vector<float> initial_step_mask;
+};
+
+static SuppressionMasks build_suppression_masks(const capgen::Tokenizer& tokenizer)
 {
-    using namespace at::indexing;
+    const int n_vocab = tokenizer.timestamp_end() + 1;
+    SuppressionMasks masks;
+    masks.step_mask.assign(n_vocab, 0.0f);
+    if (tokenizer.is_multilingual())
+        for (int token : s_MULTILINGUAL_VOCAB_BAD_TOKENS)
+            masks.step_mask[token] = -INFINITY;
+    else
+        for (int token : s_ENGLISH_VOCAB_BAD_TOKENS)
+            masks.step_mask[token] = -INFINITY;
+    masks.step_mask[tokenizer.no_timestamps()] = -INFINITY;
+
+    const double precision = 30.0 / 448.0;
+    // Initial timestamp cannot be later than this.
+    const double max_initial_timestamp = 1.0;
+    const int max_initial_timesamp_index = round(max_initial_timestamp / precision);
+    const int last_allowed = tokenizer.timestamp_begin() + max_initial_timesamp_index;
+    masks.initial_step_mask = masks.step_mask;
+    for (int token = last_allowed + 1; token < n_vocab; ++token)
+        masks.initial_step_mask[token] = -INFINITY;
+    return masks;
+}
 
-    // Suppress <|notimestamps|> because we always want timestamps.
-    logits.index_put_({Slice(NULL), tokenizer.no_timestamps()}, -INFINITY);
-    // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly.
-    for (int k = 0; k < tokens.size(0); ++k)
+static const SuppressionMasks& get_suppression_masks(const capgen::Tokenizer& tokenizer)
+{
+    if (tokenizer.is_multilingual())
     {
-        // Select all the predicted tokens.
-        auto seq = tokens[k].index({Slice(tokenizer.prompt_length(), NULL)});
-        bool last_was_timestamp = false;
-        // check if the seq has atleast two preds and if the last pred is a timestamp.
-        if (seq.size(0) >= 1 && seq[-1].item().toInt() >= tokenizer.timestamp_begin())
-            last_was_timestamp = true;
-        bool penultimate_was_timestamp = false;
-        // check if the second last item was a timestamp.
-        if (seq.size(0) < 2 || seq[-2].item().toInt() >= tokenizer.timestamp_begin())
-            penultimate_was_timestamp = true;
-        if (last_was_timestamp)
-        {
-            // Timestamps have appeared in pairs, suppress all timestamps for next pred cycle.
-            if (penultimate_was_timestamp)
-                logits[k].index_put_({Slice(tokenizer.timestamp_begin(), NULL)}, -INFINITY);
-            else
-                logits[k].index_put_({Slice(NULL, tokenizer.eot())}, -INFINITY);
-        }
+        static const SuppressionMasks multilingual_masks = build_suppression_masks(tokenizer);
+        return multilingual_masks;
     }
+    static const SuppressionMasks english_masks = build_suppression_masks(tokenizer);
+    return english_masks;
+}
 
-    double precision = 30.0 / 448.0;
-    // Initial timestamp cannot be later than this.
-    double max_initial_timestamp = 1.0;
-    int max_initial_timesamp_index = round(max_initial_timestamp / precision);
-    if (tokens.size(1) == tokenizer.prompt_length())
+
+// Suppresses the tokens that must not be predicted next by setting their logits to -inf.
+// `logits` holds the logits of the last position of every sequence in `tokens`, shape
+// [n_seqs, n_vocab], and both tensors must be contiguous in their last dimension. The
+// masks, the timestamp pair rules and the timestamp-vs-text test are applied in a single
+// pass over the raw logits of every sequence so that no tensors are allocated and no
+// values are synchronized per step.
+static void suppress_forbidden(at::Tensor& logits,
+                               const at::Tensor& tokens,
+                               const capgen::Tokenizer& tokenizer)
+{
+    const SuppressionMasks& masks = get_suppression_masks(tokenizer);
+    const int n_tokens = tokens.size(1);
+    const float *mask = (n_tokens == tokenizer.prompt_length()) ? masks.initial_step_mask.data() : masks.step_mask.data();
+
+    const int n_vocab = logits.size(-1);
+    const int ts_begin = tokenizer.timestamp_begin();
+    const int eot = tokenizer.eot();
+    // The timestamp-vs-text test treats <|0.00|> as a text token.
+    const int text_end = ts_begin + 1;
+    const int64_t *tokens_data = tokens.data_ptr<int64_t>();
+    float *logits_data = logits.data_ptr<float>();
+    for (int k = 0; k < logits.size(0); ++k)
     {
-        int last_allowed = tokenizer.timestamp_begin() + max_initial_timesamp_index;
-        logits.index_put_({Slice(NULL), Slice(last_allowed + 1, NULL)}, -INFINITY);
+        const int64_t *seq = tokens_data + k * tokens.stride(0);
+        float *row = logits_data + k * logits.stride(0);
+
+        // Timestamps have to appear in pairs, except directly before EOT; mask logits accordingly.
+        const int n_preds = n_tokens - tokenizer.prompt_length();
+        const bool last_was_timestamp = n_preds >= 1 && seq[n_tokens - 1] >= ts_begin;
+        const bool penultimate_was_timestamp = n_preds < 2 || seq[n_tokens - 2] >= ts_begin;
+        // Timestamps have appeared in pairs, suppress all timestamps for next pred cycle.
+        const int suppress_begin = last_was_timestamp ? (penultimate_was_timestamp ? ts_begin : 0) : n_vocab;
+        const int suppress_end = (last_was_timestamp && !penultimate_was_timestamp) ? eot : n_vocab;
+
+        float max_text_logit = -INFINITY;
+        for (int i = 0; i < text_end; ++i)
+        {
+            row[i] = (i >= suppress_begin && i < suppress_end) ? -INFINITY : row[i] + mask[i];
+            max_text_logit = std::max(max_text_logit, row[i]);
+        }
+        float max_timestamp_logit = -INFINITY;
+        for (int i = text_end; i < n_vocab; ++i)
+        {
+            row[i] = (i >= suppress_begin && i < suppress_end) ? -INFINITY : row[i] + mask[i];
+            max_timestamp_logit = std::max(max_timestamp_logit, row[i]);
+        }
+
+        // If the sum of probability over timestamps is above any other token, sample a
+        // timestamp. Both sides share the softmax normalizer so the raw logits are compared.
+        if (max_timestamp_logit == -INFINITY)
+            continue;
+        float timestamp_sum = 0.0f;
+        for (int i = text_end; i < n_vocab; ++i)
+            timestamp_sum += std::exp(row[i] - max_timestamp_logit);
+        if (max_timestamp_logit + std::log(timestamp_sum) > max_text_logit)
+            std::fill(row, row + text_end, -INFINITY);
     }
+}
 
-    // if sum of probability over timestamps is above any other token, sample timestamp
-    at::Tensor logprobs = at::log_softmax(logits.to(at::kFloat), -1);
-    for (int k = 0; k < tokens.size(0); ++k)
-    {
-        at::Tensor timestamp_logprob = logprobs[k].index({Slice(tokenizer.timestamp_begin() + 1)}).logsumexp(-1);
-        at::Tensor max_text_token_logprob = logprobs[k].index({Slice(NULL, tokenizer.timestamp_begin() + 1)}).max();
+// Returns the index of the largest value in the given buffer.
+static int argmax(const float *data, int size)
+{
+    int max_idx = 0;
+    for (int i = 1; i < size; ++i)
+        if (data[i] > data[max_idx])
+            max_idx = i;
+    return max_idx;
+}
+
+// Computes log(sum(exp(data))) in a numerically stable way. `max_value` must be the largest
+// value in the buffer.
+static float logsumexp(const float *data, int size, float max_value)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < size; ++i)
+        sum += std::exp(data[i] - max_value);
+    return max_value + std::log(sum);
+}
+
+// Returns the probability of the no-speech token at the start-of-transcript position of the
+// first sequence. `logits` are the unsuppressed logits of the prompt, shape [n_seqs, len, n_vocab].
+static float no_speech_probability(const at::Tensor& logits, const capgen::Tokenizer& tokenizer)
+{
+    const at::Tensor sot_logits = logits.select(1, 0);
+    const float *logits_data = sot_logits.data_ptr<float>();
+    const int n_vocab = sot_logits.size(-1);
+    const float max_logit = logits_data[argmax(logits_data, n_vocab)];
+    return std::exp(logits_data[tokenizer.no_speech()] - logsumexp(logits_data, n_vocab, max_logit));
+}
+
+// Returns the position of the last text token before `pos` in `tokens`, or -1 if there is
+// none.
+template <typename Token>
+static int previous_text_token(const Token *tokens, int pos, const capgen::Tokenizer& tokenizer)
+{
+    do
+        pos -= 1;
+    while (pos >= 0 && tokenizer.is_timestamp(tokens[pos]));
+    return pos;
+}
 
-        if (timestamp_logprob.item().toDouble() > max_text_token_logprob.item().toDouble()) 
+// Returns the position in `tokens` at which the text starts repeating itself, i.e the
+// position of the second of the consecutive copies of an n-gram at the end of the text, or
+// -1 if the text does not end with a repetition. Timestamps are ignored because a looping
+// model usually emits increasing timestamps between the copies. The tokens are compared from
+// the end in place, so the check is called on every step without allocating and usually
+// stops at the first comparison of each n-gram size.
+template <typename Token>
+static int find_repetition(const Token *tokens,
+                           int n_tokens,
+                           const capgen::Tokenizer& tokenizer,
+                           const capgen::DecodingOptions& options)
+{
+    for (int ngram = 1; ngram <= (int)options.repetition_max_ngram; ++ngram)
+    {
+        const int min_tokens_repeats = (options.repetition_min_tokens + ngram - 1) / ngram;
+        const int n_repeats = std::max((int)options.repetition_min_repeats, min_tokens_repeats);
+        // The last `ngram * n_repeats` text tokens are copies of an n-gram if every one of
+        // them but the first `ngram` equals the text token `ngram` positions before it.
+        const int n_comparisons = ngram * (n_repeats - 1);
+        if (n_comparisons <= 0)
+            continue;
+        int later = previous_text_token(tokens, n_tokens, tokenizer);
+        int earlier = later;
+        for (int i = 0; i < ngram && earlier >= 0; ++i)
+            earlier = previous_text_token(tokens, earlier, tokenizer);
+        int repetition_pos = -1;
+        for (int i = 0; i < n_comparisons; ++i)
         {
-            logits[k].index_put_({Slice(NULL, tokenizer.timestamp_begin() + 1)}, -INFINITY);
+            // Either the text is shorter than the copies or it does not repeat.
+            if (earlier < 0 || tokens[earlier] != tokens[later])
+            {
+                repetition_pos = -1;
+                break;
+            }
+            repetition_pos = later;
+            later = previous_text_token(tokens, later, tokenizer);
+            earlier = previous_text_token(tokens, earlier, tokenizer);
         }
+        if (repetition_pos >= 0)
+            return repetition_pos;
     }
+    return -1;
 }
 
-static void suppress_forbidden(at::Tensor& logits,
-                                      const at::Tensor& tokens,
-                                      const capgen::Tokenizer& tokenizer)
+// Truncates the tokens to `end` and then drops the trailing incomplete timestamped
+// transcription, if there is one, so that the next segment starts where the last
+// complete transcription ended.
+static void truncate_tokens(std::vector<uint32_t>& tokens, int end, const capgen::Tokenizer& tokenizer)
 {
-    if (tokenizer.is_multilingual())
-        logits.index_put_({at::indexing::Slice(NULL), s_MULTILINGUAL_VOCAB_BAD_TOKENS}, -INFINITY);
-    else
-        logits.index_put_({at::indexing::Slice(NULL), s_ENGLISH_VOCAB_BAD_TOKENS}, -INFINITY);
-    apply_timestamp_rules(logits, tokens, tokenizer);
+    tokens.resize(end);
+    // A complete transcription ends with a timestamp that directly follows a text token.
+    for (int i = tokens.size() - 1; i >= 1; --i)
+        if (tokenizer.is_timestamp(tokens[i]) && !tokenizer.is_timestamp(tokens[i - 1]))
+        {
+            tokens.resize(i + 1);
+            return;
+        }
+}
+
+// Returns the reason for which the decoding of the given tokens should stop early, if any,
+// and sets `end` to the number of tokens to keep, before `truncate_tokens`.
+template <typename Token>
+static capgen::DecodingStopReason find_early_stop(const Token *tokens,
+                                                  int n_tokens,
+                                                  uint32_t max_tokens,
+                                                  const capgen::Tokenizer& tokenizer,
+                                                  const capgen::DecodingOptions& options,
+                                                  int& end)
+{
+    end = find_repetition(tokens, n_tokens, tokenizer, options);
+    if (end >= 0)
+        return capgen::DecodingStopReason::Repetition;
+    end = n_tokens;
+    if (n_tokens >= (int)max_tokens)
+        return capgen::DecodingStopReason::TokenBudget;
+    return capgen::DecodingStopReason::Completed;
+}
+
+// Checks whether the decoding of the given tokens should stop early. If so, the tokens
+// are truncated and the reason for stopping is returned.
+static capgen::DecodingStopReason check_early_stop(std::vector<uint32_t>& tokens,
+                                                   uint32_t max_tokens,
+                                                   const capgen::Tokenizer& tokenizer,
+                                                   const capgen::DecodingOptions& options)
+{
+    int end;
+    const capgen::DecodingStopReason stop_reason = find_early_stop(tokens.data(), tokens.size(), max_tokens, tokenizer, options, end);
+    if (stop_reason != capgen::DecodingStopReason::Completed)
+        truncate_tokens(tokens, end, tokenizer);
+    return stop_reason;
 }
 
 
 namespace capgen {
 
-int detect_language(const at::Tensor &spectrogram,
+int detect_language(const at::Tensor &audio_features,
+                    const int cache_index,
                     std::shared_ptr<Whisper> model,
                     const Tokenizer &tokenizer) 
 {
-    at::Tensor audio_segment = spectrogram.index_select(-1, at::arange(0, 3000));
-    at::Tensor audio_features = model->embed_audio(audio_segment);
     const at::TensorOptions tensor_opts = at::TensorOptions(at::kLong);
     at::Tensor tokens = at::tensor({tokenizer.sot()}, tensor_opts);
     tokens = tokens.unsqueeze(0);
-    at::Tensor logits = model->logits(tokens, audio_features, -2);
+    at::Tensor logits = model->logits(tokens, audio_features, cache_index);
     logits = logits.index({at::indexing::Slice(NULL), 0});
     at::Tensor mask = at::ones(logits.size(-1), at::kBool);
     // Mask language tokens.
@@ -138,13 +313,16 @@ SegmentTranscription::SegmentTranscription(std::vector<uint32_t>& tokens,
                                            const Tokenizer& tokenizer)
 {
     m_segment_index = segment_index;
-    if (tokenizer.is_timestamp(tokens.back()))
+    if (!tokens.empty() && tokenizer.is_timestamp(tokens.back()))
         m_end_time = tokenizer.decode_timestamp_token(tokens.back());
     else
     {
         m_end_time = 30.0f;
         tokens.push_back(tokenizer.timestamp_end());
     }
+    // A segment that ends at <0.00> would not advance the transcription through the audio.
+    if (m_end_time <= 0.0f)
+        m_end_time = 30.0f;
 
     TimestampedTranscription timestamped_trx;
     for (uint32_t token : tokens) {
@@ -164,74 +342,144 @@ SegmentTranscription::SegmentTranscription(std::vector<uint32_t>& tokens,
     }
 }
 
+SegmentTranscription::SegmentTranscription(uint32_t segment_index, float end_time)
+{
+    m_segment_index = segment_index;
+    m_end_time = end_time;
+}
 
-void greedy_decode_segment(const at::Tensor& spectrogram,
-                           capgen::TranscriptionTask task,
-                           const uint32_t language_id,
-                           const uint32_t segment_index,
-                           std::shared_ptr<Whisper> model,
-                           const Tokenizer& tokenizer,
-                           std::vector<SegmentTranscription>& out_transcriptions)
+void SegmentTranscription::clip(float end_time)
 {
-    const at::Tensor audio_features = model->embed_audio(spectrogram);
-    const auto tensor_opts = at::TensorOptions(at::kLong);
-    at::Tensor tokens;
+    while (!sub_segments.empty() && sub_segments.back().m_start_time >= end_time)
+        sub_segments.pop_back();
+    if (!sub_segments.empty() && sub_segments.back().m_end_time > end_time)
+        sub_segments.back().m_end_time = end_time;
+    m_end_time = end_time;
+}
+
+
+float compression_ratio(const std::vector<uint32_t>& tokens, const Tokenizer& tokenizer)
+{
+    std::string text;
+    for (uint32_t token : tokens)
+        if (!tokenizer.is_timestamp(token))
+            text += tokenizer.decode_token(token);
+    if (text.empty())
+        return 0.0f;
+    uLongf compressed_size = compressBound(text.size());
+    std::vector<Bytef> compressed(compressed_size);
+    const int ret = compress2(compressed.data(), &compressed_size, (const Bytef *)text.data(), text.size(), Z_BEST_COMPRESSION);
+    if (ret != Z_OK)
+    {
+        CG_LOG_ERROR("Failed to compress decoded text: zlib error=%d", ret);
+        return 0.0f;
+    }
+    return (float)text.size() / (float)compressed_size;
+}
+
+DecodingResult greedy_decode_segment(const at::Tensor& audio_features,
+                                     capgen::TranscriptionTask task,
+                                     const uint32_t language_id,
+                                     const int cache_index,
+                                     const uint32_t max_tokens,
+                                     std::shared_ptr<Whisper> model,
+                                     const Tokenizer& tokenizer,
+                                     const DecodingOptions& options)
+{
+    // The context tokens are written into a preallocated buffer and the model is given a
+    // view of the filled part of the buffer so that the context is never copied.
+    const int max_ctx_tokens = tokenizer.prompt_length() + model->n_ctx();
+    const at::Tensor tokens_buf = at::zeros({1, max_ctx_tokens}, at::TensorOptions(at::kLong));
+    int64_t *tokens_data = tokens_buf.data_ptr<int64_t>();
+    tokens_data[0] = tokenizer.sot();
     if (tokenizer.is_multilingual())
     {
-        int task_token = (task == capgen::TranscriptionTask::Transcribe) ? tokenizer.transcribe() : tokenizer.translate();
-        tokens = at::tensor({tokenizer.sot(), (int)language_id, task_token}, tensor_opts);
+        tokens_data[1] = language_id;
+        tokens_data[2] = (task == capgen::TranscriptionTask::Transcribe) ? tokenizer.transcribe() : tokenizer.translate();
     }
-    else
-        tokens = at::tensor({tokenizer.sot()}, tensor_opts);
-    tokens = tokens.unsqueeze(0);
-    std::vector<uint32_t> pred_tokens;
-    pred_tokens.reserve(model->n_ctx());
-    for (int i = 0; i < model->n_ctx(); ++i)
+    int n_ctx_tokens = tokenizer.prompt_length();
+
+    DecodingResult result;
+    result.tokens.reserve(model->n_ctx());
+    for (int i = 0; i < (int)model->n_ctx(); ++i)
     {
-        at::Tensor logits = model->logits(tokens, audio_features, segment_index);
-        logits = logits.index({at::indexing::Slice(NULL), at::indexing::Slice(-1)}).squeeze(1);
-        suppress_forbidden(logits, tokens, tokenizer);
-        // const at::Tensor probs = at::softmax(logits, -1);
-        const at::Tensor pred_token = logits.argmax(-1);
-        const int pred_token_int = pred_token.item().toInt();
-        if (pred_token_int == tokenizer.eot())
+        const at::Tensor tokens = tokens_buf.narrow(1, 0, n_ctx_tokens);
+        // Only the last position is needed after the first step, which also needs the
+        // start-of-transcript position for the no-speech probability.
+        const at::Tensor logits = model->logits(tokens, audio_features, cache_index, (i == 0) ? -1 : 1);
+        if (i == 0)
+            result.no_speech_prob = no_speech_probability(logits, tokenizer);
+        // A view of the logits of the last position, shape [1, n_vocab].
+        at::Tensor last_logits = logits.select(1, logits.size(1) - 1);
+        suppress_forbidden(last_logits, tokens, tokenizer);
+
+        // The prediction and its log probability are computed directly on the logits buffer
+        // to avoid allocating intermediate tensors and synchronizing on their values.
+        const float *logits_data = last_logits.data_ptr<float>();
+        const int n_vocab = last_logits.size(-1);
+        const int pred_token = argmax(logits_data, n_vocab);
+        result.sum_logprob += logits_data[pred_token] - logsumexp(logits_data, n_vocab, logits_data[pred_token]);
+        if (pred_token == tokenizer.eot())
+            break;
+        result.tokens.push_back((uint32_t)pred_token);
+        result.stop_reason = check_early_stop(result.tokens, max_tokens, tokenizer, options);
+        if (result.stop_reason != DecodingStopReason::Completed)
             break;
-        pred_tokens.push_back((uint32_t)pred_token_int);
         // Add predicted token to the context.
-        tokens = at::cat({tokens, pred_token.view({1, 1})}, 1);
+        tokens_data[n_ctx_tokens] = pred_token;
+        n_ctx_tokens += 1;
     }
-    out_transcriptions.push_back(SegmentTranscription(pred_tokens, segment_index, tokenizer));
+    return result;
 }
 
-void beamsearch_decode_segment(const at::Tensor &spectrogram,
-                               TranscriptionTask task,
-                               const uint32_t language_id,
-                               const uint32_t segment_index,
-                               std::shared_ptr<Whisper> model,
-                               const Tokenizer &tokenizer,
-                               std::vector<SegmentTranscription> &out_transcriptions)
+DecodingResult beamsearch_decode_segment(const at::Tensor &segment_audio_features,
+                                         TranscriptionTask task,
+                                         const uint32_t language_id,
+                                         const int cache_index,
+                                         const uint32_t max_tokens,
+                                         std::shared_ptr<Whisper> model,
+                                         const Tokenizer &tokenizer,
+                                         const DecodingOptions& options)
 {
     // BEAMSEARCH.
-    const uint32_t n_beam = 4;
-    // Embed audio and copy the embeddings `n_beam` times in the zeroth dimension.
-    at::Tensor audio_features = model->embed_audio(spectrogram);
-    audio_features = audio_features.repeat_interleave(n_beam, 0);
-
-    // Prepare initial prompt sequence.
-    at::Tensor ctx_tokens;
-    const auto tokens_opts = at::TensorOptions(at::kLong);
-    if (tokenizer.is_multilingual())
+    if (options.n_beam < 1 || options.n_beam > s_MAX_BEAMS)
     {
-        int task_token = (task == capgen::TranscriptionTask::Transcribe) ? tokenizer.transcribe() : tokenizer.translate();
-        ctx_tokens = at::tensor({tokenizer.sot(), (int)language_id, task_token}, tokens_opts);
+        CG_LOG_ERROR("Invalid number of beams: %u, expected 1 to %d", options.n_beam, s_MAX_BEAMS);
+        throw std::exception();
     }
-    else
-        ctx_tokens = at::tensor({tokenizer.sot()}, tokens_opts);
-    ctx_tokens = ctx_tokens.unsqueeze(0);
-    ctx_tokens = ctx_tokens.repeat_interleave(n_beam, 0);
-
-    // Keeps track of the sum of log probabilities of the top beams at each iteration.
-    std::vector<float> sum_logprobs(n_beam, 0.0);
+    const int n_beam = options.n_beam;
+    // All the beams attend to the same audio so the audio embeddings are broadcast to
+    // `n_beam` rows rather than copied.
+    const at::Tensor audio_features = segment_audio_features.expand({n_beam, -1, -1});
+
+    // The context tokens of the live beams are kept in a fixed buffer, one row per beam,
+    // and the model is given a view of the filled columns. The number of live beams never
+    // changes so the decoder cache is computed once per segment.
+    const int max_ctx_tokens = tokenizer.prompt_length() + model->n_ctx();
+    const at::Tensor tokens_buf = at::zeros({n_beam, max_ctx_tokens}, at::TensorOptions(at::kLong));
+    int64_t *tokens_data = tokens_buf.data_ptr<int64_t>();
+    for (int beam = 0; beam < n_beam; ++beam)
+    {
+        int64_t *beam_tokens = tokens_data + beam * max_ctx_tokens;
+        beam_tokens[0] = tokenizer.sot();
+        if (tokenizer.is_multilingual())
+        {
+            beam_tokens[1] = language_id;
+            beam_tokens[2] = (task == capgen::TranscriptionTask::Transcribe) ? tokenizer.transcribe() : tokenizer.translate();
+        }
+    }
+    int n_ctx_tokens = tokenizer.prompt_length();
+    // Used to reorder the rows of the tokens buffer after every step.
+    std::vector<int64_t> reorder_buf(n_beam * max_ctx_tokens);
+
+    // Sum of log probabilities of the live beams. All the beams hold the same prompt at the
+    // start so only the first one is expanded in the first step.
+    std::vector<float> sum_logprobs(n_beam, -INFINITY);
+    sum_logprobs[0] = 0.0f;
+    std::vector<float> new_sum_logprobs(n_beam);
+    // The beam each live beam was expanded from and the token it was expanded with.
+    std::vector<int> source_beams(n_beam);
+    std::vector<int64_t> new_tokens(n_beam);
 
     // Contains the predicted tokens of the completed beams.
     std::vector<std::vector<uint32_t>> final_beams_tokens;
@@ -241,96 +489,120 @@ void beamsearch_decode_segment(const at::Tensor &spectrogram,
     std::vector<float> final_beams_logprobs;
     final_beams_logprobs.reserve(n_beam);
 
-    // Holds the sum of log probabilities and context tokens of all the considered(expanded) beams
-    // at each iteration. 
-    std::vector<std::pair<float, at::Tensor>> scores;
-    auto scores_comp = [](const std::pair<float, at::Tensor> &lhs, const std::pair<float, at::Tensor> &rhs) {
-        return lhs.first < rhs.first;
-    };
-    scores.reserve(n_beam * n_beam);
-
-    // Keeps track of how many beams have been completed.
-    uint32_t n_completed = 0;
-    // Controls the kv cache of the model. During the first iteration, the model automatically
-    // caches the computed key and value matrices because we continuously use the same audio
-    // features tensor at each cross attention block. When we complete a beam and reshape the 
-    // audio features tensor, we tell the model to recompute the cache by changing the cache
-    // index value. We would not have to do that if the model could detect and resize by itself
-    // but the model is designed to assume that the two iterations with same cache index should
-    // have the same output and the same shape.
-    uint32_t cache_idx = segment_index;
-
-    for (int i = 0; i < model->n_ctx(); ++i)
+    // Set if the search is stopped early and the best remaining beam is used as the output.
+    DecodingStopReason stop_reason = DecodingStopReason::Completed;
+    float no_speech_prob = 0.0f;
+
+    // Each beam is expanded with one token more than the number of beams so that `n_beam`
+    // beams remain even if every beam predicts the end-of-transcript token.
+    const int n_expand = n_beam + 1;
+    for (int i = 0; i < (int)model->n_ctx(); ++i)
     {
-        if (n_completed == n_beam)
+        if ((int)final_beams_tokens.size() >= n_beam)
             break;
 
-        at::Tensor logits = model->logits(ctx_tokens, audio_features, cache_idx);
-        logits = logits.index({at::indexing::Slice(NULL), at::indexing::Slice(-1)}).squeeze(1);
-        suppress_forbidden(logits, ctx_tokens, tokenizer);
-        at::Tensor logprobs = logits.log_softmax(-1);
-        auto logprobs_topk = logprobs.topk(n_beam, -1, true, true);
-        at::Tensor top_logprobs = std::get<0>(logprobs_topk);
-        at::Tensor top_tokens =  std::get<1>(logprobs_topk);
-
-        // Resets the score so we can compare new beams.
-        scores.clear();
-        // Rows represent number of beams remaining to be completed while columns reperesent the number of
-        // tokens that we consider at each iteration from each individual beam.
-        for (int row = 0; row < n_beam - n_completed; ++row)
-            for (int col = 0; col < n_beam; ++col)
+        const at::Tensor tokens = tokens_buf.narrow(1, 0, n_ctx_tokens);
+        const at::Tensor logits = model->logits(tokens, audio_features, cache_index, (i == 0) ? -1 : 1);
+        if (i == 0)
+            no_speech_prob = no_speech_probability(logits, tokenizer);
+        at::Tensor last_logits = logits.select(1, logits.size(1) - 1);
+        suppress_forbidden(last_logits, tokens, tokenizer);
+        const at::Tensor logprobs = last_logits.log_softmax(-1);
+        auto logprobs_topk = logprobs.topk(n_expand, -1, true, true);
+        const at::Tensor top_tokens = std::get<1>(logprobs_topk);
+
+        // Scores of all the n_beam x n_expand candidates. At most `n_beam` candidates can end
+        // a beam so the best 2 x n_beam candidates are enough to find `n_beam` live beams.
+        const at::Tensor beam_scores = at::from_blob(sum_logprobs.data(), {n_beam, 1}, at::TensorOptions(at::kFloat));
+        const at::Tensor candidate_scores = (std::get<0>(logprobs_topk) + beam_scores).flatten();
+        auto candidates_topk = candidate_scores.topk(std::min(2 * n_beam, (int)candidate_scores.numel()), -1, true, true);
+        const at::Tensor best_scores = std::get<0>(candidates_topk);
+        const at::Tensor best_candidates = std::get<1>(candidates_topk);
+        const float *best_scores_data = best_scores.data_ptr<float>();
+        const int64_t *best_candidates_data = best_candidates.data_ptr<int64_t>();
+        const int64_t *top_tokens_data = top_tokens.data_ptr<int64_t>();
+
+        int n_live = 0;
+        for (int c = 0; c < (int)best_candidates.numel() && n_live < n_beam; ++c)
+        {
+            const float score = best_scores_data[c];
+            if (score == -INFINITY)
+                break;
+            const int source_beam = best_candidates_data[c] / n_expand;
+            const int64_t pred_token = top_tokens_data[best_candidates_data[c]];
+            if (pred_token == tokenizer.eot())
             {
-                float cumulative_logprob = sum_logprobs[row] + top_logprobs.index({row, col}).item().toFloat();
-                at::Tensor prefix = at::cat({ctx_tokens.index({row}).flatten(), top_tokens.index({row, col}).unsqueeze(0)}, 0);
-                scores.push_back(std::make_pair(cumulative_logprob, prefix));
+                if ((int)final_beams_tokens.size() < n_beam)
+                {
+                    const int64_t *beam_tokens = tokens_data + source_beam * max_ctx_tokens;
+                    final_beams_tokens.emplace_back(beam_tokens + tokenizer.prompt_length(), beam_tokens + n_ctx_tokens);
+                    final_beams_logprobs.push_back(score);
+                }
             }
+            else
+            {
+                source_beams[n_live] = source_beam;
+                new_tokens[n_live] = pred_token;
+                new_sum_logprobs[n_live] = score;
+                n_live += 1;
+            }
+        }
+        if (n_live == 0)
+            break;
 
-        sum_logprobs.clear();
-        // We don't sort on the first iteration because all the beams have the same predictions and
-        // therefore we only need to pick top beams from a single beam.
-        if (i > 0)
-            std::sort(scores.rbegin(),scores.rend(), scores_comp);
-
-        at::Tensor new_ctx_tokens = at::zeros({1, scores[0].second.size(0)}, tokens_opts);
-        int n_remaining_beams = n_beam - n_completed;
-        for (int beam_idx = 0; beam_idx < n_remaining_beams; ++beam_idx)
+        // Reorder the rows of the tokens buffer so that row j holds the beam that live beam j
+        // was expanded from and then append the new tokens.
+        for (int j = 0; j < n_live; ++j)
+            std::copy_n(tokens_data + source_beams[j] * max_ctx_tokens, n_ctx_tokens, reorder_buf.data() + j * max_ctx_tokens);
+        for (int j = 0; j < n_beam; ++j)
         {
-            auto [logprob, prefix] = scores[beam_idx];
-            int pred_token = prefix.index({-1}).item().toInt();
-            if (pred_token == tokenizer.eot())
+            int64_t *beam_tokens = tokens_data + j * max_ctx_tokens;
+            if (j < n_live)
             {
-                at::Tensor out_prefix = prefix.slice(0, tokenizer.prompt_length(), -1);
-                std::vector out_prefix_vec = std::vector<uint32_t>(out_prefix.data_ptr<int64_t>(),
-                                                                   out_prefix.data_ptr<int64_t>() + out_prefix.numel());
-                final_beams_tokens.push_back(std::move(out_prefix_vec));
-                final_beams_logprobs.push_back(logprob);
-                n_completed += 1;
-
-                audio_features = audio_features.index({at::indexing::Slice(0, n_beam - n_completed)});
-                // Resets the cache so that the model recompute the cache on the next iteration.
-                // This is important because we just sliced the audio features and therefore the
-                // cache of the correct dimensions must be recomputed. Also, we reset by adding two
-                // to avoid the next segment from using cache from the current segment.
-                cache_idx += 2;
+                std::copy_n(reorder_buf.data() + j * max_ctx_tokens, n_ctx_tokens, beam_tokens);
+                beam_tokens[n_ctx_tokens] = new_tokens[j];
+                sum_logprobs[j] = new_sum_logprobs[j];
             }
             else
+                sum_logprobs[j] = -INFINITY;
+        }
+        n_ctx_tokens += 1;
+
+        // Stop early if the best remaining beam is stuck in a loop or has used up the token
+        // budget. It becomes the output only if no beam has completed.
+        if ((int)final_beams_tokens.size() < n_beam)
+        {
+            // The tokens of the best beam are checked in the buffer and only copied if it stops.
+            const int64_t *best_tokens_data = tokens_data + tokenizer.prompt_length();
+            int best_tokens_end;
+            const DecodingStopReason beam_stop_reason = find_early_stop(best_tokens_data, n_ctx_tokens - tokenizer.prompt_length(),
+                                                                        max_tokens, tokenizer, options, best_tokens_end);
+            if (beam_stop_reason != DecodingStopReason::Completed)
             {
-                new_ctx_tokens = at::cat({new_ctx_tokens, prefix.unsqueeze(0)}, 0);
-                sum_logprobs.push_back(logprob);
+                if (final_beams_tokens.empty())
+                {
+                    std::vector<uint32_t> best_tokens(best_tokens_data, best_tokens_data + n_ctx_tokens - tokenizer.prompt_length());
+                    truncate_tokens(best_tokens, best_tokens_end, tokenizer);
+                    final_beams_tokens.push_back(std::move(best_tokens));
+                    final_beams_logprobs.push_back(sum_logprobs[0]);
+                    stop_reason = beam_stop_reason;
+                }
+                break;
             }
         }
-
-        // Slicing gets rid of the first row of zeros that was created with the tensor.
-        if (new_ctx_tokens.size(0) > 1)
-            ctx_tokens = new_ctx_tokens.index({at::indexing::Slice(1, (n_beam - n_completed)+1)});
     }
 
+    // The search always stops with at least one completed beam or with the best remaining
+    // beam when the token budget runs out.
+    DecodingResult result;
+    result.stop_reason = stop_reason;
+    result.no_speech_prob = no_speech_prob;
     if (!final_beams_tokens.empty()) {
         // Normalize the log probabilities and pick the transcription with the highest sum of log
         // probability.
         float max_logprob = -INFINITY;
         int max_logprob_idx = 0;
-        for (int j = 0; j < final_beams_logprobs.size(); j++)
+        for (int j = 0; j < (int)final_beams_logprobs.size(); j++)
         {
             float normalised_logprob = final_beams_logprobs[j] / final_beams_tokens[j].size();
             if (normalised_logprob > max_logprob)
@@ -340,18 +612,172 @@ void beamsearch_decode_segment(const at::Tensor &spectrogram,
             }
         }
 
-        out_transcriptions.push_back(SegmentTranscription(final_beams_tokens[max_logprob_idx], segment_index, tokenizer));
+        result.tokens = std::move(final_beams_tokens[max_logprob_idx]);
+        result.sum_logprob = final_beams_logprobs[max_logprob_idx];
     }
-    else
+    return result;
+}
+
+DecodingResult adaptive_decode_segment(const at::Tensor& audio_features,
+                                       TranscriptionTask task,
+                                       const uint32_t language_id,
+                                       const int cache_index,
+                                       const uint32_t max_tokens,
+                                       std::shared_ptr<Whisper> model,
+                                       const Tokenizer& tokenizer,
+                                       const DecodingOptions& options)
+{
+    DecodingResult result = greedy_decode_segment(audio_features, task, language_id, cache_index, max_tokens, model, tokenizer, options);
+    const float avg_logprob = result.avg_logprob();
+    const float ratio = compression_ratio(result.tokens, tokenizer);
+    if (result.stop_reason == DecodingStopReason::Completed
+        && avg_logprob >= options.logprob_threshold
+        && ratio <= options.compression_ratio_threshold)
+        return result;
+
+    CG_LOG_DEBUG("Re-decoding segment with beamsearch: avg_logprob=%.2f, compression_ratio=%.2f", avg_logprob, ratio);
+    return beamsearch_decode_segment(audio_features, task, language_id, cache_index, max_tokens, model, tokenizer, options);
+}
+
+DecodingResult speculative_decode_segment(const at::Tensor& audio_features,
+                                          const at::Tensor& draft_audio_features,
+                                          TranscriptionTask task,
+                                          const uint32_t language_id,
+                                          const int cache_index,
+                                          const uint32_t max_tokens,
+                                          std::shared_ptr<Whisper> model,
+                                          std::shared_ptr<Whisper> draft_model,
+                                          const Tokenizer& tokenizer,
+                                          const DecodingOptions& options)
+{
+    // The draft tokens are written into the context buffer after the accepted tokens so
+    // that the model can verify all of them with a single call. Rejected draft tokens are
+    // simply overwritten in the next round.
+    const int max_ctx_tokens = tokenizer.prompt_length() + model->n_ctx();
+    const at::Tensor tokens_buf = at::zeros({1, max_ctx_tokens}, at::TensorOptions(at::kLong));
+    int64_t *tokens_data = tokens_buf.data_ptr<int64_t>();
+    tokens_data[0] = tokenizer.sot();
+    if (tokenizer.is_multilingual())
     {
-        uint32_t start_time = (uint32_t)tokenizer.timestamp_begin();
-        uint32_t end_time = (uint32_t)tokenizer.timestamp_end();
-        // Put three dots to indicate failure. In the future, shall be replaced by other
-        // methods such as repetition dection methods.
-        std::vector<uint32_t> failed_tokens({start_time, 13, 13, 13, end_time});
+        tokens_data[1] = language_id;
+        tokens_data[2] = (task == capgen::TranscriptionTask::Transcribe) ? tokenizer.transcribe() : tokenizer.translate();
+    }
+    int n_ctx_tokens = tokenizer.prompt_length();
+
+    // Used to report how many of the draft tokens were accepted.
+    int n_drafted = 0;
+    int n_accepted = 0;
 
-        out_transcriptions.push_back(SegmentTranscription(failed_tokens, segment_index, tokenizer));
+    DecodingResult result;
+    result.tokens.reserve(model->n_ctx());
+    bool done = false;
+    while (!done && result.tokens.size() < model->n_ctx())
+    {
+        // Greedy decoding would never give the model more than `max_ctx_tokens - 1` tokens
+        // and there is no point drafting beyond the token budget.
+        const int n_draft = std::min({(int)options.n_draft_tokens,
+                                      max_ctx_tokens - 1 - n_ctx_tokens,
+                                      (int)max_tokens - (int)result.tokens.size()});
+        int n_draft_tokens = 0;
+        for (; n_draft_tokens < n_draft; ++n_draft_tokens)
+        {
+            const at::Tensor tokens = tokens_buf.narrow(1, 0, n_ctx_tokens + n_draft_tokens);
+            const at::Tensor logits = draft_model->logits(tokens, draft_audio_features, cache_index, 1);
+            at::Tensor last_logits = logits.select(1, logits.size(1) - 1);
+            suppress_forbidden(last_logits, tokens, tokenizer);
+            const int draft_token = argmax(last_logits.data_ptr<float>(), last_logits.size(-1));
+            // The model predicts the end of transcript itself after the last draft token.
+            if (draft_token == tokenizer.eot())
+                break;
+            tokens_data[n_ctx_tokens + n_draft_tokens] = draft_token;
+        }
+        n_drafted += n_draft_tokens;
+
+        // The last `n_draft_tokens + 1` positions hold the logits of the token that follows the
+        // j-th draft token, or the accepted tokens for j = 0, so every draft token is checked
+        // against the token greedy decoding would have predicted in its place. All the
+        // positions are computed in the first round for the no-speech probability.
+        const bool first_round = (n_ctx_tokens == tokenizer.prompt_length());
+        const at::Tensor logits = model->logits(tokens_buf.narrow(1, 0, n_ctx_tokens + n_draft_tokens), audio_features,
+                                                cache_index, first_round ? -1 : n_draft_tokens + 1);
+        if (first_round)
+            result.no_speech_prob = no_speech_probability(logits, tokenizer);
+        const int first_pos = logits.size(1) - (n_draft_tokens + 1);
+        for (int j = 0; j <= n_draft_tokens; ++j)
+        {
+            const at::Tensor tokens = tokens_buf.narrow(1, 0, n_ctx_tokens + j);
+            at::Tensor pos_logits = logits.select(1, first_pos + j);
+            suppress_forbidden(pos_logits, tokens, tokenizer);
+
+            const float *logits_data = pos_logits.data_ptr<float>();
+            const int n_vocab = pos_logits.size(-1);
+            const int pred_token = argmax(logits_data, n_vocab);
+            result.sum_logprob += logits_data[pred_token] - logsumexp(logits_data, n_vocab, logits_data[pred_token]);
+            if (pred_token == tokenizer.eot())
+            {
+                done = true;
+                break;
+            }
+            result.tokens.push_back((uint32_t)pred_token);
+            result.stop_reason = check_early_stop(result.tokens, max_tokens, tokenizer, options);
+            if (result.stop_reason != DecodingStopReason::Completed || result.tokens.size() >= model->n_ctx())
+            {
+                done = true;
+                break;
+            }
+            // The first rejected draft token is replaced by the prediction of the model and the
+            // remaining draft tokens are discarded because they followed a different context.
+            if (j == n_draft_tokens || pred_token != tokens_data[n_ctx_tokens + j])
+            {
+                tokens_data[n_ctx_tokens + j] = pred_token;
+                n_ctx_tokens += j + 1;
+                break;
+            }
+            n_accepted += 1;
+        }
+    }
+    CG_LOG_DEBUG("Speculative decoding accepted %d of %d draft tokens", n_accepted, n_drafted);
+    return result;
+}
+
+DecodingResult decode_segment(const at::Tensor& audio_features,
+                              const at::Tensor& draft_audio_features,
+                              TranscriptionTask task,
+                              const uint32_t language_id,
+                              const int cache_index,
+                              const float segment_duration,
+                              std::shared_ptr<Whisper> model,
+                              const Tokenizer& tokenizer,
+                              TranscriptionDecoder decoder,
+                              const DecodingOptions& options)
+{
+    // The constant allowance leaves room for timestamps and short words in very short segments.
+    const uint32_t token_budget = 16 + (uint32_t)std::ceil(segment_duration * options.max_tokens_per_second);
+    const uint32_t max_tokens = std::min(token_budget, model->n_ctx());
+
+    DecodingResult result;
+    switch (decoder)
+    {
+        case TranscriptionDecoder::Greedy:
+            if (options.draft_model && draft_audio_features.defined())
+            {
+                result = speculative_decode_segment(audio_features, draft_audio_features, task, language_id, cache_index,
+                                                    max_tokens, model, options.draft_model, tokenizer, options);
+                break;
+            }
+            result = greedy_decode_segment(audio_features, task, language_id, cache_index, max_tokens, model, tokenizer, options);
+            break;
+        case TranscriptionDecoder::BeamSearch:
+            result = beamsearch_decode_segment(audio_features, task, language_id, cache_index, max_tokens, model, tokenizer, options);
+            break;
+        default:
+            result = adaptive_decode_segment(audio_features, task, language_id, cache_index, max_tokens, model, tokenizer, options);
     }
+    if (result.stop_reason == DecodingStopReason::Repetition)
+        CG_LOG_MDEBUG("Segment decoding stopped early: repetition detected");
+    else if (result.stop_reason == DecodingStopReason::TokenBudget)
+        CG_LOG_DEBUG("Segment decoding stopped early: token budget of %d exhausted", max_tokens);
+    return result;
 }
 
 void write_time(float seconds, std::FILE *outfile, bool is_start=true) {
@@ -369,33 +795,54 @@ void write_time(float seconds, std::FILE *outfile, bool is_start=true) {
 }
 
 
-void save_to_srt(const std::vector<SegmentTranscription>& transcription,
-                 const Tokenizer& tokenizer,
-                 const std::string& filename)
+SrtWriter::SrtWriter(const std::string& filename, const Tokenizer& tokenizer, float start_time, float time_scale)
+  : m_tokenizer(tokenizer), m_start_time(start_time), m_time_scale(time_scale)
 {
-    std::FILE *outfile = std::fopen(filename.c_str(), "w");
-    if (!outfile)
+    m_outfile = std::fopen(filename.c_str(), "w");
+    if (!m_outfile)
     {
         CG_LOG_ERROR("Failed to create captions srt file at %s", filename.c_str());
         throw std::exception();
     }
-    float time_offset = 0.0f;
-    int segment_index = 1;
-    for (const auto &segment_trx : transcription)
+}
+
+SrtWriter::~SrtWriter()
+{
+    std::fclose(m_outfile);
+}
+
+std::string SrtWriter::append(const SegmentTranscription& segment_trx)
+{
+    std::string text;
+    for (const auto &timestamped_trx : segment_trx.sub_segments)
     {
-        for (const auto &timestamped_trx : segment_trx.sub_segments)
+        std::fprintf(m_outfile, "%d\n", m_caption_index);
+        m_caption_index += 1;
+        write_time(m_start_time + m_time_scale * (m_time_offset + timestamped_trx.m_start_time), m_outfile, true);
+        write_time(m_start_time + m_time_scale * (m_time_offset + timestamped_trx.m_end_time), m_outfile, false);
+        for (auto &token : timestamped_trx.m_text_tokens)
         {
-            std::fprintf(outfile, "%d\n", segment_index);
-            segment_index += 1;
-            write_time(time_offset + timestamped_trx.m_start_time, outfile, true);
-            write_time(time_offset + timestamped_trx.m_end_time, outfile, false);
-            for (auto &token : timestamped_trx.m_text_tokens)
-                std::fprintf(outfile, "%s", tokenizer.decode_token(token));
-            std::fprintf(outfile, "\n\n");
+            const char *word = m_tokenizer.decode_token(token);
+            std::fprintf(m_outfile, "%s", word);
+            text += word;
         }
-        time_offset += segment_trx.m_end_time;
+        std::fprintf(m_outfile, "\n\n");
     }
-    std::fclose(outfile);
+    m_time_offset += segment_trx.m_end_time;
+    std::fflush(m_outfile);
+    return text;
+}
+
+
+void save_to_srt(const std::vector<SegmentTranscription>& transcription,
+                 const Tokenizer& tokenizer,
+                 const std::string& filename,
+                 float start_time,
+                 float time_scale)
+{
+    SrtWriter writer(filename, tokenizer, start_time, time_scale);
+    for (const auto &segment_trx : transcription)
+        writer.append(segment_trx);
 }
 
 } // namespace capgen
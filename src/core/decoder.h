@@ -6,12 +6,16 @@
 
 #include <ATen/ATen.h>
 
+#include <cstdio>
+#include <string>
 #include <vector>
 
  
 namespace capgen {
 
-int detect_language(const at::Tensor &spectrogram,
+// Detects the language spoken in the window whose encoder output is `audio_features`.
+int detect_language(const at::Tensor &audio_features,
+                    const int cache_index,
                     std::shared_ptr<Whisper>,
                     const Tokenizer &tokenizer);
 
@@ -26,6 +30,11 @@ public:
 };
 
 
+// Why the decoding of a segment stopped. Decoding stops early if the model gets stuck
+// repeating itself or if it predicts more tokens than the segment's duration allows.
+enum class DecodingStopReason { Completed, Repetition, TokenBudget };
+
+
 // Represents full transcription of a 30-second segment. For instance, 
 //<0.00>The quick brown fox jumped over the lazy dog<2.00><2.00>Some other content
 // <3.12>...<28.12>Final transcription.<30.00>.
@@ -36,34 +45,149 @@ public:
     std::vector<TimestampedTranscription> sub_segments;
     uint32_t m_segment_index;
     float m_end_time;
+    DecodingStopReason m_stop_reason = DecodingStopReason::Completed;
 
     SegmentTranscription(std::vector<uint32_t>& tokens,
                        uint32_t segment_index,
                        const Tokenizer& tokenizer);
+    // Creates a segment without any transcription that ends at `end_time`. Used for the
+    // parts of the audio that are skipped because they contain no speech.
+    SegmentTranscription(uint32_t segment_index, float end_time);
+
+    // Drops the transcriptions that start at or after `end_time` and ends the segment at
+    // `end_time`. Used to align a segment to one decoded from the same audio by another
+    // task so that both advance through the audio in lockstep.
+    void clip(float end_time);
 };
 
 
-void greedy_decode_segment(const at::Tensor& spectrogram,
-                           TranscriptionTask task,
-                           const uint32_t language_id,
-                           const uint32_t segment_index,
-                           std::shared_ptr<Whisper>,
-                           const Tokenizer& tokenizer,
-                           std::vector<SegmentTranscription>& out_transcriptions);
+// Output of decoding a single 30-second segment.
+class DecodingResult {
+public:
+    // The predicted tokens, excluding the prompt and the end-of-transcript token.
+    std::vector<uint32_t> tokens;
+    // Sum of log probabilities of the predicted tokens, including end-of-transcript.
+    float sum_logprob = 0.0f;
+    DecodingStopReason stop_reason = DecodingStopReason::Completed;
+    // Probability of the no-speech token at the start of the transcript. A high value
+    // together with a low average log probability indicates that the segment has no speech.
+    float no_speech_prob = 0.0f;
+
+    float avg_logprob() const { return sum_logprob / (tokens.size() + 1); }
+};
 
 
-void beamsearch_decode_segment(const at::Tensor& spectrogram,
-                           TranscriptionTask task,
-                           const uint32_t language_id,
-                           const uint32_t segment_index,
-                           std::shared_ptr<Whisper>,
-                           const Tokenizer& tokenizer,
-                           std::vector<SegmentTranscription>& out_transcriptions);
+// Ratio of the size of the decoded text to its zlib-compressed size. Repetitive text
+// compresses well so a high ratio indicates the model got stuck in a loop.
+float compression_ratio(const std::vector<uint32_t>& tokens, const Tokenizer& tokenizer);
+
+
+// The decoding functions below take the encoder output of the segment rather than its
+// spectrogram so that a single encoder pass can be shared by several decoding passes.
+// Decoding passes over the same audio features should use the same `cache_index` so that
+// the decoder can reuse its cross-attention cache.
+DecodingResult greedy_decode_segment(const at::Tensor& audio_features,
+                                     TranscriptionTask task,
+                                     const uint32_t language_id,
+                                     const int cache_index,
+                                     const uint32_t max_tokens,
+                                     std::shared_ptr<Whisper>,
+                                     const Tokenizer& tokenizer,
+                                     const DecodingOptions& options);
+
+
+DecodingResult beamsearch_decode_segment(const at::Tensor& audio_features,
+                                         TranscriptionTask task,
+                                         const uint32_t language_id,
+                                         const int cache_index,
+                                         const uint32_t max_tokens,
+                                         std::shared_ptr<Whisper>,
+                                         const Tokenizer& tokenizer,
+                                         const DecodingOptions& options);
+
+
+// Decodes the segment greedily and re-decodes it with beamsearch only if the greedy
+// output fails the log probability or compression ratio thresholds in `options`.
+DecodingResult adaptive_decode_segment(const at::Tensor& audio_features,
+                                       TranscriptionTask task,
+                                       const uint32_t language_id,
+                                       const int cache_index,
+                                       const uint32_t max_tokens,
+                                       std::shared_ptr<Whisper>,
+                                       const Tokenizer& tokenizer,
+                                       const DecodingOptions& options);
+
+
+// Produces the same tokens as greedy decoding but with fewer sequential calls to `model`.
+// `draft_model`, a smaller model sharing the tokenizer of `model`, proposes up to
+// `options.n_draft_tokens` tokens which `model` then verifies in a single call. The draft
+// tokens are accepted up to the first one that differs from the prediction of `model`.
+// `draft_audio_features` is the encoder output of the draft model for the same segment.
+DecodingResult speculative_decode_segment(const at::Tensor& audio_features,
+                                          const at::Tensor& draft_audio_features,
+                                          TranscriptionTask task,
+                                          const uint32_t language_id,
+                                          const int cache_index,
+                                          const uint32_t max_tokens,
+                                          std::shared_ptr<Whisper> model,
+                                          std::shared_ptr<Whisper> draft_model,
+                                          const Tokenizer& tokenizer,
+                                          const DecodingOptions& options);
+
+
+// Decodes the segment using the given decoding method. `segment_duration` is the duration,
+// in seconds, of the audio in the segment excluding padding and bounds the number of tokens
+// that may be predicted. Greedy decoding is done speculatively if `options.draft_model` is
+// set and `draft_audio_features` is defined.
+DecodingResult decode_segment(const at::Tensor& audio_features,
+                              const at::Tensor& draft_audio_features,
+                              TranscriptionTask task,
+                              const uint32_t language_id,
+                              const int cache_index,
+                              const float segment_duration,
+                              std::shared_ptr<Whisper>,
+                              const Tokenizer& tokenizer,
+                              TranscriptionDecoder decoder,
+                              const DecodingOptions& options);
+
+// Writes the transcription of a media file to an srt file one segment at a time, as the
+// segments are decoded, so that the captions of the finished segments are on disk if the
+// transcription fails and can be shown while the rest of the audio is transcribed. The
+// segments must be appended in order because the times in the file are relative to the
+// start of the audio.
+class SrtWriter {
+public:
+    /// @param start_time Time, in seconds, in the media at which the first segment starts.
+    /// @param time_scale Factor by which the times in the segments are multiplied to get
+    ///  times in the media, e.g the tempo by which the audio was sped up.
+    SrtWriter(const std::string& filename,
+              const Tokenizer& tokenizer,
+              float start_time = 0.0f,
+              float time_scale = 1.0f);
+    ~SrtWriter();
+    SrtWriter(const SrtWriter&) = delete;
+    SrtWriter& operator=(const SrtWriter&) = delete;
+
+    // Writes the captions of the segment, flushes them to the file and returns their text.
+    std::string append(const SegmentTranscription& segment_trx);
+
+private:
+    std::FILE *m_outfile;
+    Tokenizer m_tokenizer;
+    float m_start_time;
+    float m_time_scale;
+    // Start time, in seconds, of the next segment relative to the first segment.
+    float m_time_offset = 0.0f;
+    // Index of the next caption. Captions are numbered from one.
+    int m_caption_index = 1;
+};
 
 // TODO: Should probably in utils.h
 void save_to_srt(const std::vector<SegmentTranscription>& transcription,
                  const Tokenizer& tokenizer,
-                 const std::string& filename);
+                 const std::string& filename,
+                 float start_time = 0.0f,
+                 float time_scale = 1.0f);
 
 } // namespace capgen
 
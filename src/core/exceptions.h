@@ -11,4 +11,11 @@ public:
     const char* what() const noexcept override { return "Failed to decode media."; };
 };
 
+/// Thrown by `transcribe` when the transcription is cancelled, see `DecodingOptions`.
+class TranscriptionCancelledException : public std::exception
+{
+public:
+    const char* what() const noexcept override { return "Transcription cancelled."; };
+};
+
 }
@@ -0,0 +1,362 @@
+#include "kernels.h"
+
+#include <ATen/Parallel.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CG_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+
+static float dot_scalar(const float *a, const float *b, int size)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < size; ++i)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+static float bf16_to_float(uint16_t value)
+{
+    // A bfloat16 is the upper half of a float.
+    const uint32_t bits = (uint32_t)value << 16;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+static float f16_to_float(uint16_t value)
+{
+    const uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+    uint32_t exponent = (value >> 10) & 0x1f;
+    uint32_t mantissa = value & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0x1f)  // Infinity and NaN.
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    else if (exponent != 0)
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else if (mantissa == 0)
+        bits = sign;
+    else
+    {
+        // Subnormal halfs are normal floats.
+        exponent = 113;
+        while (!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            exponent -= 1;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+static float dot_f16_scalar(const float *a, const uint16_t *b, int size)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < size; ++i)
+        sum += a[i] * f16_to_float(b[i]);
+    return sum;
+}
+
+static float dot_bf16_scalar(const float *a, const uint16_t *b, int size)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < size; ++i)
+        sum += a[i] * bf16_to_float(b[i]);
+    return sum;
+}
+
+#ifdef CG_KERNELS_X86
+
+__attribute__((target("avx2,fma")))
+static float hsum_avx2(__m256 acc)
+{
+    const __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    const __m128 sum2 = _mm_add_ps(sum4, _mm_movehl_ps(sum4, sum4));
+    const __m128 sum1 = _mm_add_ss(sum2, _mm_shuffle_ps(sum2, sum2, 0x55));
+    return _mm_cvtss_f32(sum1);
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *a, const float *b, int size)
+{
+    // Two accumulators hide the latency of the fused multiply-adds.
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= size; i += 8)
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    float sum = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < size; ++i)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static float dot_avx512(const float *a, const float *b, int size)
+{
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i + 16 <= size; i += 16)
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    float sum = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+    for (; i < size; ++i)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static float dot_f16_avx2(const float *a, const uint16_t *b, int size)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m256 b0 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)));
+        const __m256 b1 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i + 8)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), b0, acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), b1, acc1);
+    }
+    float sum = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < size; ++i)
+        sum += a[i] * f16_to_float(b[i]);
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static __m256 load_bf16_avx2(const uint16_t *b)
+{
+    const __m256i widened = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b)));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(widened, 16));
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_bf16_avx2(const float *a, const uint16_t *b, int size)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), load_bf16_avx2(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), load_bf16_avx2(b + i + 8), acc1);
+    }
+    float sum = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < size; ++i)
+        sum += a[i] * bf16_to_float(b[i]);
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static float dot_f16_avx512(const float *a, const uint16_t *b, int size)
+{
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m512 b0 = _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i)));
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), b0, acc);
+    }
+    float sum = _mm512_reduce_add_ps(acc);
+    for (; i < size; ++i)
+        sum += a[i] * f16_to_float(b[i]);
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static float dot_bf16_avx512(const float *a, const uint16_t *b, int size)
+{
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m512i widened = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i)));
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_castsi512_ps(_mm512_slli_epi32(widened, 16)), acc);
+    }
+    float sum = _mm512_reduce_add_ps(acc);
+    for (; i < size; ++i)
+        sum += a[i] * bf16_to_float(b[i]);
+    return sum;
+}
+
+#endif // CG_KERNELS_X86
+
+
+using DotFn = float (*)(const float *, const float *, int);
+using DotHalfFn = float (*)(const float *, const uint16_t *, int);
+
+struct DotKernel {
+    DotFn fn;
+    DotHalfFn f16_fn;
+    DotHalfFn bf16_fn;
+    const char *isa;
+};
+
+static DotKernel select_dot_kernel()
+{
+#ifdef CG_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return {dot_avx512, dot_f16_avx512, dot_bf16_avx512, "avx512"};
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        // Every CPU with AVX2 has F16C but it is a separate feature flag.
+        const DotHalfFn f16_fn = __builtin_cpu_supports("f16c") ? dot_f16_avx2 : dot_f16_scalar;
+        return {dot_avx2, f16_fn, dot_bf16_avx2, "avx2"};
+    }
+#endif
+    return {dot_scalar, dot_f16_scalar, dot_bf16_scalar, "scalar"};
+}
+
+static const DotKernel s_DOT_KERNEL = select_dot_kernel();
+
+
+namespace capgen {
+
+const char *kernels_isa()
+{
+    return s_DOT_KERNEL.isa;
+}
+
+float dot(const float *a, const float *b, int size)
+{
+    return s_DOT_KERNEL.fn(a, b, size);
+}
+
+void axpy(float alpha, const float *x, float *y, int size)
+{
+    for (int i = 0; i < size; ++i)
+        y[i] += alpha * x[i];
+}
+
+template <typename T, typename Fn>
+static void linear_impl(const float *x, int n_rows, int in_features,
+                        const T *w, Fn dot_fn, const float *b, int out_features,
+                        float *y)
+{
+    // Each weight row is loaded once and used for all the input rows.
+    const int64_t grain_size = 16;
+    at::parallel_for(0, out_features, grain_size, [&](int64_t begin, int64_t end) {
+        for (int64_t o = begin; o < end; ++o)
+        {
+            const T *w_row = w + o * in_features;
+            const float bias = b ? b[o] : 0.0f;
+            for (int r = 0; r < n_rows; ++r)
+                y[r * out_features + o] = dot_fn(x + r * in_features, w_row, in_features) + bias;
+        }
+    });
+}
+
+void linear(const float *x, int n_rows, int in_features,
+            const WeightMatrix& w, const float *b, int out_features,
+            float *y)
+{
+    switch (w.type)
+    {
+        case WeightType::F32:
+            linear_impl(x, n_rows, in_features, static_cast<const float *>(w.data), s_DOT_KERNEL.fn, b, out_features, y);
+            break;
+        case WeightType::F16:
+            linear_impl(x, n_rows, in_features, static_cast<const uint16_t *>(w.data), s_DOT_KERNEL.f16_fn, b, out_features, y);
+            break;
+        case WeightType::BF16:
+            linear_impl(x, n_rows, in_features, static_cast<const uint16_t *>(w.data), s_DOT_KERNEL.bf16_fn, b, out_features, y);
+            break;
+    }
+}
+
+void load_row(const WeightMatrix& w, int64_t row, int size, float *out)
+{
+    switch (w.type)
+    {
+        case WeightType::F32:
+            std::copy_n(static_cast<const float *>(w.data) + row * size, size, out);
+            break;
+        case WeightType::F16:
+            for (int i = 0; i < size; ++i)
+                out[i] = f16_to_float(static_cast<const uint16_t *>(w.data)[row * size + i]);
+            break;
+        case WeightType::BF16:
+            for (int i = 0; i < size; ++i)
+                out[i] = bf16_to_float(static_cast<const uint16_t *>(w.data)[row * size + i]);
+            break;
+    }
+}
+
+void layer_norm(const float *x, int n_rows, int size,
+                const float *gamma, const float *beta,
+                float *out, float eps)
+{
+    for (int r = 0; r < n_rows; ++r)
+    {
+        const float *x_row = x + r * size;
+        float *out_row = out + r * size;
+        float mean = 0.0f;
+        for (int i = 0; i < size; ++i)
+            mean += x_row[i];
+        mean /= size;
+        float var = 0.0f;
+        for (int i = 0; i < size; ++i)
+            var += (x_row[i] - mean) * (x_row[i] - mean);
+        var /= size;
+        const float inv_std = 1.0f / std::sqrt(var + eps);
+        for (int i = 0; i < size; ++i)
+            out_row[i] = (x_row[i] - mean) * inv_std * gamma[i] + beta[i];
+    }
+}
+
+void gelu(float *x, int size)
+{
+    const float inv_sqrt2 = 0.70710678118654752f;
+    for (int i = 0; i < size; ++i)
+        x[i] = 0.5f * x[i] * (1.0f + std::erf(x[i] * inv_sqrt2));
+}
+
+void attention(const float *q, const float *k, const float *v, int n_keys, int kv_stride,
+               int n_head, int d_head, float scale, float *scores, float *out)
+{
+    at::parallel_for(0, n_head, 1, [&](int64_t begin, int64_t end) {
+        for (int64_t h = begin; h < end; ++h)
+        {
+            const float *q_head = q + h * d_head;
+            float *head_scores = scores + h * n_keys;
+            float max_score = -INFINITY;
+            for (int i = 0; i < n_keys; ++i)
+            {
+                head_scores[i] = s_DOT_KERNEL.fn(q_head, k + i * kv_stride + h * d_head, d_head) * scale;
+                max_score = std::max(max_score, head_scores[i]);
+            }
+            float sum = 0.0f;
+            for (int i = 0; i < n_keys; ++i)
+            {
+                head_scores[i] = std::exp(head_scores[i] - max_score);
+                sum += head_scores[i];
+            }
+            float *out_head = out + h * d_head;
+            std::fill(out_head, out_head + d_head, 0.0f);
+            for (int i = 0; i < n_keys; ++i)
+                axpy(head_scores[i] / sum, v + i * kv_stride + h * d_head, out_head, d_head);
+        }
+    });
+}
+
+} // namespace capgen
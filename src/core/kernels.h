@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+
+
+// Compute kernels used by the native decoder. All buffers are row-major float arrays,
+// except the weight matrices which may be stored in a 16-bit type.
+// The dot product, which dominates the cost of the decoder, is dispatched at runtime to
+// an AVX-512 or AVX2 implementation if the CPU supports it.
+namespace capgen {
+
+// Storage type of a weight matrix. 16-bit weights are converted to fp32 as they are loaded
+// so all the arithmetic and the accumulation is done in fp32.
+enum class WeightType { F32, F16, BF16 };
+
+struct WeightMatrix {
+    const void *data;
+    WeightType type;
+};
+
+// Returns the name of the instruction set used by the kernels, e.g "avx2".
+const char *kernels_isa();
+
+float dot(const float *a, const float *b, int size);
+
+// y += alpha * x
+void axpy(float alpha, const float *x, float *y, int size);
+
+// Computes y = x @ w.T + b where x is [n_rows, in_features], w is [out_features, in_features]
+// and y is [n_rows, out_features]. `b` may be null. Output features are computed in parallel.
+void linear(const float *x, int n_rows, int in_features,
+            const WeightMatrix& w, const float *b, int out_features,
+            float *y);
+
+// Converts row `row` of the weight matrix `w`, whose rows have `size` elements, to fp32.
+void load_row(const WeightMatrix& w, int64_t row, int size, float *out);
+
+// Normalizes each of the `n_rows` rows of `x`, of `size` elements, into `out`.
+void layer_norm(const float *x, int n_rows, int size,
+                const float *gamma, const float *beta,
+                float *out, float eps = 1e-5f);
+
+// Applies the exact (erf) GELU activation in place.
+void gelu(float *x, int size);
+
+// Computes the attention output of a single query over `n_keys` keys and values of
+// `n_head` heads, each of `d_head` elements. Row i of `k` and `v` holds the key and value of
+// position i for all the heads and rows are `kv_stride` elements apart. The attention
+// scores are scaled by `scale`. Heads are computed in parallel and `scores` must hold at
+// least `n_head * n_keys` elements.
+void attention(const float *q, const float *k, const float *v, int n_keys, int kv_stride,
+               int n_head, int d_head, float scale, float *scores, float *out);
+
+} // namespace capgen
@@ -1,37 +1,107 @@
+#include <chrono>
+#include <filesystem>
+#include <limits>
 #include <vector>
 #include "model.h"
+#include "native_decoder.h"
+#include "utils.h"
+#include "weights.h"
 #include "log.h"
 
 
+// Number of runs on synthetic inputs done at load. The profiling executor profiles the first
+// run of a graph and specializes it on the second.
+static const int s_WARM_UP_RUNS = 2;
+
+#ifdef CAPGEN_CHECK_DECODER_PARITY
+// Largest difference between the logits of the native and the scripted decoders that is
+// attributed to the different order of floating point operations.
+static const float s_DECODER_PARITY_TOLERANCE = 1e-2f;
+#endif
+
+
+// Returns the name of the data type in which the weights of the module are stored. Reduced
+// precision variants are saved unfrozen so that their weights remain bf16 or fp16 parameters,
+// while frozen modules hold their weights as fp32 constants.
+static const char *weights_dtype(const torch::jit::Module& module)
+{
+    for (const at::Tensor& param : module.parameters())
+        return c10::toString(param.scalar_type());
+    return c10::toString(at::kFloat);
+}
+
+// Returns the path of a file of the model, e.g `./assets/models/tiny/encoder.en.pt` for the
+// file `encoder` with the extension `.pt` of the English tiny model.
+static std::string model_file_path(const std::string &name, capgen::ModelType model_type, const char *file, const char *extension)
+{
+    const char *type_suffix = (model_type == capgen::ModelType::English) ? ".en" : "";
+    return std::string("./assets/models/") + name + "/" + file + type_suffix + extension;
+}
+
+
 namespace capgen {
 
-Whisper::Whisper(const std::string &name, ModelType model_type)
+Whisper::Whisper(const std::string &name, ModelType model_type, DecoderBackendType backend_type)
   : m_name(name), m_model_type(model_type)
 {
     CG_LOG_INFO("Loading model: %s", name.c_str());
-    std::string encoder_path;
-    std::string decoder_path;
-    if (m_model_type == ModelType::English) {
-      encoder_path = std::string("./assets/models/") + m_name + std::string("/encoder.en.pt");
-      decoder_path = std::string("./assets/models/") + m_name + std::string("/decoder.en.pt");
-    }
-    else {
-      encoder_path = std::string("./assets/models/") + m_name + std::string("/encoder.pt");
-      decoder_path = std::string("./assets/models/") + m_name + std::string("/decoder.pt");
-    }
+    const std::string encoder_path = model_file_path(m_name, m_model_type, "encoder", ".pt");
+    const std::string decoder_path = model_file_path(m_name, m_model_type, "decoder", ".pt");
+    const std::string encoder_weights_path = model_file_path(m_name, m_model_type, "encoder", ".bin");
+    const std::string decoder_weights_path = model_file_path(m_name, m_model_type, "decoder", ".bin");
+    // Models exported with `--format mmap` keep their weights in memory-mapped files rather
+    // than in the scripted modules.
+    const bool mapped_weights = std::filesystem::exists(encoder_weights_path);
+    const std::string scripted_decoder_weights_path = mapped_weights ? decoder_weights_path : "";
 
     CG_LOG_INFO("Model encoder path: %s", encoder_path.c_str());
     CG_LOG_INFO("Model decoder path: %s", decoder_path.c_str());
 
+    if (backend_type == DecoderBackendType::Native && !std::filesystem::exists(decoder_weights_path))
+    {
+        CG_LOG_WARNING("Decoder weights not found at %s, using the scripted decoder", decoder_weights_path.c_str());
+        backend_type = DecoderBackendType::TorchScript;
+    }
+
     try {
-    	m_encoder = torch::jit::load(encoder_path);
-    	m_decoder = torch::jit::load(decoder_path);
+    	if (mapped_weights)
+    	{
+    	    m_encoder = torch::jit::load(encoder_path);
+    	    assign_weights(m_encoder, load_weights(encoder_weights_path));
+    	}
+    	else
+    	    m_encoder = load_optimized_module(encoder_path);
+    	if (backend_type == DecoderBackendType::Native)
+    	{
+    	    m_decoder = std::make_unique<NativeDecoder>(decoder_weights_path);
+#ifdef CAPGEN_CHECK_DECODER_PARITY
+    	    m_reference_decoder = std::make_unique<TorchScriptDecoder>(decoder_path, scripted_decoder_weights_path);
+#endif
+    	}
+    	else
+    	    m_decoder = std::make_unique<TorchScriptDecoder>(decoder_path, scripted_decoder_weights_path);
     }
     catch (const c10::Error &e) {
         CG_LOG_MERROR("Failed to load models");
     	throw;
     }
-    CG_LOG_MINFO("Model loading complete");
+    CG_LOG_INFO("Model loading complete: decoder=%s, weights=%s", m_decoder->name(), weights_dtype(m_encoder));
+    warm_up();
+}
+
+void Whisper::warm_up()
+{
+    const auto start_time = std::chrono::steady_clock::now();
+    const at::Tensor spectrogram = at::zeros({1, 80, 3000});
+    const at::Tensor tokens = at::zeros({1, 4}, at::TensorOptions(at::kLong));
+    for (int i = 0; i < s_WARM_UP_RUNS; ++i)
+    {
+        const at::Tensor audio_features = embed_audio(spectrogram);
+        logits(tokens, audio_features, i);
+    }
+    clear_cache();
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time);
+    CG_LOG_INFO("Model warm-up complete: %dms", (int)elapsed.count());
 }
 
 at::Tensor Whisper::embed_audio(const at::Tensor& spectrogram)
@@ -49,12 +119,56 @@ bool Whisper::is_multilingual()
 
 at::Tensor Whisper::logits(const at::Tensor& tokens, 
                            const at::Tensor& audio_features,
-                           const int cache_index)
+                           const int cache_index,
+                           const int64_t n_last)
 {
     at::NoGradGuard no_grad;  // No gradients.
-    const std::vector<torch::jit::IValue> decoder_inputs = {tokens, audio_features, at::tensor({cache_index})};
-    const at::Tensor logits = m_decoder.forward(decoder_inputs).toTensor();
+    bool new_audio = false;
+    if (cache_index != m_cache_index || audio_features.size(0) != m_cache_batch_size)
+    {
+        m_cache_index = cache_index;
+        m_cache_batch_size = audio_features.size(0);
+        m_decoder_cache_index += 1;
+        new_audio = true;
+    }
+    const at::Tensor logits = m_decoder->logits(tokens, audio_features, m_decoder_cache_index, n_last);
+
+#ifdef CAPGEN_CHECK_DECODER_PARITY
+    // The check is done on the first call of every window because the scripted decoder is
+    // much slower.
+    if (m_reference_decoder && new_audio)
+    {
+        const at::Tensor expected = m_reference_decoder->logits(tokens, audio_features, m_decoder_cache_index, n_last);
+        const float max_diff = (logits - expected).abs().max().item<float>();
+        if (max_diff > s_DECODER_PARITY_TOLERANCE)
+            CG_LOG_WARNING("Native decoder logits differ from the scripted decoder: max_diff=%f", max_diff);
+        else
+            CG_LOG_DEBUG("Native decoder parity check passed: max_diff=%f", max_diff);
+    }
+#endif
     return logits;
 }
 
-}  // namespace capgen
\ No newline at end of file
+void Whisper::clear_cache()
+{
+    // No call is made with this index so the next call always gets a new decoder index.
+    m_cache_index = std::numeric_limits<int>::min();
+}
+
+uint64_t model_files_hash(const std::string &name, ModelType model_type)
+{
+    uint64_t hash = HASH_SEED;
+    for (const char *file : {"encoder", "decoder"})
+        for (const char *extension : {".pt", ".bin"})
+        {
+            const std::string path = model_file_path(name, model_type, file, extension);
+            // Only models exported with `--format mmap` have weights files.
+            if (!std::filesystem::exists(path))
+                continue;
+            const uint64_t file_hash = hash_media_file(path);
+            hash = hash_bytes(&file_hash, sizeof(file_hash), hash);
+        }
+    return hash;
+}
+
+}  // namespace capgen
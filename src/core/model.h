@@ -1,8 +1,12 @@
 #pragma once
 
+#include "backend.h"
+
 #include <torch/script.h>
 
+#include <memory>
 #include <string>
+#include <vector>
 
 namespace capgen {
 
@@ -13,12 +17,26 @@ enum class ModelType {
 
 class Whisper {
 public:
-    Whisper(const std::string &name, ModelType model_type);
+    /// @param backend_type The implementation of the decoder. The native decoder requires
+    ///  the decoder weights file and the scripted decoder is used if it is not found.
+    Whisper(const std::string &name,
+            ModelType model_type,
+            DecoderBackendType backend_type = DecoderBackendType::TorchScript);
     at::Tensor embed_audio(const at::Tensor& spectrogram);
     bool is_multilingual();
+    /// @brief Computes the logits of the given tokens.
+    /// @param cache_index Identifies the audio features. The decoder computes its
+    ///  cross-attention cache once and reuses it for all calls with the same index so
+    ///  calls with different audio features must use different indices.
+    /// @param n_last The number of trailing positions whose logits are returned. All the
+    ///  positions are returned if it is not positive.
     at::Tensor logits(const at::Tensor& tokens,
                       const at::Tensor& audio_features,
-                      const int cache_index);
+                      const int cache_index,
+                      const int64_t n_last = -1);
+    // Forces the decoder to recompute its cross-attention cache on the next call. Must be
+    // called before reusing cache indices with new audio, e.g at the start of a transcription.
+    void clear_cache();
 
     uint32_t n_ctx() const { return m_n_ctx; }
     const std::string &name() const { return m_name; }
@@ -30,8 +48,29 @@ private:
     std::string m_name;
     ModelType m_model_type;
 
+    // The decoder assumes that calls with the same cache index have audio features of the
+    // same shape so it cannot tell when the batch size of the audio features changes, e.g
+    // when a segment decoded greedily is re-decoded with beamsearch. We therefore keep track
+    // of the cache index and batch size of the last call and give the decoder an index it
+    // has never seen whenever either of them changes.
+    int m_cache_index = -1;
+    int64_t m_cache_batch_size = -1;
+    int m_decoder_cache_index = -1;
+
     torch::jit::script::Module m_encoder;
-    torch::jit::script::Module m_decoder;
+    std::unique_ptr<DecoderBackend> m_decoder;
+
+    // Runs the encoder and the decoder on synthetic inputs so that the graph optimizations
+    // of the scripted modules are done at load rather than on the first windows of a job.
+    void warm_up();
+#ifdef CAPGEN_CHECK_DECODER_PARITY
+    // Builds with CAPGEN_CHECK_DECODER_PARITY compare the native decoder with the scripted one.
+    std::unique_ptr<DecoderBackend> m_reference_decoder;
+#endif
 };
 
+/// @brief Returns a hash of the files of the model that changes whenever the model is
+///  exported again. It is computed without loading the model.
+uint64_t model_files_hash(const std::string &name, ModelType model_type);
+
 } // namespace capgen
@@ -0,0 +1,150 @@
+#include "models_manager.h"
+#include "log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <filesystem>
+
+capgen::ModelsManager::ModelsManager()
+{
+    register_downloaded_models();
+}
+
+std::shared_ptr<capgen::Whisper> capgen::ModelsManager::get_model(const std::string &name, capgen::ModelType model_type)
+{
+    std::shared_future<std::shared_ptr<capgen::Whisper>> model;
+    std::promise<std::shared_ptr<capgen::Whisper>> load_promise;
+    bool load = false;
+    DecoderBackendType backend_type;
+    {
+        std::lock_guard<std::mutex> lock(m_loaded_models_mutex);
+        backend_type = m_backend_type;
+        for (const auto &loaded_model : m_loaded_models)
+            if (loaded_model.name == name && loaded_model.model_type == model_type && loaded_model.backend_type == backend_type)
+                model = loaded_model.model;
+        // If model is not loaded, load it into memory. The load is done outside the lock so
+        // that other models can be requested meanwhile.
+        if (!model.valid())
+        {
+            model = load_promise.get_future().share();
+            m_loaded_models.push_back({name, model_type, backend_type, model});
+            load = true;
+        }
+    }
+
+    if (load)
+    {
+        try {
+            load_promise.set_value(std::make_shared<capgen::Whisper>(name, model_type, backend_type));
+        }
+        catch (const std::exception &e) {
+            // Threads waiting for the model get the exception and the next request retries.
+            load_promise.set_exception(std::current_exception());
+            std::lock_guard<std::mutex> lock(m_loaded_models_mutex);
+            m_loaded_models.erase(std::remove_if(m_loaded_models.begin(), m_loaded_models.end(),
+                [&name, model_type, backend_type](const LoadedModel &loaded_model) {
+                    return loaded_model.name == name && loaded_model.model_type == model_type && loaded_model.backend_type == backend_type;
+                }), m_loaded_models.end());
+        }
+    }
+    return model.get();
+}
+
+bool capgen::ModelsManager::model_is_loaded(const std::string &name, capgen::ModelType model_type)
+{
+    std::lock_guard<std::mutex> lock(m_loaded_models_mutex);
+    for (const auto &loaded_model : m_loaded_models)
+        if (loaded_model.name == name && loaded_model.model_type == model_type && loaded_model.backend_type == m_backend_type)
+            return loaded_model.model.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    return false;
+}
+
+void capgen::ModelsManager::unload_model(const std::string &name, capgen::ModelType model_type, capgen::DecoderBackendType backend_type)
+{
+    std::lock_guard<std::mutex> lock(m_loaded_models_mutex);
+    m_loaded_models.erase(std::remove_if(m_loaded_models.begin(), m_loaded_models.end(),
+        [&name, model_type, backend_type](const LoadedModel &loaded_model) {
+            return loaded_model.name == name && loaded_model.model_type == model_type && loaded_model.backend_type == backend_type;
+        }), m_loaded_models.end());
+    CG_LOG_INFO("Unloaded model: %s", name.c_str());
+}
+
+void capgen::ModelsManager::set_decoder_backend(capgen::DecoderBackendType backend_type)
+{
+    std::lock_guard<std::mutex> lock(m_loaded_models_mutex);
+    m_backend_type = backend_type;
+}
+
+capgen::DecoderBackendType capgen::ModelsManager::get_decoder_backend()
+{
+    std::lock_guard<std::mutex> lock(m_loaded_models_mutex);
+    return m_backend_type;
+}
+
+const std::vector<std::string> &capgen::ModelsManager::get_registered_models() const
+{
+    return m_registered_models;
+}
+
+int capgen::ModelsManager::get_registered_models_length() const
+{
+    return m_registered_models.size();
+}
+
+std::string capgen::ModelsManager::get_default_model_name() const
+{
+    std::string default_model = "base";
+    if (model_is_registered(default_model))
+        return default_model;
+    if (m_registered_models.size() == 0)
+        return "";
+    return m_registered_models.front();
+}
+
+const capgen::ModelInfo& capgen::ModelsManager::get_model_info(const std::string& model_name) const
+{
+    if (model_name == "tiny")
+        return m_tiny_model_info;
+    else if (model_name == "small")
+        return m_small_model_info;
+    return m_base_model_info;
+}
+
+std::vector<std::string> capgen::ModelsManager::get_model_variants() const
+{
+    std::vector<std::string> variants;
+    for (const auto &model_name : m_registered_models)
+        if (model_name != m_tiny_model_info.name && model_name != m_base_model_info.name && model_name != m_small_model_info.name)
+            variants.push_back(model_name);
+    return variants;
+}
+
+bool capgen::ModelsManager::model_is_registered(const std::string& name) const
+{
+    for (const auto &model_name : m_registered_models)
+        if (model_name == name)
+            return true;
+    return false;
+}
+
+void capgen::ModelsManager::register_downloaded_models()
+{
+    for (const auto &entry : std::filesystem::directory_iterator(m_models_basepath))
+        if (entry.is_directory())
+        {
+            const std::string model_dir = entry.path().string();
+            m_registered_models.push_back(std::string(model_dir.begin() + m_models_basepath.length(), model_dir.end()));
+        }
+}
+
+void capgen::ModelsManager::reload_registered_models()
+{
+    for (const auto &entry : std::filesystem::directory_iterator(m_models_basepath))
+        if (entry.is_directory()) 
+        {
+            const std::string model_dir = entry.path().string();
+            if (!model_is_registered(model_dir))
+                m_registered_models.push_back(std::string(model_dir.begin() + m_models_basepath.length(), model_dir.end()));
+        }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "model.h"
+
+#include <cstdint>
+#include <future>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+namespace capgen {
+
+struct ModelInfo {
+    const char *name;
+    uint32_t dl_size_mb; // download size (compressed).
+    uint32_t mem_usage_mb;
+    const char* url;
+};
+
+/// @brief Performs model management tasks during runtime which include:
+///  ~ Storing a list of downloaded models.
+///  ~ Loading the downloaded models from disk to memory for inference.
+class ModelsManager {
+public:
+    ModelsManager();
+    /// @brief Returns the model, loading it if it is not loaded. Models may be requested from
+    ///  several threads at once and a model that is being loaded by another thread, e.g by a
+    ///  preload, is waited for rather than loaded a second time.
+    std::shared_ptr<capgen::Whisper> get_model(const std::string &name, capgen::ModelType model_type);
+    /// @brief Whether the model is loaded and ready to be used.
+    bool model_is_loaded(const std::string &name, capgen::ModelType model_type);
+    /// @brief Drops the model loaded with the given backend. A model that is in use is freed
+    ///  once its users release it and a model that is being loaded once its load completes.
+    void unload_model(const std::string &name, capgen::ModelType model_type, DecoderBackendType backend_type);
+    /// @brief Sets the decoder implementation of the models that are requested afterwards.
+    ///  Models loaded with another backend are kept but are not returned by `get_model`.
+    void set_decoder_backend(DecoderBackendType backend_type);
+    DecoderBackendType get_decoder_backend();
+    const std::vector<std::string> &get_registered_models() const;
+    bool model_is_registered(const std::string &name) const;
+    void reload_registered_models();
+    void register_downloaded_models();
+    int get_registered_models_length() const;
+    std::string get_default_model_name() const;
+    const ModelInfo& get_model_info(const std::string& model_name) const;
+    /// @brief Returns the registered models that are variants of the downloadable models,
+    ///  e.g `small-int8`. Variants are exported locally with `cpp_model_gen.py`.
+    std::vector<std::string> get_model_variants() const;
+
+private:
+    const ModelInfo m_tiny_model_info = {"tiny", 178, 500, "https://huggingface.co/iangitonga/capgen_models/resolve/main/tiny.zip"};
+    const ModelInfo m_base_model_info = {"base", 338, 800, "https://huggingface.co/iangitonga/capgen_models/resolve/main/base.zip"};
+    const ModelInfo m_small_model_info = {"small", 1140, 1000, "https://huggingface.co/iangitonga/capgen_models/resolve/main/small.zip"};
+
+    const std::string m_models_basepath =  "./assets/models/";
+    std::vector<std::string> m_registered_models;
+
+    struct LoadedModel {
+        std::string name;
+        capgen::ModelType model_type;
+        DecoderBackendType backend_type;
+        // Becomes ready when the model has loaded.
+        std::shared_future<std::shared_ptr<capgen::Whisper>> model;
+    };
+    // Models loaded in memory or being loaded and the backend of the models requested next.
+    // Guarded by `m_loaded_models_mutex`.
+    std::vector<LoadedModel> m_loaded_models;
+    DecoderBackendType m_backend_type = DecoderBackendType::TorchScript;
+    std::mutex m_loaded_models_mutex;
+};
+
+} // namespace capgen
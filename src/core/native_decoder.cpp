@@ -0,0 +1,310 @@
+#include "native_decoder.h"
+#include "weights.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <exception>
+
+
+// The heads of all the whisper models have 64 dimensions.
+static const int s_D_HEAD = 64;
+
+
+namespace capgen {
+
+NativeDecoder::NativeDecoder(const std::string& weights_path)
+{
+    m_weights = load_weights(weights_path);
+
+    const at::Tensor token_embedding = weight_tensor("token_embedding.weight");
+    m_n_vocab = token_embedding.size(0);
+    m_n_state = token_embedding.size(1);
+    m_n_ctx = weight_tensor("positional_embedding").size(0);
+    m_n_head = m_n_state / s_D_HEAD;
+    m_n_layer = 0;
+    while (m_weights.count("blocks." + std::to_string(m_n_layer) + ".attn.qkv.weight"))
+        m_n_layer += 1;
+    // Files written before the projections were fused have no `attn.qkv` weights.
+    if (m_n_layer == 0)
+    {
+        CG_LOG_ERROR("Weights file %s has no decoder layers", weights_path.c_str());
+        throw std::exception();
+    }
+
+    m_token_embedding = weight_matrix("token_embedding.weight");
+    m_positional_embedding = weight("positional_embedding");
+    m_ln_w = weight("ln.weight");
+    m_ln_b = weight("ln.bias");
+    for (int i = 0; i < m_n_layer; ++i)
+    {
+        const std::string block = "blocks." + std::to_string(i) + ".";
+        LayerWeights layer;
+        layer.attn_ln_w = weight(block + "attn_ln.weight");
+        layer.attn_ln_b = weight(block + "attn_ln.bias");
+        layer.attn_qkv_w = weight_matrix(block + "attn.qkv.weight");
+        layer.attn_qkv_b = weight(block + "attn.qkv.bias");
+        layer.attn_out_w = weight_matrix(block + "attn.out.weight");
+        layer.attn_out_b = weight(block + "attn.out.bias");
+        layer.cross_ln_w = weight(block + "cross_attn_ln.weight");
+        layer.cross_ln_b = weight(block + "cross_attn_ln.bias");
+        layer.cross_q_w = weight_matrix(block + "cross_attn.query.weight");
+        layer.cross_q_b = weight(block + "cross_attn.query.bias");
+        // The key and value projections are fused into a [2 * n_state, n_state] matrix.
+        const at::Tensor cross_kv_w = weight_tensor(block + "cross_attn.kv.weight");
+        const at::Tensor cross_kv_b = weight_tensor(block + "cross_attn.kv.bias");
+        layer.cross_k_w = cross_kv_w.narrow(0, 0, m_n_state);
+        layer.cross_v_w = cross_kv_w.narrow(0, m_n_state, m_n_state);
+        layer.cross_v_b = cross_kv_b.narrow(0, m_n_state, m_n_state);
+        layer.cross_out_w = weight_matrix(block + "cross_attn.out.weight");
+        layer.cross_out_b = weight(block + "cross_attn.out.bias");
+        layer.mlp_ln_w = weight(block + "mlp_ln.weight");
+        layer.mlp_ln_b = weight(block + "mlp_ln.bias");
+        layer.mlp_fc1_w = weight_matrix(block + "mlp.0.weight");
+        layer.mlp_fc1_b = weight(block + "mlp.0.bias");
+        layer.mlp_fc2_w = weight_matrix(block + "mlp.2.weight");
+        layer.mlp_fc2_b = weight(block + "mlp.2.bias");
+        m_layers.push_back(layer);
+    }
+    m_cross_k.resize(m_n_layer);
+    m_cross_v.resize(m_n_layer);
+    CG_LOG_INFO("Native decoder loaded: n_layer=%d, n_state=%d, n_head=%d, weights=%s, kernels=%s",
+                m_n_layer, m_n_state, m_n_head, c10::toString(token_embedding.scalar_type()), kernels_isa());
+}
+
+at::Tensor NativeDecoder::weight_tensor(const std::string& name) const
+{
+    const auto it = m_weights.find(name);
+    if (it == m_weights.end())
+    {
+        CG_LOG_ERROR("Decoder weight not found: %s", name.c_str());
+        throw std::exception();
+    }
+    return it->second;
+}
+
+const float *NativeDecoder::weight(const std::string& name) const
+{
+    const at::Tensor tensor = weight_tensor(name);
+    if (tensor.scalar_type() != at::kFloat)
+    {
+        CG_LOG_ERROR("Decoder weight %s must be stored as float", name.c_str());
+        throw std::exception();
+    }
+    return tensor.data_ptr<float>();
+}
+
+WeightMatrix NativeDecoder::weight_matrix(const std::string& name) const
+{
+    const at::Tensor tensor = weight_tensor(name);
+    switch (tensor.scalar_type())
+    {
+        case at::kFloat:
+            return {tensor.data_ptr(), WeightType::F32};
+        case at::kHalf:
+            return {tensor.data_ptr(), WeightType::F16};
+        case at::kBFloat16:
+            return {tensor.data_ptr(), WeightType::BF16};
+        default:
+            CG_LOG_ERROR("Unsupported data type of decoder weight %s", name.c_str());
+            throw std::exception();
+    }
+}
+
+void NativeDecoder::reserve_cache_rows(int n_rows)
+{
+    if (n_rows <= m_n_cache_rows)
+        return;
+    const int64_t row_size = (int64_t)m_n_ctx * m_n_state;
+    std::vector<float> self_k((int64_t)m_n_layer * n_rows * row_size);
+    std::vector<float> self_v((int64_t)m_n_layer * n_rows * row_size);
+    for (int layer = 0; layer < m_n_layer; ++layer)
+        for (int row = 0; row < m_n_cache_rows; ++row)
+        {
+            const int64_t dst = ((int64_t)layer * n_rows + row) * row_size;
+            std::copy_n(self_k(layer, row), row_size, self_k.data() + dst);
+            std::copy_n(self_v(layer, row), row_size, self_v.data() + dst);
+        }
+    m_self_k = std::move(self_k);
+    m_self_v = std::move(self_v);
+    m_n_cache_rows = n_rows;
+    m_cached_tokens.resize(n_rows);
+}
+
+void NativeDecoder::match_cache_rows(const int64_t *tokens, int64_t tokens_stride, int n_seqs, int n_tokens,
+                                     std::vector<int>& prefix_lengths)
+{
+    auto common_prefix_length = [n_tokens](const std::vector<int64_t>& cached, const int64_t *seq) {
+        const int max_length = std::min((int)cached.size(), n_tokens);
+        int length = 0;
+        while (length < max_length && cached[length] == seq[length])
+            length += 1;
+        return length;
+    };
+
+    std::vector<int> source_rows(n_seqs);
+    prefix_lengths.assign(n_seqs, 0);
+    bool rows_moved = false;
+    for (int s = 0; s < n_seqs; ++s)
+    {
+        const int64_t *seq = tokens + s * tokens_stride;
+        // Prefer the row of the sequence itself so that nothing is copied on ties.
+        source_rows[s] = s;
+        prefix_lengths[s] = common_prefix_length(m_cached_tokens[s], seq);
+        for (int row = 0; row < m_n_cache_rows; ++row)
+        {
+            const int length = common_prefix_length(m_cached_tokens[row], seq);
+            if (length > prefix_lengths[s])
+            {
+                source_rows[s] = row;
+                prefix_lengths[s] = length;
+            }
+        }
+        rows_moved = rows_moved || source_rows[s] != s;
+    }
+    if (!rows_moved)
+        return;
+
+    // A row may be both the source of one sequence and the destination of another so all
+    // the sources are read before any row is written.
+    const int64_t row_size = (int64_t)m_n_ctx * m_n_state;
+    m_gather.resize(n_seqs * row_size);
+    for (int layer = 0; layer < m_n_layer; ++layer)
+        for (int kv = 0; kv < 2; ++kv)
+        {
+            for (int s = 0; s < n_seqs; ++s)
+                if (source_rows[s] != s)
+                {
+                    const float *src = kv == 0 ? self_k(layer, source_rows[s]) : self_v(layer, source_rows[s]);
+                    std::copy_n(src, (int64_t)prefix_lengths[s] * m_n_state, m_gather.data() + s * row_size);
+                }
+            for (int s = 0; s < n_seqs; ++s)
+                if (source_rows[s] != s)
+                {
+                    float *dst = kv == 0 ? self_k(layer, s) : self_v(layer, s);
+                    std::copy_n(m_gather.data() + s * row_size, (int64_t)prefix_lengths[s] * m_n_state, dst);
+                }
+        }
+    std::vector<std::vector<int64_t>> cached_tokens(n_seqs);
+    for (int s = 0; s < n_seqs; ++s)
+        cached_tokens[s].assign(m_cached_tokens[source_rows[s]].begin(), m_cached_tokens[source_rows[s]].begin() + prefix_lengths[s]);
+    for (int s = 0; s < n_seqs; ++s)
+        m_cached_tokens[s] = std::move(cached_tokens[s]);
+}
+
+void NativeDecoder::forward(const int64_t *tokens, int n_tokens, int start_pos, int cache_row, int n_last, float *logits)
+{
+    const int D = m_n_state;
+    const int n_new = n_tokens - start_pos;
+    const int n_audio_ctx = m_cross_k[0].size(0);
+    m_x.resize(n_new * D);
+    m_h.resize(n_new * D);
+    m_q.resize(n_new * D);
+    m_qkv.resize(n_new * 3 * D);
+    m_attn.resize(n_new * D);
+    m_mlp.resize(n_new * 4 * D);
+    m_scores.resize(m_n_head * std::max(m_n_ctx, n_audio_ctx));
+    float *x = m_x.data(), *h = m_h.data(), *q = m_q.data(), *qkv = m_qkv.data();
+    float *attn = m_attn.data(), *mlp = m_mlp.data();
+
+    for (int t = 0; t < n_new; ++t)
+    {
+        load_row(m_token_embedding, tokens[start_pos + t], D, x + t * D);
+        axpy(1.0f, m_positional_embedding + (int64_t)(start_pos + t) * D, x + t * D, D);
+    }
+
+    const float scale = 1.0f / std::sqrt((float)s_D_HEAD);
+    for (int l = 0; l < m_n_layer; ++l)
+    {
+        const LayerWeights &layer = m_layers[l];
+
+        // Self attention. The keys and values of the new positions are copied into the cache
+        // after the ones of the prefix.
+        float *k_cache = self_k(l, cache_row);
+        float *v_cache = self_v(l, cache_row);
+        layer_norm(x, n_new, D, layer.attn_ln_w, layer.attn_ln_b, h);
+        linear(h, n_new, D, layer.attn_qkv_w, layer.attn_qkv_b, 3 * D, qkv);
+        for (int t = 0; t < n_new; ++t)
+        {
+            const float *qkv_row = qkv + (int64_t)t * 3 * D;
+            std::copy_n(qkv_row + D, D, k_cache + (int64_t)(start_pos + t) * D);
+            std::copy_n(qkv_row + 2 * D, D, v_cache + (int64_t)(start_pos + t) * D);
+        }
+        for (int t = 0; t < n_new; ++t)
+            attention(qkv + (int64_t)t * 3 * D, k_cache, v_cache, start_pos + t + 1, D, m_n_head, s_D_HEAD, scale, m_scores.data(), attn + t * D);
+        linear(attn, n_new, D, layer.attn_out_w, layer.attn_out_b, D, h);
+        axpy(1.0f, h, x, n_new * D);
+
+        // Cross attention.
+        layer_norm(x, n_new, D, layer.cross_ln_w, layer.cross_ln_b, h);
+        linear(h, n_new, D, layer.cross_q_w, layer.cross_q_b, D, q);
+        const float *cross_k = m_cross_k[l].data_ptr<float>();
+        const float *cross_v = m_cross_v[l].data_ptr<float>();
+        for (int t = 0; t < n_new; ++t)
+            attention(q + t * D, cross_k, cross_v, n_audio_ctx, D, m_n_head, s_D_HEAD, scale, m_scores.data(), attn + t * D);
+        linear(attn, n_new, D, layer.cross_out_w, layer.cross_out_b, D, h);
+        axpy(1.0f, h, x, n_new * D);
+
+        // MLP.
+        layer_norm(x, n_new, D, layer.mlp_ln_w, layer.mlp_ln_b, h);
+        linear(h, n_new, D, layer.mlp_fc1_w, layer.mlp_fc1_b, 4 * D, mlp);
+        gelu(mlp, n_new * 4 * D);
+        linear(mlp, n_new, 4 * D, layer.mlp_fc2_w, layer.mlp_fc2_b, D, h);
+        axpy(1.0f, h, x, n_new * D);
+    }
+
+    // Only the logits of the last `n_last` positions are computed.
+    const float *x_last = x + (int64_t)(n_new - n_last) * D;
+    layer_norm(x_last, n_last, D, m_ln_w, m_ln_b, h);
+    linear(h, n_last, D, m_token_embedding, nullptr, m_n_vocab, logits);
+}
+
+at::Tensor NativeDecoder::logits(const at::Tensor& tokens,
+                                 const at::Tensor& audio_features,
+                                 int audio_id,
+                                 int64_t n_last)
+{
+    const int n_seqs = tokens.size(0);
+    const int n_tokens = tokens.size(1);
+    if (n_tokens > m_n_ctx)
+    {
+        CG_LOG_ERROR("Number of tokens %d exceeds the decoder context of %d", n_tokens, m_n_ctx);
+        throw std::exception();
+    }
+    if (audio_id != m_audio_id)
+    {
+        // The keys and values are the same for all the sequences so they are only computed
+        // from the first row of the audio features.
+        const at::Tensor features = audio_features.select(0, 0).to(at::kFloat);
+        for (int l = 0; l < m_n_layer; ++l)
+        {
+            m_cross_k[l] = at::linear(features, m_layers[l].cross_k_w.to(at::kFloat)).contiguous();
+            m_cross_v[l] = at::linear(features, m_layers[l].cross_v_w.to(at::kFloat), m_layers[l].cross_v_b).contiguous();
+        }
+        m_audio_id = audio_id;
+        // The cached self-attention keys and values depend on the audio.
+        for (auto &cached_tokens : m_cached_tokens)
+            cached_tokens.clear();
+    }
+
+    const int n_out = (n_last > 0) ? std::min((int)n_last, n_tokens) : n_tokens;
+    const int64_t *tokens_data = tokens.data_ptr<int64_t>();
+    const int64_t tokens_stride = tokens.stride(0);
+    reserve_cache_rows(n_seqs);
+    std::vector<int> prefix_lengths;
+    match_cache_rows(tokens_data, tokens_stride, n_seqs, n_tokens, prefix_lengths);
+
+    at::Tensor logits = at::empty({n_seqs, n_out, m_n_vocab}, at::TensorOptions(at::kFloat));
+    float *logits_data = logits.data_ptr<float>();
+    for (int s = 0; s < n_seqs; ++s)
+    {
+        const int64_t *seq = tokens_data + s * tokens_stride;
+        // Positions whose logits are requested are always computed.
+        const int start_pos = std::min(prefix_lengths[s], n_tokens - n_out);
+        forward(seq, n_tokens, start_pos, s, n_out, logits_data + (int64_t)s * n_out * m_n_vocab);
+        m_cached_tokens[s].assign(seq, seq + n_tokens);
+    }
+    return logits;
+}
+
+} // namespace capgen
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "backend.h"
+#include "kernels.h"
+
+#include <ATen/ATen.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace capgen {
+
+/// @brief A decoder implemented directly on top of the compute kernels in `kernels.h`. It
+///  avoids the dispatch and allocation overhead of running the scripted module, which is
+///  comparable to the math of a decoding step for the smaller models. It keeps the
+///  self-attention keys and values of the sequences it has decoded and matches every new
+///  sequence to the cached sequence that shares the longest prefix with it, so that a
+///  decoding step, even one that reorders beams, only computes the new positions.
+///  All the sequences of a call must attend to the same audio, i.e the rows of the audio
+///  features must be identical, which is the case for all the decoding methods.
+class NativeDecoder : public DecoderBackend {
+public:
+    /// @brief Maps the decoder weights file written by `cpp_model_gen.py` into memory.
+    NativeDecoder(const std::string& weights_path);
+    at::Tensor logits(const at::Tensor& tokens,
+                      const at::Tensor& audio_features,
+                      int audio_id,
+                      int64_t n_last) override;
+    const char *name() const override { return "native"; }
+
+private:
+    // Weight matrices may be stored in fp32, fp16 or bf16. Biases and layer norms are fp32.
+    struct LayerWeights {
+        const float *attn_ln_w, *attn_ln_b;
+        // Fused query, key and value projection, [3 * n_state, n_state].
+        WeightMatrix attn_qkv_w, attn_out_w;
+        const float *attn_qkv_b, *attn_out_b;
+        const float *cross_ln_w, *cross_ln_b;
+        WeightMatrix cross_q_w, cross_out_w;
+        const float *cross_q_b, *cross_out_b;
+        at::Tensor cross_k_w, cross_v_w, cross_v_b;
+        const float *mlp_ln_w, *mlp_ln_b;
+        WeightMatrix mlp_fc1_w, mlp_fc2_w;
+        const float *mlp_fc1_b, *mlp_fc2_b;
+    };
+
+    // Holds the weights, keyed by their name in the state dict of the decoder. The tensors
+    // point into the read-only mapping of the weights file.
+    std::unordered_map<std::string, at::Tensor> m_weights;
+    std::vector<LayerWeights> m_layers;
+    WeightMatrix m_token_embedding;
+    const float *m_positional_embedding;
+    const float *m_ln_w, *m_ln_b;
+    int m_n_vocab, m_n_ctx, m_n_state, m_n_head, m_n_layer;
+
+    // Cross-attention keys and values of the audio, a [n_audio_ctx, n_state] tensor per layer.
+    int m_audio_id = -1;
+    std::vector<at::Tensor> m_cross_k;
+    std::vector<at::Tensor> m_cross_v;
+
+    // Self-attention keys and values laid out as [n_layer][n_cache_rows][n_ctx][n_state] and
+    // the tokens whose keys and values are held by each cache row.
+    int m_n_cache_rows = 0;
+    std::vector<float> m_self_k;
+    std::vector<float> m_self_v;
+    std::vector<std::vector<int64_t>> m_cached_tokens;
+
+    // Scratch buffers reused across calls.
+    std::vector<float> m_x, m_h, m_q, m_qkv, m_attn, m_mlp, m_scores, m_gather;
+
+    const float *weight(const std::string& name) const;
+    WeightMatrix weight_matrix(const std::string& name) const;
+    at::Tensor weight_tensor(const std::string& name) const;
+    float *self_k(int layer, int row) { return m_self_k.data() + ((int64_t)layer * m_n_cache_rows + row) * m_n_ctx * m_n_state; }
+    float *self_v(int layer, int row) { return m_self_v.data() + ((int64_t)layer * m_n_cache_rows + row) * m_n_ctx * m_n_state; }
+    void reserve_cache_rows(int n_rows);
+    void match_cache_rows(const int64_t *tokens, int64_t tokens_stride, int n_seqs, int n_tokens, std::vector<int>& prefix_lengths);
+    void forward(const int64_t *tokens, int n_tokens, int start_pos, int cache_row, int n_last, float *logits);
+};
+
+} // namespace capgen
@@ -1,88 +1,75 @@
 #include "tokenizer.h"
 #include "log.h"
 
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <vector>
 
-namespace capgen {
 
-Tokenizer::Tokenizer(TokenizerType tokenizer_type)
-{
-    m_tokenizer_type = tokenizer_type;
-    if (m_tokenizer_type == TokenizerType::English)
-        init_english_tokenizer();
-    else
-        init_multilingual_tokenizer();
-    // Vocab init.
-    m_vocab = new char[m_vocab_bufsize];
-    load_vocabulary();
-}
+namespace capgen {
 
+// The words of a vocabulary packed into a single buffer. Each word is null-terminated and
+// `offsets[token]` is the position of the word of `token` in `words`. The words are read
+// from the vocabulary file, which holds a word per line in the order of their tokens.
+struct Vocabulary {
+    std::vector<char> words;
+    std::vector<uint32_t> offsets;
+};
 
-Tokenizer &capgen::Tokenizer::operator=(Tokenizer &&other) noexcept
+static Vocabulary load_vocabulary(const TokenizerSpec &spec)
 {
-    if (this != &other)
-    {
-        m_tokenizer_type = other.m_tokenizer_type;
-
-        m_sot = other.m_sot;
-        m_eot = other.m_eot;
-        m_transcribe = other.m_transcribe;
-        m_translate = other.m_translate;
-        m_no_speech = other.m_no_speech;
-        m_no_timestamps = other.m_no_timestamps;
-        m_timestamp_begin = other.m_timestamp_begin;
-        m_timestamp_end = other.m_timestamp_end;
-
-        m_vocab_filepath = other.m_vocab_filepath;
-        m_prompt_length = other.m_prompt_length;
-        m_vocab_size = other.m_vocab_size;
-        m_vocab_bufsize = other.m_vocab_bufsize;
-
-        delete[] m_vocab;
-        // Move the other vocab here.
-        m_vocab = other.m_vocab;
-        other.m_vocab = nullptr;
+    std::ifstream vocab_file(spec.vocab_filepath, std::ios::binary | std::ios::ate);
+    if (!vocab_file) {
+        CG_LOG_ERROR("Failed to open vocab file: %s", spec.vocab_filepath);
+        throw std::exception();
+    }
+    Vocabulary vocab;
+    const std::streamsize file_size = vocab_file.tellg();
+    // The extra byte terminates the last word.
+    vocab.words.resize(file_size + 1, '\0');
+    vocab_file.seekg(0);
+    if (!vocab_file.read(vocab.words.data(), file_size)) {
+        CG_LOG_ERROR("Failed to read vocab file: %s", spec.vocab_filepath);
+        throw std::exception();
     }
-    return *this;
-}
 
-Tokenizer::~Tokenizer()
-{
-  delete[] m_vocab;
+    vocab.offsets.reserve(spec.vocab_size);
+    vocab.offsets.push_back(0);
+    for (uint32_t i = 0; i < file_size; ++i)
+        if (vocab.words[i] == '\n')
+        {
+            vocab.words[i] = '\0';
+            if ((int)vocab.offsets.size() < spec.vocab_size)
+                vocab.offsets.push_back(i + 1);
+        }
+    // Words missing from the file decode to the empty string at the end of the buffer.
+    while ((int)vocab.offsets.size() < spec.vocab_size)
+        vocab.offsets.push_back(file_size);
+    return vocab;
 }
 
-void Tokenizer::init_english_tokenizer()
+// Returns the vocabulary of the tokenizer type, loading it on the first call. The
+// initialization of function-local statics is thread-safe.
+static const Vocabulary &get_vocabulary(TokenizerType tokenizer_type)
 {
-    m_sot = 50257;
-    m_eot = 50256;
-    m_transcribe = 50358;
-    m_translate = 50357;
-    m_no_speech = 50361;
-    m_no_timestamps = 50362;
-    m_timestamp_begin = 50363;
-    m_timestamp_end = 51863;
-
-    m_prompt_length = 1;
-    m_vocab_filepath = "./assets/english_vocab";
-    m_vocab_size = 50256;
-    m_vocab_bufsize = m_vocab_size * m_word_size;
+    if (tokenizer_type == TokenizerType::English)
+    {
+        static const Vocabulary english_vocab = load_vocabulary(ENGLISH_TOKENIZER_SPEC);
+        return english_vocab;
+    }
+    static const Vocabulary multilingual_vocab = load_vocabulary(MULTILINGUAL_TOKENIZER_SPEC);
+    return multilingual_vocab;
 }
 
-
-void Tokenizer::init_multilingual_tokenizer()
+Tokenizer::Tokenizer(TokenizerType tokenizer_type)
 {
-    m_sot = 50258;
-    m_eot = 50257;
-    m_transcribe = 50359;
-    m_translate = 50358;
-    m_no_speech = 50362;
-    m_no_timestamps = 50363;
-    m_timestamp_begin = 50364;
-    m_timestamp_end = 51864;
-
-    m_prompt_length = 3;
-    m_vocab_filepath = "./assets/multilingual_vocab";
-    m_vocab_size = 50364;
-    m_vocab_bufsize = m_vocab_size * m_word_size;
+    m_tokenizer_type = tokenizer_type;
+    if (m_tokenizer_type == TokenizerType::English)
+        m_spec = &ENGLISH_TOKENIZER_SPEC;
+    else
+        m_spec = &MULTILINGUAL_TOKENIZER_SPEC;
+    m_vocab = &get_vocabulary(m_tokenizer_type);
 }
 
 bool Tokenizer::is_multilingual() const
@@ -93,56 +80,34 @@ bool Tokenizer::is_multilingual() const
 const char* const Tokenizer::decode_token(int token) const
 {
     validate_token_range(token);
-    // `vocab_` is the pointer to the buffer start pos, `token_size_` is
-    // the offset and `token` is the index.
-    return m_vocab + (token * m_word_size);
+    // Timestamps and the other tokens after the vocabulary have no words.
+    if (token >= m_spec->vocab_size)
+        return "";
+    return m_vocab->words.data() + m_vocab->offsets[token];
 }
 
 float Tokenizer::decode_timestamp_token(int token) const
 {
-    if (token > m_timestamp_end || token < m_timestamp_begin)
+    if (token > m_spec->timestamp_end || token < m_spec->timestamp_begin)
     {
         CG_LOG_DEBUG("Token %d out of range", token);
         throw std::exception();
     }
-    return (token - m_timestamp_begin) * 0.02f;
+    return (token - m_spec->timestamp_begin) * 0.02f;
 }
 
 bool Tokenizer::is_timestamp(int token) const
 {
   validate_token_range(token);
-  return token >= m_timestamp_begin;
-}
-
-void Tokenizer::load_vocabulary()
-{
-    FILE* vocab_file = std::fopen(m_vocab_filepath.c_str(), "r");
-    if (!vocab_file) {
-        CG_LOG_ERROR("Failed to open vocab file: %s", m_vocab_filepath.c_str());
-        throw std::exception();
-    }
-
-    uint8_t char_hold;
-    for (int token_offset = 0; token_offset < m_vocab_bufsize; token_offset += m_word_size)
-    {
-        uint32_t char_idx = 0;
-        while((char_hold = std::fgetc(vocab_file)) != EOF && char_hold != '\n' && char_idx < m_word_size - 1)
-        {
-          m_vocab[token_offset + char_idx] = char_hold;
-          char_idx += 1;
-        }
-        m_vocab[token_offset + char_idx] = '\0';
-    }
-    fclose(vocab_file);
+  return token >= m_spec->timestamp_begin;
 }
 
 void Tokenizer::validate_token_range(int token) const
 {
-    if (token > m_timestamp_end) {
+    if (token < 0 || token > m_spec->timestamp_end) {
         CG_LOG_DEBUG("Token %d out of range", token);
         throw std::exception();
     }
 }
 
 } // namespace capgen.
-
@@ -13,82 +13,68 @@ namespace capgen {
 enum class TokenizerType { English, Multilingual };
 
 
+/// Special tokens and vocabulary of a tokenizer type. The tokens are declared as ints
+/// rather than uint because libtorch does not currently support uint types as inputs to
+/// models.
+struct TokenizerSpec {
+    int sot;
+    int eot;
+    int transcribe;
+    int translate;
+    int no_speech;
+    int no_timestamps;
+    int timestamp_begin;
+    int timestamp_end;
+    // Length of prompt/begin sequence.
+    int prompt_length;
+    // Number of words in the vocabulary file. Tokens after them, i.e the timestamps, have
+    // no words.
+    int vocab_size;
+    const char *vocab_filepath;
+};
+
+inline constexpr TokenizerSpec ENGLISH_TOKENIZER_SPEC = {
+    50257, 50256, 50358, 50357, 50361, 50362, 50363, 51863, 1, 50256, "./assets/english_vocab"
+};
+
+inline constexpr TokenizerSpec MULTILINGUAL_TOKENIZER_SPEC = {
+    50258, 50257, 50359, 50358, 50362, 50363, 50364, 51864, 3, 50364, "./assets/multilingual_vocab"
+};
+
+// The words of a vocabulary, defined in tokenizer.cpp.
+struct Vocabulary;
+
+
+/// Tokenizers are cheap to create and copy. The vocabulary of each tokenizer type is loaded
+/// the first time a tokenizer of the type is created and is shared, read-only, by all the
+/// tokenizers of the type for the lifetime of the process.
 class Tokenizer {
 public:
     static const int s_english_token = 50258;
 
     Tokenizer(TokenizerType tokenizer_type);
-    // Copy constructors and are explicitly deleted to prevent the compiler from generating copy
-    // constructors that copy the internal pointers. We also don't need them currently but that
-    // is subject to change.
-    Tokenizer(const Tokenizer&) = delete;
-    Tokenizer &operator=(const Tokenizer &other) = delete;
-    Tokenizer(const Tokenizer &&other) = delete;  // Also not needed.
-    Tokenizer &operator=(Tokenizer &&other) noexcept;
-    ~Tokenizer();
     
     const char* const decode_token(int token) const;
     float decode_timestamp_token(int token) const;
     bool is_timestamp(int token) const;
     bool is_multilingual() const;
 
-    int prompt_length() const { return m_prompt_length; }
-    int sot() const { return m_sot; }
-    int eot() const { return m_eot; }
-    int transcribe() const { return m_transcribe; }
-    int translate() const { return m_translate; }
-    int no_speech() const { return m_no_speech; }
-    int no_timestamps() const { return m_no_timestamps; }
-    int timestamp_begin() const { return m_timestamp_begin; }
-    int timestamp_end() const { return m_timestamp_end; }
+    int prompt_length() const { return m_spec->prompt_length; }
+    int sot() const { return m_spec->sot; }
+    int eot() const { return m_spec->eot; }
+    int transcribe() const { return m_spec->transcribe; }
+    int translate() const { return m_spec->translate; }
+    int no_speech() const { return m_spec->no_speech; }
+    int no_timestamps() const { return m_spec->no_timestamps; }
+    int timestamp_begin() const { return m_spec->timestamp_begin; }
+    int timestamp_end() const { return m_spec->timestamp_end; }
 
 private:
     TokenizerType m_tokenizer_type;
+    const TokenizerSpec *m_spec;
+    const Vocabulary *m_vocab;
 
-    // Special tokens required for transcription. They are declared as ints rather than
-    // uint because libtorch does not currently support uint types as inputs to models.
-    int m_sot;
-    int m_eot;
-    int m_transcribe;
-    int m_translate;
-    int m_no_speech;
-    int m_no_timestamps;
-    int m_timestamp_begin;
-    int m_timestamp_end;
-
-    // Path to the vocabulary file.
-    std::string m_vocab_filepath;
-
-    // Length of prompt/begin sequence.
-    uint32_t m_prompt_length;
-
-    // Memory size, in bytes, of allocated for each word.
-    const int m_word_size = 50;
-
-    // Total number of words in the vocabulary. 
-    int m_vocab_size;
-
-    // Size of the vocab buffer, in bytes.
-    int m_vocab_bufsize;
-
-    // The buffer (2MB size) which holds all the vocab words. Conceptually, it contains
-    // fixed-size slots for each word in the vocabulary. The slot size is large enough to 
-    // hold the longest word.
-    // When creating the vocabulary, we read each word from a file, add it to its slot in
-    // the buffer and then add a null-termination character so that for words smaller than
-    // the slots, we know where they end. The words are stored in the order of their
-    // corresponding token value so the first slot contains the word that when decoded,
-    // maps to token value 0. That allows for very fast decoding because we can index a
-    // word directly by adding an offset to to the buffer pointer. We could potentially
-    // use something like hash map to make it much simpler but we would have to allocate 
-    // memory for each slot independently which would lead to bad memory fragmentation.
-    // TODO: Can we embed the whole dictionary in the source.
-    char *m_vocab;
-
-    void init_english_tokenizer();
-    void init_multilingual_tokenizer();
-    void load_vocabulary();
     void validate_token_range(int token) const;
 };
 
-} // namespace capgen.
\ No newline at end of file
+} // namespace capgen.
@@ -1,5 +1,8 @@
 #include "audio.h"
+#include "cache.h"
+#include "checkpoint.h"
 #include "decoder.h"
+#include "exceptions.h"
 #include "log.h"
 #include "model.h"
 #include "tokenizer.h"
@@ -8,28 +11,112 @@
 
 #include <torch/script.h>
 
+#include <algorithm>
 #include <cstdlib>
 #include <filesystem>
 #include <functional>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 
+// Returns the path of the srt file of the media, e.g `movie.srt` for the extension `srt`, which
+// is next to the media unless an output directory is set.
+static std::filesystem::path srt_filepath(const std::filesystem::path& media_filepath,
+                                          const capgen::DecodingOptions& options,
+                                          const char *extension)
+{
+    std::filesystem::path outfilepath = options.output_dir.empty() ? media_filepath : options.output_dir / media_filepath.filename();
+    return outfilepath.replace_extension(extension);
+}
 
-static at::Tensor pad_or_trim(at::Tensor &spectrogram, int start_frame_pos)
+// Returns the key of the checkpoint and of the cached transcript of a transcription.
+static capgen::CheckpointKey checkpoint_key(uint64_t media_hash,
+                                            int64_t media_mtime,
+                                            const std::string& model_name,
+                                            capgen::ModelType model_type,
+                                            capgen::TranscriptionTask task,
+                                            capgen::TranscriptionDecoder decoder,
+                                            const std::string& segmentation_model_name,
+                                            const capgen::DecodingOptions& options)
 {
-    int end_frame_pos = start_frame_pos + 3000;
-    const int64_t total_frames = spectrogram.size(-1);
-    if (total_frames - start_frame_pos >= 3000)
-        return spectrogram.index_select(-1, at::arange(start_frame_pos, end_frame_pos));
-    else
+    return {media_hash, media_mtime, model_name, model_type, task, decoder, capgen::model_files_hash(model_name, model_type),
+            segmentation_model_name, options.start_time, options.end_time, options.tempo,
+            options.n_beam, options.logprob_threshold, options.compression_ratio_threshold,
+            options.repetition_max_ngram, options.repetition_min_repeats, options.repetition_min_tokens,
+            options.max_tokens_per_second, options.no_speech_threshold};
+}
+
+// Frames of audio kept before the start of a speech region found by the segmentation pass
+// so that the transcription model does not cut off the first word.
+static const uint32_t s_SPEECH_REGION_MARGIN_FRAMES = 50;
+// Share of the progress, in percent, that is given to the segmentation pass in cascade mode.
+// The segmentation model is much faster than the transcription model.
+static const float s_SEGMENTATION_PROGRESS_SHARE = 20.0f;
+
+// Transcribes the audio from `start_frame` greedily with the given model and returns the
+// [start, end) frame ranges of the windows that contain speech. A region starts at the first
+// timestamp that the model predicted in the window so that the transcription pass can seek
+// straight to it. `progress_callback` is called after every window with the fraction of the
+// audio from `start_frame` that was searched.
+static std::vector<std::pair<uint32_t, uint32_t>> find_speech_regions(std::shared_ptr<capgen::Whisper> model,
+                                                                      const at::Tensor& spectrogram,
+                                                                      const uint32_t language_id,
+                                                                      const capgen::Tokenizer& tokenizer,
+                                                                      const capgen::DecodingOptions& options,
+                                                                      const uint32_t start_frame,
+                                                                      const std::function<void(float)>& progress_callback)
+{
+    const uint32_t frames_per_segment = 3000;
+    const uint32_t total_frames = spectrogram.size(-1);
+    capgen::AudioFeaturesCache features_cache;
+    capgen::DecodingOptions segmentation_options = options;
+    segmentation_options.draft_model = nullptr;
+    model->clear_cache();
+
+    std::vector<std::pair<uint32_t, uint32_t>> speech_regions;
+    uint32_t window_idx = 0;
+    uint32_t seek = start_frame;
+    while (seek < total_frames)
     {
-        // Add the required number of frames.
-        const int needed_extra_frames = 3000 - (total_frames - start_frame_pos);
-        at::Tensor padded_spectrogram = at::pad(spectrogram, {0, needed_extra_frames, 0, 0});
-        return padded_spectrogram.index_select(-1, at::arange(start_frame_pos, end_frame_pos));;
+        if (options.is_cancelled && options.is_cancelled())
+        {
+            CG_LOG_INFO("Segmentation cancelled after %d windows", (int)window_idx);
+            throw capgen::TranscriptionCancelledException();
+        }
+        const at::Tensor audio_features = features_cache.get_audio_features(model, spectrogram, seek, frames_per_segment);
+        const float window_duration = std::min(total_frames - seek, frames_per_segment) / 100.0f;
+        capgen::DecodingResult result = capgen::decode_segment(audio_features, at::Tensor(), capgen::TranscriptionTask::Transcribe,
+                                                               language_id, window_idx, window_duration, model, tokenizer,
+                                                               capgen::TranscriptionDecoder::Greedy, segmentation_options);
+        const bool has_text = std::any_of(result.tokens.begin(), result.tokens.end(),
+                                          [&tokenizer](uint32_t token) { return !tokenizer.is_timestamp(token); });
+        const bool has_speech = has_text && !(result.no_speech_prob > options.no_speech_threshold
+                                              && result.avg_logprob() < options.logprob_threshold);
+        const capgen::SegmentTranscription window_trx(result.tokens, window_idx, tokenizer);
+        uint32_t window_end;
+        if (has_speech && !window_trx.sub_segments.empty())
+        {
+            window_end = std::min(seek + (uint32_t)(window_trx.m_end_time * 100), total_frames);
+            const uint32_t speech_start = seek + (uint32_t)(window_trx.sub_segments.front().m_start_time * 100);
+            const uint32_t region_start = std::max(seek, speech_start - std::min(speech_start, s_SPEECH_REGION_MARGIN_FRAMES));
+            // Regions of consecutive speech windows are merged.
+            if (!speech_regions.empty() && speech_regions.back().second >= region_start)
+                speech_regions.back().second = window_end;
+            else
+                speech_regions.push_back({region_start, window_end});
+        }
+        else
+            window_end = std::min(seek + frames_per_segment, total_frames);
+        seek = window_end;
+        window_idx += 1;
+        progress_callback((float)(seek - start_frame) / (float)(total_frames - start_frame));
     }
+    // The model may also be used as a draft model in the transcription pass, which reuses
+    // the window indices as cache indices for different windows.
+    model->clear_cache();
+    return speech_regions;
 }
 
 
@@ -38,21 +125,112 @@ void capgen::transcribe(std::filesystem::path media_filepath,
                         TranscriptionTask task,
                         TranscriptionDecoder decoder,
                         std::function<void()> trx_start_callback,
-                        std::function<void(float)> trx_update_callback)
+                        std::function<void(float)> trx_update_callback,
+                        std::function<void(const std::string&)> trx_segment_callback,
+                        const DecodingOptions &options)
 {
     CG_LOG_INFO("Transcription process started for file: %s", media_filepath.c_str());
+    if (options.start_time > 0.0f || options.end_time >= 0.0f)
+        CG_LOG_INFO("Transcribing from %.2fs to %.2fs", options.start_time, options.end_time);
+    if (options.tempo != 1.0f)
+        CG_LOG_INFO("Transcribing audio sped up by %.2fx", options.tempo);
 
-    // Load audio and tokenizer.
-    const capgen::AudioPreprocessor audio_preprocessor;
-    at::Tensor spectrogram = audio_preprocessor.get_audio_spectrogram(media_filepath.c_str());
+    // Identifies the media in the transcription checkpoint, which is opened before the audio
+    // is decoded. A media that cannot be read fails as it does when decoding.
+    uint64_t media_hash;
+    int64_t media_mtime;
+    try {
+        media_hash = capgen::hash_media_file(media_filepath.string());
+        media_mtime = capgen::file_modification_time(media_filepath.string());
+    }
+    catch (const std::exception &e) {
+        throw capgen::MediaDecodingException();
+    }
     capgen::Tokenizer tokenizer(capgen::TokenizerType::English);
+    if (whisper->is_multilingual())
+        tokenizer = capgen::Tokenizer(capgen::TokenizerType::Multilingual);
+    // Shares the encoder output of a window between language detection and decoding.
+    capgen::AudioFeaturesCache features_cache;
+    const uint32_t frames_per_segment = 3000;
+    // Segment indices are used as decoder cache indices so the cache from a previous
+    // transcription must not be reused.
+    whisper->clear_cache();
+    // The draft model, if any, proposes tokens from the same vocabulary as the transcription
+    // model so the two must be of the same type.
+    std::shared_ptr<capgen::Whisper> draft_model = options.draft_model;
+    if (draft_model && (draft_model.get() == whisper.get() || draft_model->model_type() != whisper->model_type()))
+    {
+        CG_LOG_WARNING("Draft model %s cannot be used with model %s, decoding without it", draft_model->name().c_str(), whisper->name().c_str());
+        draft_model = nullptr;
+    }
+    // Only greedy decoding is done speculatively.
+    if (decoder != capgen::TranscriptionDecoder::Greedy)
+        draft_model = nullptr;
+    if (draft_model)
+    {
+        draft_model->clear_cache();
+        CG_LOG_INFO("Using draft model: %s", draft_model->name().c_str());
+    }
+    capgen::DecodingOptions decoding_options = options;
+    decoding_options.draft_model = draft_model;
+
+    // In dual-task mode every segment is decoded twice against the same audio features,
+    // once for transcription and once for translation. The transcription drives the seek.
+    bool dual_task = (task == capgen::TranscriptionTask::TranscribeAndTranslate);
+    if (dual_task && !whisper->is_multilingual())
+    {
+        CG_LOG_MWARNING("English models cannot translate, only transcribing");
+        dual_task = false;
+    }
+    const capgen::TranscriptionTask segment_task = dual_task ? capgen::TranscriptionTask::Transcribe : task;
+
+    // In cascade mode, a first pass with the segmentation model finds the parts of the audio
+    // that contain speech and the transcription model skips the rest.
+    std::shared_ptr<capgen::Whisper> segmentation_model = options.segmentation_model;
+    if (segmentation_model && (segmentation_model.get() == whisper.get() || segmentation_model->model_type() != whisper->model_type()))
+    {
+        CG_LOG_WARNING("Segmentation model %s cannot be used with model %s, transcribing all the audio", segmentation_model->name().c_str(), whisper->name().c_str());
+        segmentation_model = nullptr;
+    }
+
+    // Resumes from the checkpoint of a previous run of this transcription that did not complete.
+    const capgen::CheckpointKey key = checkpoint_key(media_hash, media_mtime, whisper->name(), whisper->model_type(), task, decoder,
+                                                     segmentation_model ? segmentation_model->name() : "", options);
+    capgen::TranscriptionCheckpoint checkpoint(key, dual_task);
+
+    // A transcription that resumes only decodes the audio after the checkpoint, which starts
+    // at the frame `frame_offset` of the transcription, and reuses the recorded language.
+    // Spectrogram frames are indexed relative to the decoded audio.
+    const capgen::CheckpointAudio &recorded_audio = checkpoint.audio();
+    const uint32_t frame_offset = (recorded_audio.n_frames > 0) ? checkpoint.seek() : 0;
+    at::Tensor spectrogram;
+    const capgen::AudioPreprocessor audio_preprocessor;
+    if (frame_offset == 0)
+        spectrogram = audio_preprocessor.get_audio_spectrogram(media_filepath.c_str(), options.start_time, options.end_time, options.tempo);
+    else if (frame_offset < recorded_audio.n_frames)
+    {
+        const float resume_time = options.start_time + frame_offset / 100.0f * options.tempo;
+        CG_LOG_INFO("Resuming the transcription at %.2fs", resume_time);
+        spectrogram = audio_preprocessor.get_audio_spectrogram(media_filepath.c_str(), resume_time, options.end_time, options.tempo);
+    }
+    else
+        spectrogram = at::zeros({1, 80, 0});
+    // Decoding long media takes a while so a cancellation during it is honoured before the
+    // models run.
+    if (options.is_cancelled && options.is_cancelled())
+    {
+        CG_LOG_MINFO("Transcription cancelled after decoding the audio");
+        throw capgen::TranscriptionCancelledException();
+    }
 
     // Detect language spoken in the audio.
     int language_id;
-    if (whisper->is_multilingual())
+    if (frame_offset > 0)
+        language_id = recorded_audio.language_id;
+    else if (whisper->is_multilingual())
     {
-        tokenizer = std::move(capgen::Tokenizer(capgen::TokenizerType::Multilingual));
-        language_id = capgen::detect_language(spectrogram, whisper, tokenizer);
+        const at::Tensor audio_features = features_cache.get_audio_features(whisper, spectrogram, 0, frames_per_segment);
+        language_id = capgen::detect_language(audio_features, 0, whisper, tokenizer);
         const char *language_id_str = tokenizer.decode_token(language_id);
         CG_LOG_INFO("Detected language: code=%s,  id=%d", language_id_str, language_id);
     }
@@ -60,43 +238,194 @@ void capgen::transcribe(std::filesystem::path media_filepath,
         language_id = capgen::Tokenizer::s_english_token;
         CG_LOG_MINFO("Using English model");
     }
-    const uint32_t frames_per_segment = 3000;
-    int n_segments = capgen::exact_div(spectrogram.size(-1), frames_per_segment);
-    // Contains the transcription for every segment.
-    std::vector<capgen::SegmentTranscription> transcriptions;
-    transcriptions.reserve(n_segments);
+    checkpoint.record_audio({(uint32_t)language_id, (uint32_t)spectrogram.size(-1)});
+    // Number of frames of the transcription, including those before the checkpoint.
+    const float total_frames = frame_offset + spectrogram.size(-1);
+
+    trx_start_callback();
+    std::vector<std::pair<uint32_t, uint32_t>> speech_regions;
+    if (segmentation_model)
+    {
+        // The segmentation pass can take minutes on long media so it reports its own progress.
+        speech_regions = find_speech_regions(segmentation_model, spectrogram, language_id, tokenizer, decoding_options, 0,
+                                             [&trx_update_callback](float fraction) {
+                                                 trx_update_callback(fraction * s_SEGMENTATION_PROGRESS_SHARE);
+                                             });
+        for (auto &region : speech_regions)
+            region = {region.first + frame_offset, region.second + frame_offset};
+        CG_LOG_INFO("Segmentation model %s found %d speech regions", segmentation_model->name().c_str(), (int)speech_regions.size());
+    }
+    // Index of the first speech region that does not end before the seek.
+    size_t region_idx = 0;
+    uint32_t skipped_frames = 0;
+
+    // Segments are written to the srt files as soon as they are decoded, e.g `movie.srt`
+    // and, in dual-task mode, the translation alongside it in `movie.en.srt`.
+    const std::filesystem::path outfilepath = srt_filepath(media_filepath, options, "srt");
+    capgen::SrtWriter srt_writer(outfilepath.string(), tokenizer, options.start_time, options.tempo);
+    std::unique_ptr<capgen::SrtWriter> translation_srt_writer;
+    if (dual_task)
+    {
+        const std::filesystem::path translation_outfilepath = srt_filepath(media_filepath, options, "en.srt");
+        translation_srt_writer = std::make_unique<capgen::SrtWriter>(translation_outfilepath.string(), tokenizer, options.start_time, options.tempo);
+    }
+    // The srt files are rewritten with the restored segments before the rest are appended.
+    for (const auto &segment_trx : checkpoint.restored_transcriptions())
+        srt_writer.append(segment_trx);
+    for (const auto &translation_trx : checkpoint.restored_translations())
+        translation_srt_writer->append(translation_trx);
+
+    // Number of segments whose decoding was stopped early, per stop reason.
+    int n_repetition_stops = 0;
+    int n_token_budget_stops = 0;
+    auto decode_segment_trx = [&](const at::Tensor &audio_features,
+                                  const at::Tensor &draft_audio_features,
+                                  capgen::TranscriptionTask trx_task,
+                                  uint32_t segment_idx,
+                                  uint32_t segment_seek,
+                                  float segment_duration) {
+        capgen::DecodingResult result = capgen::decode_segment(audio_features, draft_audio_features, trx_task, language_id, segment_idx,
+                                                               segment_duration, whisper, tokenizer, decoder, decoding_options);
+        // Truncated segments are reported with their time in the media so that they can be
+        // checked in the srt file.
+        if (result.stop_reason != capgen::DecodingStopReason::Completed)
+        {
+            const float media_time = options.start_time + options.tempo * segment_seek / 100.0f;
+            const char *reason = (result.stop_reason == capgen::DecodingStopReason::Repetition) ? "repetition" : "token budget";
+            CG_LOG_WARNING("Segment %d at %.2fs stopped early (%s), its text is truncated", (int)segment_idx, media_time, reason);
+        }
+        if (result.stop_reason == capgen::DecodingStopReason::Repetition)
+            n_repetition_stops += 1;
+        else if (result.stop_reason == capgen::DecodingStopReason::TokenBudget)
+            n_token_budget_stops += 1;
+        capgen::SegmentTranscription segment_trx(result.tokens, segment_idx, tokenizer);
+        segment_trx.m_stop_reason = result.stop_reason;
+        return segment_trx;
+    };
 
-    const float total_frames = spectrogram.size(-1);
-    float frames_transcribed = 0;
-    uint32_t segment_idx = 0;
     // seek is the position of the frame of the segment we should transcribe next.
-    uint32_t seek = 0;
+    uint32_t seek = checkpoint.seek();
+    float frames_transcribed = seek;
+    uint32_t segment_idx = checkpoint.restored_transcriptions().size();
     const float max_percentage = 99.0f;
+    // The transcription pass reports the progress after that of the segmentation pass, if any.
+    const float min_percentage = segmentation_model ? s_SEGMENTATION_PROGRESS_SHARE : 0.0f;
     const capgen::TranscribingTimer timer;
 
-    trx_start_callback();
-    while (seek < spectrogram.size(-1))
+    while (seek < total_frames)
     {
-        at::Tensor segment_spec = pad_or_trim(spectrogram, seek);
+        if (options.is_cancelled && options.is_cancelled())
+        {
+            CG_LOG_INFO("Transcription cancelled after %d segments", (int)segment_idx);
+            throw capgen::TranscriptionCancelledException();
+        }
+        if (segmentation_model)
+        {
+            while (region_idx < speech_regions.size() && speech_regions[region_idx].second <= seek)
+                region_idx += 1;
+            // Skip to the start of the next speech region, or to the end of the audio if
+            // there is none, with an empty segment.
+            const uint32_t next_speech_frame = (region_idx < speech_regions.size()) ? speech_regions[region_idx].first : (uint32_t)total_frames;
+            if (next_speech_frame > seek)
+            {
+                const uint32_t n_skip_frames = next_speech_frame - seek;
+                const capgen::SegmentTranscription skipped_segment(segment_idx, n_skip_frames / 100.0f);
+                srt_writer.append(skipped_segment);
+                if (dual_task)
+                    translation_srt_writer->append(skipped_segment);
+                frames_transcribed += n_skip_frames;
+                skipped_frames += n_skip_frames;
+                seek += n_skip_frames;
+                checkpoint.append(skipped_segment, &skipped_segment, seek);
+                segment_idx += 1;
+                continue;
+            }
+        }
+
+        const at::Tensor audio_features = features_cache.get_audio_features(whisper, spectrogram, seek - frame_offset, frames_per_segment);
+        // Duration, in seconds, of the audio in the segment excluding the padding.
+        const float segment_duration = std::min(total_frames - seek, (float)frames_per_segment) / 100.0f;
+        at::Tensor draft_audio_features;
+        if (draft_model)
+            draft_audio_features = features_cache.get_audio_features(draft_model, spectrogram, seek - frame_offset, frames_per_segment);
 
-        if (decoder == capgen::TranscriptionDecoder::Greedy)
-            capgen::greedy_decode_segment(segment_spec, task, language_id, segment_idx, whisper, tokenizer, transcriptions);
+        const uint32_t segment_seek = seek;
+        const capgen::SegmentTranscription segment_trx = decode_segment_trx(audio_features, draft_audio_features, segment_task,
+                                                                            segment_idx, segment_seek, segment_duration);
+        const std::string segment_text = srt_writer.append(segment_trx);
+        frames_transcribed += segment_trx.m_end_time * 100;
+        seek += (int)(segment_trx.m_end_time * 100);
+        if (dual_task)
+        {
+            capgen::SegmentTranscription translation_trx = decode_segment_trx(audio_features, draft_audio_features, capgen::TranscriptionTask::Translate,
+                                                                              segment_idx, segment_seek, segment_duration);
+            translation_trx.clip(segment_trx.m_end_time);
+            translation_srt_writer->append(translation_trx);
+            checkpoint.append(segment_trx, &translation_trx, seek);
+        }
         else
-            capgen::beamsearch_decode_segment(segment_spec, task, language_id, segment_idx, whisper, tokenizer, transcriptions);
-        frames_transcribed += transcriptions[segment_idx].m_end_time * 100;
-        seek += (int)(transcriptions[segment_idx].m_end_time * 100);
+            checkpoint.append(segment_trx, nullptr, seek);
+        if (!segment_text.empty())
+            trx_segment_callback(segment_text);
         segment_idx += 1;
 
-        float prog_percentage = (frames_transcribed / total_frames) * max_percentage;
+        float prog_percentage = min_percentage + (frames_transcribed / total_frames) * (max_percentage - min_percentage);
         // We must not exceed max percentage.
         if (prog_percentage <= max_percentage)
             trx_update_callback(prog_percentage);
         CG_LOG_DEBUG("Transcription progress: (%d%)", (int)prog_percentage);
     }
 
-    std::filesystem::path outfilepath = media_filepath.replace_extension("srt");
-    capgen::save_to_srt(transcriptions, tokenizer, outfilepath.string());
+    // The checkpoint of the complete transcription is kept as its cached transcript.
+    capgen::TranscriptCache().put(checkpoint, key);
     trx_update_callback(100.0f);
+    if (segmentation_model)
+        CG_LOG_INFO("Skipped %.2fs of audio without speech", skipped_frames / 100.0f);
+    if (n_repetition_stops > 0 || n_token_budget_stops > 0)
+        CG_LOG_INFO("Decoding stopped early: repetition=%d, token budget=%d segments", n_repetition_stops, n_token_budget_stops);
     CG_LOG_MINFO("Transcription Complete");
     timer.stop(segment_idx);
-}
\ No newline at end of file
+}
+
+bool capgen::transcribe_from_cache(std::filesystem::path media_filepath,
+                                   const std::string &model_name,
+                                   ModelType model_type,
+                                   TranscriptionTask task,
+                                   TranscriptionDecoder decoder,
+                                   const std::string &segmentation_model_name,
+                                   const DecodingOptions &options,
+                                   const std::function<void(const std::string&)> &trx_segment_callback)
+{
+    // Failing to open the media is reported by the transcription.
+    if (!std::filesystem::exists(media_filepath))
+        return false;
+    const capgen::CheckpointKey key = checkpoint_key(capgen::hash_media_file(media_filepath.string()),
+                                                     capgen::file_modification_time(media_filepath.string()), model_name, model_type,
+                                                     task, decoder, segmentation_model_name, options);
+    // English models only transcribe, see `transcribe`.
+    const bool dual_task = (task == capgen::TranscriptionTask::TranscribeAndTranslate && model_type == capgen::ModelType::Multilingual);
+    std::vector<capgen::SegmentTranscription> transcriptions;
+    std::vector<capgen::SegmentTranscription> translations;
+    if (!capgen::TranscriptCache().get(key, dual_task, transcriptions, translations))
+        return false;
+
+    const capgen::TokenizerType tokenizer_type = (model_type == capgen::ModelType::English) ? capgen::TokenizerType::English
+                                                                                             : capgen::TokenizerType::Multilingual;
+    const capgen::Tokenizer tokenizer(tokenizer_type);
+    const std::filesystem::path outfilepath = srt_filepath(media_filepath, options, "srt");
+    // The segments are written as they are replayed, like those of a transcription.
+    capgen::SrtWriter srt_writer(outfilepath.string(), tokenizer, options.start_time, options.tempo);
+    for (const auto &segment_trx : transcriptions)
+    {
+        const std::string segment_text = srt_writer.append(segment_trx);
+        if (!segment_text.empty() && trx_segment_callback)
+            trx_segment_callback(segment_text);
+    }
+    if (dual_task)
+    {
+        const std::filesystem::path translation_outfilepath = srt_filepath(media_filepath, options, "en.srt");
+        capgen::save_to_srt(translations, tokenizer, translation_outfilepath.string(), options.start_time, options.tempo);
+    }
+    CG_LOG_INFO("Wrote cached transcript to %s", outfilepath.c_str());
+    return true;
+}
@@ -9,19 +9,108 @@
 
 namespace capgen {
 
-enum class TranscriptionTask { Transcribe, Translate };
+/// `TranscribeAndTranslate` produces both a source language transcription and an English
+/// translation, decoded from a single encoder pass per segment.
+enum class TranscriptionTask { Transcribe, Translate, TranscribeAndTranslate };
 
-enum TranscriptionDecoder { Greedy, BeamSearch };
+/// `Adaptive` decodes greedily and only falls back to beamsearch for the segments whose
+/// greedy decoding looks unreliable.
+enum TranscriptionDecoder { Greedy, BeamSearch, Adaptive };
+
+/// Tunable parameters of the segment decoders.
+struct DecodingOptions {
+    // Adaptive decoding re-decodes a segment with beamsearch if the average log probability
+    // of its greedy decoding is below `logprob_threshold` or if the compression ratio of
+    // the decoded text, which grows as the text becomes repetitive, is above
+    // `compression_ratio_threshold`.
+    float logprob_threshold = -1.0f;
+    float compression_ratio_threshold = 2.4f;
+
+    // Decoding of a segment stops early once its text ends with consecutive copies of an
+    // n-gram of at most `repetition_max_ngram` tokens. At least `repetition_min_repeats`
+    // copies spanning at least `repetition_min_tokens` tokens are required so that short
+    // legitimate repetitions such as "no, no, no" are not mistaken for loops.
+    uint32_t repetition_max_ngram = 16;
+    uint32_t repetition_min_repeats = 3;
+    uint32_t repetition_min_tokens = 12;
+
+    // Maximum number of tokens predicted per second of audio in a segment. Bounds the cost
+    // of segments that do not reach an end-of-transcript token.
+    float max_tokens_per_second = 6.0f;
+
+    // Number of beams kept by beamsearch, between 1 and 32. More beams search more candidate
+    // transcriptions at the cost of a larger decoder batch.
+    uint32_t n_beam = 4;
+
+    // If set, greedy decoding uses this smaller model to draft `n_draft_tokens` tokens at a
+    // time which the transcription model verifies in a single call. The output is the same
+    // as plain greedy decoding. Must be of the same model type as the transcription model.
+    std::shared_ptr<Whisper> draft_model;
+    uint32_t n_draft_tokens = 4;
+
+    // If set, the audio is first transcribed greedily with this faster model to find the
+    // parts of the audio that contain speech and the transcription model is then only run
+    // on those parts. A window is considered to have no speech if the probability of the
+    // no-speech token is above `no_speech_threshold` and the average log probability of its
+    // decoding is below `logprob_threshold`, or if no text was decoded from it.
+    std::shared_ptr<Whisper> segmentation_model;
+    float no_speech_threshold = 0.6f;
+
+    // Part of the media, in seconds, that is transcribed. Only this part of the audio is
+    // decoded and the times in the srt files are times in the whole media. A negative end
+    // time transcribes up to the end of the media.
+    float start_time = 0.0f;
+    float end_time = -1.0f;
+
+    // Factor, between 0.5 and 2.0, by which the audio is sped up with a pitch-preserving
+    // filter before it is transcribed. Faster audio has fewer windows to transcribe, e.g
+    // 1.25 transcribes 20% fewer windows, at some cost in accuracy. The times in the srt
+    // files are scaled back to times in the media.
+    float tempo = 1.0f;
+
+    // Directory in which the srt files are written. If empty, they are written next to the
+    // media file.
+    std::filesystem::path output_dir;
+
+    // If set, called from the transcribing thread once the audio is decoded, then before every
+    // window of the segmentation pass and every segment. Once it returns true the
+    // transcription stops and throws `TranscriptionCancelledException`. The segments
+    // transcribed so far are kept in the checkpoint so a later transcription resumes them.
+    std::function<bool()> is_cancelled;
+};
 
 /// @brief Transcribe the media file in the given path.
 /// @param path path to the media file.
 /// @param update_callback A function to call with a progress value in percentage rounded
 ///   off to the nearest int.
+/// @param segment_callback A function to call with the text of every segment, in order,
+///   once the segment is transcribed and written to the srt file.
+/// @param options Parameters of the decoder.
 void transcribe(std::filesystem::path media_filepath,
                 std::shared_ptr<Whisper> whisper,
                 TranscriptionTask task,
                 TranscriptionDecoder decoder,
                 std::function<void()> trx_start_callback,
-                std::function<void(float)> trx_update_callback);
+                std::function<void(float)> trx_update_callback,
+                std::function<void(const std::string&)> trx_segment_callback,
+                const DecodingOptions &options = DecodingOptions());
+
+/// @brief Writes the srt files of the media file from the cached transcript of a previous
+///  transcription of the same media, see `TranscriptCache`, without loading the model.
+/// @param segmentation_model_name Name of the segmentation model of the transcription,
+///  empty if it had none.
+/// @param options Only the options that change the transcript without being models, i.e
+///  the transcribed part of the media and the tempo, are used.
+/// @param trx_segment_callback If set, called with the text of every cached segment, as
+///  `transcribe` does with the segments it transcribes.
+/// @return Whether the transcript was cached.
+bool transcribe_from_cache(std::filesystem::path media_filepath,
+                           const std::string &model_name,
+                           ModelType model_type,
+                           TranscriptionTask task,
+                           TranscriptionDecoder decoder,
+                           const std::string &segmentation_model_name,
+                           const DecodingOptions &options = DecodingOptions(),
+                           const std::function<void(const std::string&)> &trx_segment_callback = nullptr);
 
 }; // namespace capgen
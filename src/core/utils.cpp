@@ -1,9 +1,18 @@
 #include "utils.h"
 #include "log.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <chrono>
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <vector>
 
 
 
@@ -15,6 +24,134 @@ const int exact_div(const long a, const long b)
     return result.quot;
 }
 
+uint64_t hash_bytes(const void *data, size_t size, uint64_t hash)
+{
+    const char *bytes = static_cast<const char *>(data);
+    // Hashed files are large so the hash mixes in a 64-bit word at a time.
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, sizeof(word));
+        hash ^= word;
+        hash *= 1099511628211ULL;
+    }
+    for (; i < size; ++i)
+    {
+        hash ^= (uint8_t)bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t hash_file(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        CG_LOG_ERROR("Failed to open file for hashing: %s", path.c_str());
+        throw std::exception();
+    }
+    uint64_t hash = HASH_SEED;
+    std::vector<char> buffer(1 << 20);
+    while (file)
+    {
+        file.read(buffer.data(), buffer.size());
+        hash = hash_bytes(buffer.data(), file.gcount(), hash);
+    }
+    return hash;
+}
+
+uint64_t hash_media_file(const std::string &path)
+{
+    const uint64_t n_chunks = 32;
+    const uint64_t chunk_size = 64 * 1024;
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        CG_LOG_ERROR("Failed to open file for hashing: %s", path.c_str());
+        throw std::exception();
+    }
+    const uint64_t file_size = file.tellg();
+    // Small files are hashed whole.
+    if (file_size <= n_chunks * chunk_size)
+        return hash_bytes(&file_size, sizeof(file_size), hash_file(path));
+
+    uint64_t hash = hash_bytes(&file_size, sizeof(file_size));
+    std::vector<char> buffer(chunk_size);
+    for (uint64_t i = 0; i < n_chunks; ++i)
+    {
+        // The first chunk is at the start of the file and the last chunk at its end.
+        file.seekg(i * (file_size - chunk_size) / (n_chunks - 1));
+        file.read(buffer.data(), chunk_size);
+        if (file.gcount() != (std::streamsize)chunk_size)
+        {
+            CG_LOG_ERROR("Failed to read file for hashing: %s", path.c_str());
+            throw std::exception();
+        }
+        hash = hash_bytes(buffer.data(), chunk_size, hash);
+    }
+    return hash;
+}
+
+int64_t file_modification_time(const std::string &path)
+{
+    struct stat file_stat;
+    if (stat(path.c_str(), &file_stat) != 0)
+    {
+        CG_LOG_ERROR("Failed to stat file: %s", path.c_str());
+        throw std::exception();
+    }
+    return (int64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
+}
+
+uint64_t hash_file_stamp(const std::string &path)
+{
+    struct stat file_stat;
+    char *absolute_path = realpath(path.c_str(), nullptr);
+    if (!absolute_path || stat(absolute_path, &file_stat) != 0)
+    {
+        std::free(absolute_path);
+        CG_LOG_ERROR("Failed to stat file for hashing: %s", path.c_str());
+        throw std::exception();
+    }
+    uint64_t hash = hash_bytes(absolute_path, std::strlen(absolute_path));
+    std::free(absolute_path);
+    const int64_t stamp[3] = {(int64_t)file_stat.st_size, (int64_t)file_stat.st_mtim.tv_sec, (int64_t)file_stat.st_mtim.tv_nsec};
+    return hash_bytes(stamp, sizeof(stamp), hash);
+}
+
+MappedFile::MappedFile(const std::string& path)
+{
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        CG_LOG_ERROR("Failed to open file: %s", path.c_str());
+        throw std::exception();
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+    {
+        close(fd);
+        CG_LOG_ERROR("Failed to read file: %s", path.c_str());
+        throw std::exception();
+    }
+    m_size = file_stat.st_size;
+    m_data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping remains valid after the file is closed.
+    close(fd);
+    if (m_data == MAP_FAILED)
+    {
+        CG_LOG_ERROR("Failed to map file: %s", path.c_str());
+        throw std::exception();
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    munmap(m_data, m_size);
+}
+
 TranscribingTimer::TranscribingTimer()
 {
     m_start_time = std::chrono::high_resolution_clock::now();
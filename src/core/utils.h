@@ -1,12 +1,56 @@
 #pragma once
 
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
 
 
 namespace capgen{
 
 const int exact_div(const long a, const long b);    
 
+// Initial value of the hashes below.
+const uint64_t HASH_SEED = 14695981039346656037ULL;
+
+// Mixes `size` bytes of data into a 64-bit FNV-1a style hash. Hashes of a sequence of
+// values are computed by passing the hash of the previous values as `hash`.
+uint64_t hash_bytes(const void *data, size_t size, uint64_t hash = HASH_SEED);
+
+// Computes a 64-bit FNV-1a style hash of the contents of the file. It identifies the
+// contents of a file, e.g for cache keys, and is not suitable for security.
+uint64_t hash_file(const std::string &path);
+
+// Computes a hash of the size of the file and of evenly spaced chunks of its contents. It
+// only reads a few megabytes of a file of any size, which makes it suitable for identifying
+// media files, whose edits almost always change their size or many parts of their contents.
+uint64_t hash_media_file(const std::string &path);
+
+// Returns the modification time of the file in nanoseconds since the epoch.
+int64_t file_modification_time(const std::string &path);
+
+// Computes a hash of the absolute path, the size and the modification time of the file
+// without reading it. It changes whenever the file is written or replaced, e.g when a model
+// is exported again, and is suitable for files that are too large to hash on every start.
+uint64_t hash_file_stamp(const std::string &path);
+
+// A read-only mapping of a whole file. Its pages are only read from the file when they are
+// accessed and are shared by all the processes that map the file.
+class MappedFile {
+public:
+    MappedFile(const std::string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char *data() const { return static_cast<const char *>(m_data); }
+    size_t size() const { return m_size; }
+
+private:
+    void *m_data;
+    size_t m_size;
+};
+
 class TranscribingTimer {
 public:
     TranscribingTimer();
@@ -0,0 +1,148 @@
+#include "weights.h"
+#include "log.h"
+#include "utils.h"
+
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <vector>
+
+
+// Weights files start with this magic followed by the format version. Version 3 holds the
+// fused attention projections, e.g `attn.qkv.weight`, rather than the separate ones.
+static const char s_WEIGHTS_MAGIC[4] = {'C', 'G', 'W', 'T'};
+static const uint32_t s_WEIGHTS_VERSION = 3;
+// Data type codes of the tensors in a weights file.
+static const uint32_t s_DTYPE_F32 = 0;
+static const uint32_t s_DTYPE_F16 = 1;
+static const uint32_t s_DTYPE_BF16 = 2;
+
+
+namespace {
+
+// Reads the values of the header and the index of a mapped weights file.
+class IndexReader {
+public:
+    IndexReader(const capgen::MappedFile& file, const std::string& path) : m_file(file), m_path(path) {}
+
+    template <typename T>
+    T read()
+    {
+        T value;
+        read_bytes(&value, sizeof(T));
+        return value;
+    }
+
+    void read_bytes(void *out, size_t n_bytes)
+    {
+        if (m_offset + n_bytes > m_file.size())
+        {
+            CG_LOG_ERROR("Truncated weights file: %s", m_path.c_str());
+            throw std::exception();
+        }
+        std::memcpy(out, m_file.data() + m_offset, n_bytes);
+        m_offset += n_bytes;
+    }
+
+private:
+    const capgen::MappedFile& m_file;
+    const std::string& m_path;
+    size_t m_offset = 0;
+};
+
+} // namespace
+
+
+namespace capgen {
+
+std::unordered_map<std::string, at::Tensor> load_weights(const std::string& path)
+{
+    const auto file = std::make_shared<MappedFile>(path);
+    IndexReader reader(*file, path);
+    char magic[4];
+    reader.read_bytes(magic, sizeof(magic));
+    const uint32_t version = reader.read<uint32_t>();
+    if (std::memcmp(magic, s_WEIGHTS_MAGIC, sizeof(magic)) != 0)
+    {
+        CG_LOG_ERROR("Invalid weights file: %s", path.c_str());
+        throw std::exception();
+    }
+    if (version != s_WEIGHTS_VERSION)
+    {
+        CG_LOG_ERROR("Weights file %s has version %u instead of %u, the model must be exported again",
+                     path.c_str(), version, s_WEIGHTS_VERSION);
+        throw std::exception();
+    }
+
+    std::unordered_map<std::string, at::Tensor> weights;
+    const uint32_t n_tensors = reader.read<uint32_t>();
+    for (uint32_t i = 0; i < n_tensors; ++i)
+    {
+        std::string name(reader.read<uint32_t>(), '\0');
+        reader.read_bytes(name.data(), name.size());
+        const uint32_t dtype_code = reader.read<uint32_t>();
+        std::vector<int64_t> shape(reader.read<uint32_t>());
+        for (auto &dim : shape)
+            dim = reader.read<int64_t>();
+        const uint64_t offset = reader.read<uint64_t>();
+
+        at::ScalarType dtype;
+        if (dtype_code == s_DTYPE_F32)
+            dtype = at::kFloat;
+        else if (dtype_code == s_DTYPE_F16)
+            dtype = at::kHalf;
+        else if (dtype_code == s_DTYPE_BF16)
+            dtype = at::kBFloat16;
+        else
+        {
+            CG_LOG_ERROR("Unsupported data type %d of tensor %s in %s", dtype_code, name.c_str(), path.c_str());
+            throw std::exception();
+        }
+        int64_t numel = 1;
+        for (const auto dim : shape)
+            numel *= dim;
+        if (offset + numel * c10::elementSize(dtype) > file->size())
+        {
+            CG_LOG_ERROR("Data of tensor %s is out of the bounds of %s", name.c_str(), path.c_str());
+            throw std::exception();
+        }
+        // The tensors are never written to so the read-only data is safe to share. Each tensor
+        // holds a reference to the mapping.
+        void *data = const_cast<char *>(file->data() + offset);
+        weights[name] = at::from_blob(data, shape, [file](void *) {}, at::TensorOptions(dtype));
+    }
+    return weights;
+}
+
+void assign_weights(torch::jit::script::Module& module,
+                    const std::unordered_map<std::string, at::Tensor>& weights)
+{
+    for (const auto &[name, tensor] : weights)
+    {
+        // Names are the dotted paths of the tensors in the module, e.g `blocks.0.mlp.0.weight`.
+        torch::jit::script::Module owner = module;
+        size_t start = 0;
+        size_t dot = name.find('.');
+        while (dot != std::string::npos)
+        {
+            const std::string submodule_name = name.substr(start, dot - start);
+            if (!owner.hasattr(submodule_name))
+            {
+                CG_LOG_ERROR("Module has no submodule %s for weight %s", submodule_name.c_str(), name.c_str());
+                throw std::exception();
+            }
+            owner = owner.attr(submodule_name).toModule();
+            start = dot + 1;
+            dot = name.find('.', start);
+        }
+        const std::string attr_name = name.substr(start);
+        if (!owner.hasattr(attr_name))
+        {
+            CG_LOG_ERROR("Module has no weight %s", name.c_str());
+            throw std::exception();
+        }
+        owner.setattr(attr_name, tensor);
+    }
+}
+
+} // namespace capgen
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <torch/script.h>
+
+#include <string>
+#include <unordered_map>
+
+
+namespace capgen {
+
+/// @brief Maps a weights file written by `cpp_model_gen.py` into memory and returns its
+///  tensors, keyed by their names in the state dict of the module they belong to. The
+///  tensors point into the read-only mapping, which is kept alive by the tensors, so the
+///  file is not read up front and its pages are shared by all the processes that map it.
+std::unordered_map<std::string, at::Tensor> load_weights(const std::string& path);
+
+/// @brief Sets the parameters and buffers of a scripted module whose weights were stripped
+///  at export to the tensors of its weights file.
+void assign_weights(torch::jit::script::Module& module,
+                    const std::unordered_map<std::string, at::Tensor>& weights);
+
+} // namespace capgen
@@ -8,6 +8,8 @@
 #include <wx/webrequest.h>
 #include <wx/wfstream.h>
 
+#include <fstream>
+
 // A c++ file containing raw png data for icons. It is meant to be included like this
 // and is therefore not compiled separately.
 #include "icons"
@@ -16,6 +18,12 @@
 // Registers our application's entry point.
 wxIMPLEMENT_APP(capgen::Application);
 
+// Time after the last change of the options after which the selected model is preloaded.
+static const int s_PRELOAD_DELAY_MS = 750;
+
+// Stores the model, the task and the decoder backend selected when the application was last used.
+static const char *s_LAST_USED_OPTIONS_PATH = "./assets/last_used_options";
+
 
 // Called upon startup.
 bool capgen::Application::OnInit()
@@ -26,6 +34,8 @@ bool capgen::Application::OnInit()
     capgen::MainWindow *main_window = new capgen::MainWindow();
     main_window->Show();
     CG_LOG_MINFO("Application has started");
+    // The model is loaded while the user picks the files to transcribe.
+    main_window->preload_selected_model();
 
     return true;
 }
@@ -33,7 +43,7 @@ bool capgen::Application::OnInit()
 
 capgen::MainWindow::MainWindow()
   : wxFrame(NULL, wxID_ANY, "Capgen", wxDefaultPosition, wxSize(600, 800)),
-    m_app(wxGetApp()), m_content_sizer(new wxBoxSizer(wxVERTICAL))
+    m_app(wxGetApp()), m_content_sizer(new wxBoxSizer(wxVERTICAL)), m_preload_timer(this, ID_preload_timer)
 {
     SetIcon(wxICON(s_CAPGEN_LOGO));
     SetMinSize(GetSize());
@@ -54,7 +64,7 @@ capgen::MainWindow::MainWindow()
     wxPanel *options_toolbar = create_options_toolbar(main_panel);
 
     // Transcription widgets container.
-    m_content_window = new wxScrolledWindow(main_panel, wxID_ANY, wxDefaultPosition, wxSize(600, 635));
+    m_content_window = new wxScrolledWindow(main_panel, wxID_ANY, wxDefaultPosition, wxSize(600, 610));
     m_content_window->SetBackgroundColour(main_panel->GetBackgroundColour());
     m_content_window->AlwaysShowScrollbars();
     m_content_window->SetSizer(m_content_sizer);
@@ -69,6 +79,107 @@ capgen::MainWindow::MainWindow()
     Bind(wxEVT_BUTTON, &MainWindow::on_audio_add, this, ID_audio_add);
     Bind(wxEVT_BUTTON, &MainWindow::on_video_add, this, ID_video_add);
     Bind(wxEVT_CHOICE, &MainWindow::on_model_choice_update, this, ID_model_selector);
+    Bind(wxEVT_CHOICE, &MainWindow::on_task_choice_update, this, ID_task_selector);
+    Bind(wxEVT_CHECKBOX, &MainWindow::on_backend_checkbox_update, this, ID_backend_checkbox);
+    Bind(EVT_MODEL_PRELOAD_COMPLETED, &MainWindow::on_model_preload_completion, this, wxID_ANY);
+    Bind(EVT_MODEL_PRELOAD_FAILED, &MainWindow::on_model_preload_fail, this, wxID_ANY);
+    Bind(wxEVT_TIMER, &MainWindow::on_preload_timer, this, ID_preload_timer);
+}
+
+void capgen::MainWindow::schedule_model_preload()
+{
+    // The status of the previous selection no longer applies. Restarts the delay if it is
+    // already running.
+    m_model_status_text->SetLabelText("");
+    m_preload_timer.StartOnce(s_PRELOAD_DELAY_MS);
+}
+
+void capgen::MainWindow::on_preload_timer(wxTimerEvent &evt)
+{
+    preload_selected_model();
+}
+
+void capgen::MainWindow::preload_selected_model()
+{
+    const std::string model_name = get_selected_model();
+    if (model_name == "" || !m_app.models_manager.model_is_registered(model_name))
+        return;
+    const capgen::ModelType model_type = get_selected_model_type();
+    const capgen::DecoderBackendType backend_type = m_app.models_manager.get_decoder_backend();
+    // A running transcription keeps its model until it completes.
+    if (!m_preloaded_model_name.empty()
+        && (m_preloaded_model_name != model_name || m_preloaded_model_type != model_type || m_preloaded_backend_type != backend_type))
+        m_app.models_manager.unload_model(m_preloaded_model_name, m_preloaded_model_type, m_preloaded_backend_type);
+    m_preloaded_model_name = model_name;
+    m_preloaded_model_type = model_type;
+    m_preloaded_backend_type = backend_type;
+    if (m_app.models_manager.model_is_loaded(model_name, model_type))
+    {
+        m_model_status_text->SetLabelText("Model ready");
+        return;
+    }
+    ModelPreloadThread *preload_thread = new ModelPreloadThread(this, model_name, model_type);
+    if (preload_thread->Run() != wxTHREAD_NO_ERROR)
+    {
+        // The model is then loaded when a transcription needs it.
+        CG_LOG_ERROR("Model preload thread failed to run for model: %s", model_name.c_str());
+        delete preload_thread;
+        return;
+    }
+    m_model_status_text->SetLabelText("Loading model...");
+}
+
+void capgen::MainWindow::on_model_preload_completion(wxThreadEvent &evt)
+{
+    // Only the status of the selected model is shown.
+    if (evt.GetString().ToStdString() == get_selected_model())
+        m_model_status_text->SetLabelText("Model ready");
+}
+
+void capgen::MainWindow::on_model_preload_fail(wxThreadEvent &evt)
+{
+    if (evt.GetString().ToStdString() == get_selected_model())
+        m_model_status_text->SetLabelText("Model failed to load");
+}
+
+void capgen::MainWindow::on_task_choice_update(wxCommandEvent &evt)
+{
+    // The task decides whether the English or the multilingual model is used.
+    save_last_used_options();
+    schedule_model_preload();
+}
+
+void capgen::MainWindow::on_backend_checkbox_update(wxCommandEvent &evt)
+{
+    // The models are loaded again with the selected backend.
+    m_app.models_manager.set_decoder_backend(m_native_backend_checkbox->IsChecked() ? capgen::DecoderBackendType::Native
+                                                                                    : capgen::DecoderBackendType::TorchScript);
+    save_last_used_options();
+    schedule_model_preload();
+}
+
+void capgen::MainWindow::restore_last_used_options()
+{
+    std::ifstream options_file(s_LAST_USED_OPTIONS_PATH);
+    std::string model_name, task, backend;
+    if (!std::getline(options_file, model_name) || !std::getline(options_file, task))
+        return;
+    if (m_app.models_manager.model_is_registered(model_name))
+        m_model_choices->SetStringSelection(model_name);
+    m_task_choices->SetStringSelection(task);
+    // Files saved by older versions do not have the backend.
+    if (std::getline(options_file, backend) && backend == "native")
+    {
+        m_native_backend_checkbox->SetValue(true);
+        m_app.models_manager.set_decoder_backend(capgen::DecoderBackendType::Native);
+    }
+}
+
+void capgen::MainWindow::save_last_used_options() const
+{
+    std::ofstream options_file(s_LAST_USED_OPTIONS_PATH);
+    options_file << get_selected_model() << "\n" << get_selected_task() << "\n"
+                 << (m_native_backend_checkbox->IsChecked() ? "native" : "torchscript") << "\n";
 }
 
 void capgen::MainWindow::add_trx_widget(std::filesystem::path media_filepath)
@@ -158,16 +269,17 @@ wxPanel *capgen::MainWindow::create_toolbar(wxPanel *parent_window)
 
 wxPanel *capgen::MainWindow::create_options_toolbar(wxPanel *parent_window)
 {
-    wxPanel *options_panel = new wxPanel(parent_window, wxID_ANY, wxDefaultPosition, wxSize(600, 75));
+    wxPanel *options_panel = new wxPanel(parent_window, wxID_ANY, wxDefaultPosition, wxSize(600, 100));
     options_panel->SetBackgroundColour(wxColour(45, 45, 45));
     wxBoxSizer *options_panel_sizer = new wxBoxSizer(wxHORIZONTAL);
     options_panel->SetSizer(options_panel_sizer);
 
     // Task selector
-    m_task_choices = new wxChoice(options_panel, wxID_ANY, wxDefaultPosition, wxSize(180, 28));
+    m_task_choices = new wxChoice(options_panel, ID_task_selector, wxDefaultPosition, wxSize(180, 28));
     m_task_choices->Append("English");
     m_task_choices->Append("Detected language");
     m_task_choices->Append("Translate to English");
+    m_task_choices->Append("Detected language + English");
     m_task_choices->Select(0);
     wxBoxSizer *task_sizer = new wxBoxSizer(wxVERTICAL);
     wxStaticText *captions_text = new wxStaticText(options_panel, wxID_ANY, "TRANSCRIPTION LANGUAGE");
@@ -181,6 +293,9 @@ wxPanel *capgen::MainWindow::create_options_toolbar(wxPanel *parent_window)
     m_model_choices->AppendString("tiny");
     m_model_choices->AppendString("base");
     m_model_choices->AppendString("small");
+    // Locally exported variants of the models such as `small-int8`.
+    for (const auto &variant : m_app.models_manager.get_model_variants())
+        m_model_choices->AppendString(variant);
     // TODO: Allow models to be sorted and use enums to refer to models instead of strings.
     std::string default_model_name = m_app.models_manager.get_default_model_name();
     if (default_model_name == "tiny")
@@ -195,10 +310,15 @@ wxPanel *capgen::MainWindow::create_options_toolbar(wxPanel *parent_window)
     model_sizer->Add(model_text, wxSizerFlags().Align(wxALIGN_CENTER_HORIZONTAL));
     model_sizer->AddSpacer(6);
     model_sizer->Add(m_model_choices);
+    m_model_status_text = new wxStaticText(options_panel, wxID_ANY, "");
+    m_model_status_text->SetForegroundColour(wxColor(50, 235, 25));
+    model_sizer->AddSpacer(6);
+    model_sizer->Add(m_model_status_text, wxSizerFlags().Align(wxALIGN_CENTER_HORIZONTAL));
 
     // Decoding method selector
     m_decoding_choices = new wxChoice(options_panel, wxID_ANY, wxDefaultPosition, wxSize(180, 28));
     m_decoding_choices->Append("Best quality");
+    m_decoding_choices->Append("Balanced");
     m_decoding_choices->Append("Fastest transcription");
     m_decoding_choices->Select(0);
     wxBoxSizer *decoding_sizer = new wxBoxSizer(wxVERTICAL);
@@ -207,11 +327,22 @@ wxPanel *capgen::MainWindow::create_options_toolbar(wxPanel *parent_window)
     decoding_sizer->Add(decoding_text, wxSizerFlags().Align(wxALIGN_CENTER_HORIZONTAL));
     decoding_sizer->AddSpacer(6);
     decoding_sizer->Add(m_decoding_choices);
+    m_skip_silence_checkbox = new wxCheckBox(options_panel, wxID_ANY, "Skip silence");
+    m_skip_silence_checkbox->SetForegroundColour(wxColor(255, 255, 255));
+    m_skip_silence_checkbox->SetToolTip("Find the parts with speech using the tiny model and transcribe only those.");
+    decoding_sizer->AddSpacer(6);
+    decoding_sizer->Add(m_skip_silence_checkbox);
+    m_native_backend_checkbox = new wxCheckBox(options_panel, ID_backend_checkbox, "Fast decoder");
+    m_native_backend_checkbox->SetForegroundColour(wxColor(255, 255, 255));
+    m_native_backend_checkbox->SetToolTip("Decode with the native decoder instead of the TorchScript one.");
+    decoding_sizer->AddSpacer(6);
+    decoding_sizer->Add(m_native_backend_checkbox);
 
     options_panel_sizer->Add(task_sizer, 0, wxGROW | wxLEFT | wxTOP, 10);
     options_panel_sizer->Add(model_sizer, 0, wxGROW | wxLEFT | wxTOP, 10);
     options_panel_sizer->Add(decoding_sizer, 0, wxGROW | wxLEFT | wxTOP, 10);
 
+    restore_last_used_options();
     return options_panel;
 }
 
@@ -279,6 +410,8 @@ void capgen::MainWindow::on_model_choice_update(wxCommandEvent &event)
                 m_model_choices->Select(64); // Force selection of none.
         }
     }
+    save_last_used_options();
+    schedule_model_preload();
 }
 
 void capgen::MainWindow::on_toolbar_btn_hover(wxMouseEvent &evt)
@@ -358,6 +491,10 @@ capgen::TranscriptionWidget::TranscriptionWidget(MainWindow *main_window,
     // Transcription progress bar.
     m_progbar = new wxGauge(this, wxID_ANY, 100, wxDefaultPosition, wxSize(500, 8), wxGA_SMOOTH | wxGA_HORIZONTAL);
 
+    m_preview_text = new wxStaticText(this, wxID_ANY, "", wxDefaultPosition, wxSize(500, -1), wxST_ELLIPSIZE_START);
+    m_preview_text->SetFont(default_font);
+    m_preview_text->SetForegroundColour(wxColour(200, 200, 200));
+
     // Widget sizer.
     wxBoxSizer *main_sizer = new wxBoxSizer(wxVERTICAL);
     const int border_size = 30;
@@ -367,6 +504,8 @@ capgen::TranscriptionWidget::TranscriptionWidget(MainWindow *main_window,
     main_sizer->Add(status_sizer, 0, wxGROW | wxLEFT, border_size);
     main_sizer->AddSpacer(10);
     main_sizer->Add(m_progbar, 0, wxLEFT, border_size);
+    main_sizer->AddSpacer(10);
+    main_sizer->Add(m_preview_text, 0, wxLEFT, border_size);
     main_sizer->Add(m_out_fpath_text, 0, wxGROW | wxLEFT, border_size);
     main_sizer->AddSpacer(25);
     this->SetSizerAndFit(main_sizer);
@@ -375,6 +514,7 @@ capgen::TranscriptionWidget::TranscriptionWidget(MainWindow *main_window,
     Bind(EVT_TRX_THREAD_LAUNCH, &TranscriptionWidget::on_trx_thread_launch, this, wxID_ANY);
     Bind(EVT_TRX_THREAD_START, &TranscriptionWidget::on_trx_thread_start, this, wxID_ANY);
     Bind(EVT_TRX_THREAD_UPDATE, &TranscriptionWidget::on_trx_thread_update, this, wxID_ANY);
+    Bind(EVT_TRX_THREAD_SEGMENT, &TranscriptionWidget::on_trx_thread_segment, this, wxID_ANY);
     Bind(EVT_TRX_THREAD_COMPLETED, &TranscriptionWidget::on_trx_thread_completion, this,wxID_ANY);
     Bind(EVT_TRX_THREAD_FAILED, &TranscriptionWidget::on_trx_thread_fail, this, wxID_ANY);
     Bind(EVT_TRX_THREAD_MEDIA_DECODING_FAILED, &TranscriptionWidget::on_trx_thread_media_decode_fail, this, wxID_ANY);
@@ -387,6 +527,7 @@ void capgen::TranscriptionWidget::on_trx_thread_completion(wxThreadEvent &event)
     m_progbar_text->SetLabelText("");
     m_progbar->Hide();
     m_status_text->Hide();
+    m_preview_text->Hide();
 
     std::string out_fpath = m_media_filepath.replace_extension("srt").filename().string();
     if (out_fpath.length() > 32)
@@ -444,6 +585,13 @@ void capgen::TranscriptionWidget::on_trx_thread_update(TranscriptionUpdateEvent
     m_progbar_text->SetLabelText(label);
 }
 
+void capgen::TranscriptionWidget::on_trx_thread_segment(wxThreadEvent &event)
+{
+    // Segments start with the space that separates them from the previous segment.
+    wxString text = event.GetString();
+    m_preview_text->SetLabelText(text.Trim(false));
+}
+
 void capgen::TranscriptionWidget::on_timer_update(wxTimerEvent &event) 
 {
     m_progbar->Pulse();
@@ -464,6 +612,8 @@ bool capgen::TranscriptionWidget::launch_transcription_task()
         model_type = capgen::ModelType::Multilingual;
         if (selected_task == "Detected language")
             trx_task = capgen::TranscriptionTask::Transcribe;
+        else if (selected_task == "Detected language + English")
+            trx_task = capgen::TranscriptionTask::TranscribeAndTranslate;
         else
             trx_task = capgen::TranscriptionTask::Translate;
     }
@@ -474,7 +624,8 @@ bool capgen::TranscriptionWidget::launch_transcription_task()
         return false;
     }
 
-    TranscriptionThread *trx_thread = new TranscriptionThread(this, m_media_filepath, selected_model, model_type, trx_task, decoder);
+    const bool skip_silence = m_main_window->get_skip_silence();
+    TranscriptionThread *trx_thread = new TranscriptionThread(this, m_media_filepath, selected_model, model_type, trx_task, decoder, skip_silence);
     if (trx_thread->Run() != wxTHREAD_NO_ERROR)
     {
         CG_LOG_ERROR("Transcription thread failed to run for media file: %s", m_media_filepath.c_str());
@@ -491,11 +642,37 @@ capgen::TranscriptionThread::TranscriptionThread(TranscriptionWidget *widget,
                                                  std::string &model_name,
                                                  capgen::ModelType model_type,
                                                  TranscriptionTask task,
-                                                 TranscriptionDecoder decoder)
+                                                 TranscriptionDecoder decoder,
+                                                 bool skip_silence)
   : wxThread(wxTHREAD_DETACHED), m_media_filepath(media_filepath), m_model_name(model_name),
-    m_model_type(model_type), m_widget(widget), m_trx_task(task), m_decoder(decoder)
+    m_model_type(model_type), m_widget(widget), m_trx_task(task), m_decoder(decoder),
+    m_skip_silence(skip_silence)
+  {}
+
+capgen::ModelPreloadThread::ModelPreloadThread(MainWindow *main_window,
+                                               const std::string &model_name,
+                                               capgen::ModelType model_type)
+  : wxThread(wxTHREAD_DETACHED), m_main_window(main_window), m_model_name(model_name), m_model_type(model_type)
   {}
 
+void *capgen::ModelPreloadThread::Entry()
+{
+    wxThreadEvent *event;
+    try
+    {
+        wxGetApp().models_manager.get_model(m_model_name, m_model_type);
+        event = new wxThreadEvent(EVT_MODEL_PRELOAD_COMPLETED);
+    }
+    catch (const std::exception &e)
+    {
+        CG_LOG_ERROR("Failed to preload model: %s", m_model_name.c_str());
+        event = new wxThreadEvent(EVT_MODEL_PRELOAD_FAILED);
+    }
+    event->SetString(m_model_name);
+    wxQueueEvent(m_main_window, event);
+    return (void *)0;
+}
+
 capgen::TranscriptionThread::~TranscriptionThread() 
 {
     CG_LOG_MINFO("Deleted Transcription thread");
@@ -516,14 +693,43 @@ void *capgen::TranscriptionThread::Entry()
         wxQueueEvent(m_widget, new TranscriptionUpdateEvent(EVT_TRX_THREAD_UPDATE, wxID_ANY, progress));
     };    
 
+    std::function<void(const std::string&)> trx_segment_callback = [this](const std::string &text) {
+        wxThreadEvent *event = new wxThreadEvent(EVT_TRX_THREAD_SEGMENT);
+        event->SetString(wxString::FromUTF8(text));
+        wxQueueEvent(m_widget, event);
+    };
+
     if (!TestDestroy())
     {
         wxQueueEvent(m_widget, new wxThreadEvent(EVT_TRX_THREAD_LAUNCH));
         try
         {
             Application& app = wxGetApp();
+            std::string draft_model_name = "tiny";
+            // Silence is found with the tiny model, which is only worth it for larger models.
+            const bool use_segmentation_model = m_skip_silence
+                                                && m_model_name != draft_model_name
+                                                && app.models_manager.model_is_registered(draft_model_name);
+            // Media that was transcribed before in the same way is not transcribed again.
+            if (capgen::transcribe_from_cache(m_media_filepath, m_model_name, m_model_type, m_trx_task, m_decoder,
+                                              use_segmentation_model ? draft_model_name : ""))
+            {
+                trx_start_callback();
+                trx_update_callback(100.0f);
+                wxQueueEvent(m_widget, new wxThreadEvent(EVT_TRX_THREAD_COMPLETED));
+                return (void *)0;
+            }
             auto model = app.models_manager.get_model(m_model_name, m_model_type);
-            capgen::transcribe(m_media_filepath, model, m_trx_task, m_decoder, trx_start_callback, trx_update_callback);
+            capgen::DecodingOptions options;
+            // Greedy decoding with a larger model is sped up by drafting tokens with the
+            // tiny model if it is installed.
+            if (m_decoder == capgen::TranscriptionDecoder::Greedy
+                && m_model_name != draft_model_name
+                && app.models_manager.model_is_registered(draft_model_name))
+                options.draft_model = app.models_manager.get_model(draft_model_name, m_model_type);
+            if (use_segmentation_model)
+                options.segmentation_model = app.models_manager.get_model(draft_model_name, m_model_type);
+            capgen::transcribe(m_media_filepath, model, m_trx_task, m_decoder, trx_start_callback, trx_update_callback, trx_segment_callback, options);
             wxQueueEvent(m_widget, new wxThreadEvent(EVT_TRX_THREAD_COMPLETED));
         }
         catch (MediaDecodingException e)
@@ -35,6 +35,9 @@ enum
     ID_about_btn,
     ID_timer,
     ID_model_selector,
+    ID_task_selector,
+    ID_backend_checkbox,
+    ID_preload_timer,
     ID_model_dl_btn,
     ID_model_dl_close_btn
 };
@@ -52,20 +55,42 @@ public:
     void notify_current_trx_finished();
     std::string get_selected_task() const { return m_task_choices->GetStringSelection().ToStdString(); }
     std::string get_selected_model() const { return m_model_choices->GetStringSelection().ToStdString(); }
+    // English transcription uses the English models and every other task the multilingual ones.
+    ModelType get_selected_model_type() const {
+        return get_selected_task() == "English" ? ModelType::English : ModelType::Multilingual;
+    }
+    /// @brief Loads the selected model in the background, if it is not loaded, so that it is
+    ///  ready by the time a transcription is started. The model preloaded for the previous
+    ///  selection is unloaded so that only the selected model is kept in memory.
+    void preload_selected_model();
     TranscriptionDecoder get_selected_decoder() const {
-        return m_decoding_choices->GetStringSelection().ToStdString() == "Best quality"
-        ? TranscriptionDecoder::BeamSearch
-        : TranscriptionDecoder::Greedy;
+        const std::string selected = m_decoding_choices->GetStringSelection().ToStdString();
+        if (selected == "Best quality")
+            return TranscriptionDecoder::BeamSearch;
+        else if (selected == "Balanced")
+            return TranscriptionDecoder::Adaptive;
+        return TranscriptionDecoder::Greedy;
     }
+    bool get_skip_silence() const { return m_skip_silence_checkbox->IsChecked(); }
 
 private:
     Application& m_app;
     wxChoice *m_model_choices;
     wxChoice *m_task_choices;
     wxChoice *m_decoding_choices;
+    wxCheckBox *m_skip_silence_checkbox;
+    wxCheckBox *m_native_backend_checkbox;
+    wxStaticText *m_model_status_text;
     wxScrolledWindow *m_content_window;
     wxSizer *m_content_sizer;
     wxPanel *m_default_trx_widget;
+    // Delays the preload after a change of the options so that going through the choices
+    // only loads the model that is finally selected.
+    wxTimer m_preload_timer;
+    // The model loaded by the last preload, empty if there was none.
+    std::string m_preloaded_model_name;
+    ModelType m_preloaded_model_type;
+    DecoderBackendType m_preloaded_backend_type;
 
     // Indicates whether a transcription thread is currently running.
     bool m_trx_thread_is_running = false;
@@ -80,6 +105,14 @@ private:
     void on_about(wxCommandEvent &evt);
     void on_audio_add(wxCommandEvent &evt);
     void on_model_choice_update(wxCommandEvent &evt);
+    void on_model_preload_completion(wxThreadEvent &evt);
+    void on_model_preload_fail(wxThreadEvent &evt);
+    void on_preload_timer(wxTimerEvent &evt);
+    void schedule_model_preload();
+    void on_task_choice_update(wxCommandEvent &evt);
+    void on_backend_checkbox_update(wxCommandEvent &evt);
+    void restore_last_used_options();
+    void save_last_used_options() const;
     void on_toolbar_btn_hover(wxMouseEvent &evt);
     void on_toolbar_btn_leave(wxMouseEvent &evt);
     void on_video_add(wxCommandEvent &evt);
@@ -125,6 +158,8 @@ private:
     wxStaticText *m_progbar_text;
     wxStaticText *m_out_fpath_text;
     wxStaticText *m_status_text;
+    // Shows the text of the last transcribed segment while the transcription is running.
+    wxStaticText *m_preview_text;
     // Timer allows us to display indeterminate progress bar when waiting for model loading
     // and audio decoding. 
     wxTimer m_timer;
@@ -135,6 +170,7 @@ private:
     void on_trx_thread_launch(wxThreadEvent& evt);
     void on_trx_thread_start(wxThreadEvent &evt);
     void on_trx_thread_update(TranscriptionUpdateEvent& evt);
+    void on_trx_thread_segment(wxThreadEvent &evt);
     void on_timer_update(wxTimerEvent &evt);
 };
 
@@ -147,7 +183,8 @@ public:
                         std::string &model_name,
                         ModelType model_type,
                         TranscriptionTask task,
-                        TranscriptionDecoder decoder);
+                        TranscriptionDecoder decoder,
+                        bool skip_silence);
     ~TranscriptionThread();
     virtual void *Entry();
 
@@ -158,13 +195,35 @@ private:
     ModelType m_model_type;
     TranscriptionTask m_trx_task;
     TranscriptionDecoder m_decoder;
+    // Whether the parts of the audio without speech are found with the tiny model and skipped.
+    bool m_skip_silence;
+};
+
+// Loads a model in the background. A transcription that needs the model while it is loading
+// waits for this load instead of loading the model again.
+class ModelPreloadThread : public wxThread
+{
+public:
+    ModelPreloadThread(MainWindow *main_window, const std::string &model_name, ModelType model_type);
+    virtual void *Entry();
+
+private:
+    MainWindow *m_main_window;
+    std::string m_model_name;
+    ModelType m_model_type;
 };
 
+// Model preload thread events. The event string holds the name of the model.
+wxDEFINE_EVENT(EVT_MODEL_PRELOAD_COMPLETED, wxThreadEvent);
+wxDEFINE_EVENT(EVT_MODEL_PRELOAD_FAILED, wxThreadEvent);
+
 // Transcription thread events.
 wxDEFINE_EVENT(EVT_TRX_THREAD_LAUNCH, wxThreadEvent);
 wxDEFINE_EVENT(EVT_TRX_THREAD_START, wxThreadEvent);
 wxDEFINE_EVENT(EVT_TRX_THREAD_COMPLETED, wxThreadEvent);
 wxDEFINE_EVENT(EVT_TRX_THREAD_UPDATE, TranscriptionUpdateEvent);
+// The event string holds the text of the segment that was transcribed.
+wxDEFINE_EVENT(EVT_TRX_THREAD_SEGMENT, wxThreadEvent);
 wxDEFINE_EVENT(EVT_TRX_THREAD_FAILED, wxThreadEvent);
 wxDEFINE_EVENT(EVT_TRX_THREAD_MEDIA_DECODING_FAILED, wxThreadEvent);
 
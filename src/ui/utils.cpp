@@ -1,87 +1,9 @@
 #include "utils.h"
 #include "core/log.h"
 
-#include <filesystem>
-
 #include "wx/archive.h"
 #include "wx/wfstream.h"
 
-capgen::ModelsManager::ModelsManager()
-{
-    register_downloaded_models();
-}
-
-std::shared_ptr<capgen::Whisper> capgen::ModelsManager::get_model(std::string &name, capgen::ModelType model_type)
-{
-    for (const auto &model_ptr : m_loaded_models)
-        if (model_ptr->name() == name && model_ptr->model_type() == model_type) {
-            return model_ptr;
-        }
-
-    // If model is not loaded, load it into memory.
-    m_loaded_models.push_back(std::make_shared<capgen::Whisper>(name, model_type));
-    m_registered_models.push_back(name);
-    return m_loaded_models.back();
-}
-
-const std::vector<std::string> &capgen::ModelsManager::get_registered_models() const
-{
-    return m_registered_models;
-}
-
-int capgen::ModelsManager::get_registered_models_length() const
-{
-    return m_registered_models.size();
-}
-
-std::string capgen::ModelsManager::get_default_model_name() const
-{
-    std::string default_model = "base";
-    if (model_is_registered(default_model))
-        return default_model;
-    if (m_registered_models.size() == 0)
-        return "";
-    return m_registered_models.front();
-}
-
-const capgen::ModelInfo& capgen::ModelsManager::get_model_info(const std::string& model_name) const
-{
-    if (model_name == "tiny")
-        return m_tiny_model_info;
-    else if (model_name == "small")
-        return m_small_model_info;
-    return m_base_model_info;
-}
-
-bool capgen::ModelsManager::model_is_registered(const std::string& name) const
-{
-    for (const auto &model_name : m_registered_models)
-        if (model_name == name)
-            return true;
-    return false;
-}
-
-void capgen::ModelsManager::register_downloaded_models()
-{
-    for (const auto &entry : std::filesystem::directory_iterator(m_models_basepath))
-        if (entry.is_directory())
-        {
-            const std::string model_dir = entry.path().string();
-            m_registered_models.push_back(std::string(model_dir.begin() + m_models_basepath.length(), model_dir.end()));
-        }
-}
-
-void capgen::ModelsManager::reload_registered_models()
-{
-    for (const auto &entry : std::filesystem::directory_iterator(m_models_basepath))
-        if (entry.is_directory()) 
-        {
-            const std::string model_dir = entry.path().string();
-            if (!model_is_registered(model_dir))
-                m_registered_models.push_back(std::string(model_dir.begin() + m_models_basepath.length(), model_dir.end()));
-        }
-}
-
 int capgen::b_to_mb(int bytes)
 {
     return (int)((float)bytes / 1000000.0f);
@@ -0,0 +1,104 @@
+#include "core/checkpoint.h"
+#include "testing.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+
+// Checks that a transcription resumes from its checkpoint with its audio, that transcriptions
+// of the same media with other options keep their own checkpoints and that a complete
+// checkpoint is moved to the path it is completed to.
+
+static std::filesystem::path checkpoint_path(const capgen::CheckpointKey &key)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.ckpt", (unsigned long long)capgen::checkpoint_key_hash(key));
+    return std::filesystem::path("./assets/checkpoints") / name;
+}
+
+int main()
+{
+    // The checkpoints are written relative to the working directory.
+    const std::filesystem::path test_dir = std::filesystem::temp_directory_path() / "capgen_test_checkpoint";
+    std::filesystem::remove_all(test_dir);
+    std::filesystem::create_directories(test_dir);
+    std::filesystem::current_path(test_dir);
+
+    const capgen::CheckpointKey key = {0x1234, 1700000000, "tiny", capgen::ModelType::English, capgen::TranscriptionTask::Transcribe,
+                                       capgen::TranscriptionDecoder::Greedy, 77, "", 0.0f, -1.0f, 1.0f,
+                                       4, -1.0f, 2.4f, 16, 3, 12, 6.0f, 0.6f};
+    {
+        capgen::TranscriptionCheckpoint checkpoint(key, false);
+        CHECK(checkpoint.seek() == 0);
+        CHECK(checkpoint.audio().n_frames == 0);
+        // Segments are only recorded after the audio.
+        checkpoint.append(make_segment(0, 30.0f, 0.0f, 2.0f, {50, 51}), nullptr, 1500);
+        checkpoint.record_audio({50259, 9000});
+        checkpoint.append(make_segment(0, 30.0f, 0.0f, 2.0f, {100, 101}), nullptr, 3000);
+        checkpoint.append(make_segment(1, 60.0f, 30.0f, 32.0f, {200, 201}), nullptr, 6000);
+    }
+    // A record cut short by a crash is dropped on restore.
+    {
+        std::FILE *file = std::fopen(checkpoint_path(key).c_str(), "ab");
+        CHECK(file);
+        std::fwrite("\x01\x02\x03", 1, 3, file);
+        std::fclose(file);
+    }
+
+    // The same media with another model or part of the media has its own checkpoint.
+    capgen::CheckpointKey other_key = key;
+    other_key.model_name = "base";
+    other_key.start_time = 10.0f;
+    CHECK(checkpoint_path(other_key) != checkpoint_path(key));
+    {
+        capgen::TranscriptionCheckpoint checkpoint(other_key, false);
+        CHECK(checkpoint.seek() == 0);
+        checkpoint.record_audio({50259, 4000});
+        checkpoint.append(make_segment(0, 30.0f, 0.0f, 2.0f, {300, 301}), nullptr, 1000);
+    }
+
+    {
+        capgen::TranscriptionCheckpoint checkpoint(key, false);
+        CHECK(checkpoint.seek() == 6000);
+        CHECK(checkpoint.audio().language_id == 50259 && checkpoint.audio().n_frames == 9000);
+        CHECK(checkpoint.restored_transcriptions().size() == 2);
+        CHECK(checkpoint.restored_transcriptions()[0].sub_segments[0].m_text_tokens[0] == 100);
+        CHECK(checkpoint.restored_transcriptions()[1].sub_segments[0].m_text_tokens[0] == 200);
+        // The restored audio is kept.
+        checkpoint.record_audio({50260, 100});
+        CHECK(checkpoint.audio().n_frames == 9000);
+
+        // A concurrent transcription with the same key neither restores nor records anything.
+        {
+            capgen::TranscriptionCheckpoint concurrent(key, false);
+            CHECK(concurrent.seek() == 0);
+            CHECK(concurrent.restored_transcriptions().empty());
+            concurrent.record_audio({50259, 9000});
+            concurrent.append(make_segment(5, 180.0f, 150.0f, 152.0f, {500, 501}), nullptr, 9000);
+        }
+
+        checkpoint.append(make_segment(2, 90.0f, 60.0f, 62.0f, {400, 401}), nullptr, 7500);
+        checkpoint.complete("./assets/cache/transcripts/complete.trx");
+    }
+    CHECK(!std::filesystem::exists(checkpoint_path(key)));
+
+    capgen::CheckpointAudio audio;
+    uint32_t seek = 0;
+    std::vector<capgen::SegmentTranscription> transcriptions, translations;
+    CHECK(capgen::read_checkpoint("./assets/cache/transcripts/complete.trx", key, false, audio, seek, transcriptions, translations) > 0);
+    CHECK(audio.n_frames == 9000);
+    CHECK(seek == 7500);
+    CHECK(transcriptions.size() == 3);
+    CHECK(transcriptions[2].sub_segments[0].m_text_tokens[0] == 400);
+
+    {
+        capgen::TranscriptionCheckpoint checkpoint(other_key, false);
+        CHECK(checkpoint.seek() == 1000);
+    }
+
+    std::filesystem::current_path(std::filesystem::temp_directory_path());
+    std::filesystem::remove_all(test_dir);
+    return 0;
+}
@@ -0,0 +1,62 @@
+#include "core/backend.h"
+#include "core/native_decoder.h"
+#include "core/weights.h"
+#include "testing.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <string>
+
+
+// Runs the scripted and the native decoders of the tiny model on the same tokens and audio
+// features and checks that their logits agree, first for a whole sequence and then for a
+// decoding step that reuses the cached keys and values.
+
+// Same tolerance as the parity check of the builds with CAPGEN_CHECK_DECODER_PARITY, see
+// `Whisper::logits`.
+static const float s_TOLERANCE = 1e-2f;
+
+static const char *s_DECODER_PATH = "./assets/models/tiny/decoder.pt";
+static const char *s_DECODER_WEIGHTS_PATH = "./assets/models/tiny/decoder.bin";
+static const char *s_ENCODER_WEIGHTS_PATH = "./assets/models/tiny/encoder.bin";
+
+static float max_diff(const at::Tensor &a, const at::Tensor &b)
+{
+    return (a - b).abs().max().item<float>();
+}
+
+int main()
+{
+    if (!std::filesystem::exists(s_DECODER_PATH) || !std::filesystem::exists(s_DECODER_WEIGHTS_PATH))
+    {
+        std::fprintf(stderr, "The tiny model exported with `--format mmap` is not installed\n");
+        return TEST_SKIPPED;
+    }
+    at::NoGradGuard no_grad;
+    // The scripted decoder only takes the weights file if its weights were stripped at export.
+    const std::string scripted_weights_path = std::filesystem::exists(s_ENCODER_WEIGHTS_PATH) ? s_DECODER_WEIGHTS_PATH : "";
+    capgen::TorchScriptDecoder scripted(s_DECODER_PATH, scripted_weights_path);
+    capgen::NativeDecoder native(s_DECODER_WEIGHTS_PATH);
+
+    const int64_t n_state = capgen::load_weights(s_DECODER_WEIGHTS_PATH).at("positional_embedding").size(1);
+    at::manual_seed(0);
+    const at::Tensor audio_features = at::randn({1, 1500, n_state});
+    // Start of transcript, English, transcribe, no timestamps, then a few text tokens.
+    const at::Tensor tokens = at::tensor({50258, 50259, 50359, 50363, 400, 1169, 2159}, at::kLong).unsqueeze(0);
+
+    const at::Tensor expected = scripted.logits(tokens, audio_features, 0, -1);
+    const at::Tensor actual = native.logits(tokens, audio_features, 0, -1);
+    CHECK(expected.sizes() == actual.sizes());
+    const float prompt_diff = max_diff(expected, actual);
+    std::printf("prompt max_diff=%f\n", prompt_diff);
+    CHECK(prompt_diff < s_TOLERANCE);
+
+    const at::Tensor next_tokens = at::cat({tokens, at::tensor({{264}}, at::kLong)}, 1);
+    const at::Tensor expected_step = scripted.logits(next_tokens, audio_features, 0, 1);
+    const at::Tensor actual_step = native.logits(next_tokens, audio_features, 0, 1);
+    CHECK(expected_step.sizes() == actual_step.sizes());
+    const float step_diff = max_diff(expected_step, actual_step);
+    std::printf("step max_diff=%f\n", step_diff);
+    CHECK(step_diff < s_TOLERANCE);
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include "cli/server.h"
+#include "core/models_manager.h"
+#include "testing.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <thread>
+
+
+// Checks the framing of the messages of the transcription server and its replies to invalid
+// requests, which are answered without running a job, and that it stops with clients
+// connected.
+
+static int connect_to_server(const std::filesystem::path &socket_path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, socket_path.c_str());
+    // The server may not be listening yet.
+    for (int attempt = 0; attempt < 50; ++attempt)
+    {
+        const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (::connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0)
+            return fd;
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return -1;
+}
+
+static void send_frame(int fd, const std::string &payload)
+{
+    const uint32_t size = payload.size();
+    CHECK(::send(fd, &size, sizeof(size), 0) == sizeof(size));
+    CHECK(::send(fd, payload.data(), payload.size(), 0) == (ssize_t)payload.size());
+}
+
+static bool read_exactly(int fd, void *out, size_t n_bytes)
+{
+    char *buf = static_cast<char *>(out);
+    while (n_bytes > 0)
+    {
+        const ssize_t n_read = ::recv(fd, buf, n_bytes, 0);
+        if (n_read <= 0)
+            return false;
+        buf += n_read;
+        n_bytes -= n_read;
+    }
+    return true;
+}
+
+// Returns the payload of the next frame, or an empty string once the server disconnects.
+static std::string receive_frame(int fd)
+{
+    uint32_t size;
+    if (!read_exactly(fd, &size, sizeof(size)))
+        return "";
+    std::string payload(size, '\0');
+    CHECK(read_exactly(fd, payload.data(), size));
+    return payload;
+}
+
+static bool starts_with(const std::string &message, const std::string &prefix)
+{
+    return message.compare(0, prefix.size(), prefix) == 0;
+}
+
+int main()
+{
+    if (!std::filesystem::is_directory("./assets/models"))
+    {
+        std::fprintf(stderr, "The models directory is not installed\n");
+        return TEST_SKIPPED;
+    }
+    const std::filesystem::path socket_path = std::filesystem::temp_directory_path() / "capgen_test_server.sock";
+    capgen::ModelsManager models_manager;
+    capgen::JobOptions default_options;
+    default_options.model_name = models_manager.get_default_model_name();
+    capgen::TranscriptionServer server(socket_path, models_manager, default_options);
+    std::thread server_thread(&capgen::TranscriptionServer::run, &server);
+
+    const int fd = connect_to_server(socket_path);
+    CHECK(fd >= 0);
+
+    send_frame(fd, "hello");
+    CHECK(receive_frame(fd) == "error\nmessage=Unknown request hello");
+    send_frame(fd, "submit\nfile");
+    CHECK(receive_frame(fd) == "error\nmessage=Invalid field in request submit");
+    send_frame(fd, "submit\npriority=1");
+    CHECK(receive_frame(fd) == "error\nmessage=Missing field file");
+    send_frame(fd, "submit\nfile=a.mp4\ncolour=red");
+    CHECK(receive_frame(fd) == "error\nmessage=Unknown field colour");
+    send_frame(fd, "submit\nfile=a.mp4\ntempo=9");
+    CHECK(receive_frame(fd) == "error\nmessage=Invalid value of field tempo: 9");
+    send_frame(fd, "submit\nfile=a.mp4\nstart=20\nend=10");
+    CHECK(receive_frame(fd) == "error\nmessage=The end must be after the start");
+    send_frame(fd, "submit\nfile=a.mp4\nmodel=not-a-model");
+    CHECK(receive_frame(fd) == "error\nmessage=Model not-a-model is not installed");
+    send_frame(fd, "cancel\njob=99");
+    CHECK(receive_frame(fd) == "error\nmessage=Unknown job 99");
+    send_frame(fd, "cancel");
+    CHECK(receive_frame(fd) == "error\nmessage=Missing or invalid field job");
+
+    // None of the invalid jobs was queued.
+    send_frame(fd, "stats");
+    const std::string stats = receive_frame(fd);
+    CHECK(starts_with(stats, "stats\nqueued=0\ncache_hits="));
+    CHECK(stats.find("\ncache_misses=") != std::string::npos);
+
+    // A frame larger than any request disconnects the client.
+    const uint32_t oversized = 1 << 30;
+    CHECK(::send(fd, &oversized, sizeof(oversized), 0) == sizeof(oversized));
+    CHECK(receive_frame(fd).empty());
+    ::close(fd);
+
+    // The server stops with a client still connected, which it disconnects.
+    const int idle_fd = connect_to_server(socket_path);
+    CHECK(idle_fd >= 0);
+    // The reply shows that the client is being served.
+    send_frame(idle_fd, "stats");
+    CHECK(starts_with(receive_frame(idle_fd), "stats\n"));
+    capgen::TranscriptionServer::stop();
+    server_thread.join();
+    CHECK(receive_frame(idle_fd).empty());
+    ::close(idle_fd);
+    return 0;
+}
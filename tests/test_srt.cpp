@@ -0,0 +1,41 @@
+#include "core/decoder.h"
+#include "core/tokenizer.h"
+#include "testing.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// Checks that the captions of a transcript of a part of the media that was sped up are timed
+// in the media, i.e offset by the start of the part and scaled by the tempo.
+
+int main()
+{
+    if (!std::filesystem::exists("./assets/english_vocab"))
+    {
+        std::fprintf(stderr, "The English vocabulary is not installed\n");
+        return TEST_SKIPPED;
+    }
+    const capgen::Tokenizer tokenizer(capgen::TokenizerType::English);
+    const std::vector<capgen::SegmentTranscription> segments = {make_segment(0, 30.0f, 1.0f, 2.5f, {400}),
+                                                                make_segment(1, 30.0f, 0.5f, 3.0f, {401})};
+    const std::filesystem::path srt_path = std::filesystem::temp_directory_path() / "capgen_test_srt.srt";
+    // The part starts at one minute and its audio was sped up by 1.5, so a second of the
+    // transcript is 1.5 seconds of the media.
+    capgen::save_to_srt(segments, tokenizer, srt_path.string(), 60.0f, 1.5f);
+
+    std::ifstream srt_file(srt_path);
+    std::stringstream srt;
+    srt << srt_file.rdbuf();
+    const std::string expected = std::string("1\n00:01:01,500 --> 00:01:03,750\n") + tokenizer.decode_token(400) + "\n\n"
+                               + "2\n00:01:45,750 --> 00:01:49,500\n" + tokenizer.decode_token(401) + "\n\n";
+    if (srt.str() != expected)
+        std::fprintf(stderr, "Expected:\n%s\nGot:\n%s\n", expected.c_str(), srt.str().c_str());
+    CHECK(srt.str() == expected);
+    std::filesystem::remove(srt_path);
+    return 0;
+}
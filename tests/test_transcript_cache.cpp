@@ -0,0 +1,89 @@
+#include "core/cache.h"
+#include "core/checkpoint.h"
+#include "testing.h"
+
+#include <chrono>
+#include <filesystem>
+#include <vector>
+
+
+// Checks that a cached transcript is only found with the key it was cached with, including
+// the modification time of the media, and that the least recently used transcripts are
+// evicted once the cache is full.
+
+static void cache_transcript(const capgen::TranscriptCache &cache, const capgen::CheckpointKey &key)
+{
+    capgen::TranscriptionCheckpoint checkpoint(key, false);
+    checkpoint.record_audio({50259, 3000});
+    checkpoint.append(make_segment(0, 30.0f, 0.0f, 2.0f, {100, 101, 102}), nullptr, 3000);
+    cache.put(checkpoint, key);
+}
+
+static bool is_cached(const capgen::TranscriptCache &cache, const capgen::CheckpointKey &key)
+{
+    std::vector<capgen::SegmentTranscription> transcriptions, translations;
+    return cache.get(key, false, transcriptions, translations) && transcriptions.size() == 1;
+}
+
+// Makes the entry look as if it was last used `age` ago.
+static void set_age(const capgen::TranscriptCache &cache, const capgen::CheckpointKey &key, std::chrono::seconds age)
+{
+    std::filesystem::last_write_time(cache.entry_path(key), std::filesystem::file_time_type::clock::now() - age);
+}
+
+int main()
+{
+    // The checkpoints are written relative to the working directory.
+    const std::filesystem::path test_dir = std::filesystem::temp_directory_path() / "capgen_test_transcript_cache";
+    std::filesystem::remove_all(test_dir);
+    std::filesystem::create_directories(test_dir);
+    std::filesystem::current_path(test_dir);
+
+    const capgen::CheckpointKey key = {0x1234, 1700000000, "tiny", capgen::ModelType::English, capgen::TranscriptionTask::Transcribe,
+                                       capgen::TranscriptionDecoder::Greedy, 77, "", 0.0f, -1.0f, 1.0f,
+                                       4, -1.0f, 2.4f, 16, 3, 12, 6.0f, 0.6f};
+    const capgen::TranscriptCache cache(test_dir / "transcripts");
+    CHECK(!is_cached(cache, key));
+    cache_transcript(cache, key);
+    const uint64_t n_hits = capgen::TranscriptCache::n_hits();
+    CHECK(is_cached(cache, key));
+    CHECK(capgen::TranscriptCache::n_hits() == n_hits + 1);
+
+    // Any change to the media, the models or the options invalidates the transcript.
+    std::vector<capgen::CheckpointKey> other_keys(9, key);
+    other_keys[0].media_hash += 1;
+    other_keys[1].media_mtime += 1;
+    other_keys[2].model_version += 1;
+    other_keys[3].task = capgen::TranscriptionTask::Translate;
+    other_keys[4].segmentation_model_name = "tiny";
+    other_keys[5].end_time = 60.0f;
+    other_keys[6].tempo = 1.25f;
+    other_keys[7].n_beam = 5;
+    other_keys[8].no_speech_threshold = 0.5f;
+    const uint64_t n_misses = capgen::TranscriptCache::n_misses();
+    for (const auto &other_key : other_keys)
+        CHECK(!is_cached(cache, other_key));
+    CHECK(capgen::TranscriptCache::n_misses() == n_misses + other_keys.size());
+
+    // A cache that holds two transcripts evicts the least recently used one for a third.
+    const uint64_t entry_size = std::filesystem::file_size(cache.entry_path(key));
+    const capgen::TranscriptCache small_cache(test_dir / "small_transcripts", entry_size * 5 / 2);
+    capgen::CheckpointKey key_a = key, key_b = key, key_c = key;
+    key_a.media_hash = 1;
+    key_b.media_hash = 2;
+    key_c.media_hash = 3;
+    cache_transcript(small_cache, key_a);
+    cache_transcript(small_cache, key_b);
+    set_age(small_cache, key_a, std::chrono::seconds(20));
+    set_age(small_cache, key_b, std::chrono::seconds(10));
+    // Using a transcript makes it the most recently used.
+    CHECK(is_cached(small_cache, key_a));
+    cache_transcript(small_cache, key_c);
+    CHECK(std::filesystem::exists(small_cache.entry_path(key_a)));
+    CHECK(!std::filesystem::exists(small_cache.entry_path(key_b)));
+    CHECK(std::filesystem::exists(small_cache.entry_path(key_c)));
+
+    std::filesystem::current_path(std::filesystem::temp_directory_path());
+    std::filesystem::remove_all(test_dir);
+    return 0;
+}
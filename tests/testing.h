@@ -0,0 +1,37 @@
+#pragma once
+
+#include "core/decoder.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+
+// Tests are plain executables run by ctest. A failed check prints where it failed and ends
+// the test, and a test whose inputs are not installed returns `TEST_SKIPPED`.
+#define TEST_SKIPPED 77
+
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        if (!(condition)) {                                                               \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            std::exit(1);                                                                 \
+        }                                                                                 \
+    } while (0)
+
+// Returns a segment that ends at `end_time` with a single sub-segment of the given tokens.
+inline capgen::SegmentTranscription make_segment(uint32_t index,
+                                                 float end_time,
+                                                 float sub_segment_start_time,
+                                                 float sub_segment_end_time,
+                                                 const std::vector<uint32_t> &tokens)
+{
+    capgen::SegmentTranscription segment(index, end_time);
+    capgen::TimestampedTranscription sub_segment;
+    sub_segment.m_start_time = sub_segment_start_time;
+    sub_segment.m_end_time = sub_segment_end_time;
+    sub_segment.m_text_tokens = tokens;
+    segment.sub_segments.push_back(sub_segment);
+    return segment;
+}